@@ -0,0 +1,162 @@
+/*******************************************************
+ * Copyright (C) 2025, Aerial Robotics Group, Hong Kong University of Science and Technology
+ * 
+ * This file is part of VINS.
+ * 
+ * Licensed under the GNU General Public License v3.0;
+ * you may not use this file except in compliance with the License.
+ *******************************************************/
+
+// compares the block sparse IntegrationBase propagation against the former dense MatrixXd F/V propagation
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "../factor/integration_base.h"
+#include "../utility/tic_toc.h"
+
+using namespace vins_multi;
+
+// the dense mid-point covariance/jacobian propagation IntegrationBase used before the block sparse kernel
+class DenseIntegration
+{
+  public:
+    DenseIntegration(const IntegrationBase &base) : integration(base) {}
+
+    void repropagate(const Eigen::Vector3d &_linearized_ba, const Eigen::Vector3d &_linearized_bg)
+    {
+        IntegrationBase &it = integration;
+        it.sum_dt = 0.0;
+        it.acc_0 = it.linearized_acc;
+        it.gyr_0 = it.linearized_gyr;
+        it.delta_p.setZero();
+        it.delta_q.setIdentity();
+        it.delta_v.setZero();
+        it.linearized_ba = _linearized_ba;
+        it.linearized_bg = _linearized_bg;
+        it.jacobian.setIdentity();
+        it.covariance.setZero();
+        for (int i = 0; i < static_cast<int>(it.dt_buf.size()); i++)
+            propagate(it.dt_buf[i], it.acc_buf[i], it.gyr_buf[i]);
+    }
+
+    void propagate(double _dt, const Eigen::Vector3d &_acc_1, const Eigen::Vector3d &_gyr_1)
+    {
+        IntegrationBase &it = integration;
+        Vector3d result_delta_p, result_delta_v, result_linearized_ba, result_linearized_bg;
+        Quaterniond result_delta_q;
+        it.midPointIntegration(_dt, it.acc_0, it.gyr_0, _acc_1, _gyr_1, it.delta_p, it.delta_q, it.delta_v,
+                               it.linearized_ba, it.linearized_bg,
+                               result_delta_p, result_delta_q, result_delta_v,
+                               result_linearized_ba, result_linearized_bg, 0);
+
+        const Eigen::Quaterniond &delta_q = it.delta_q;
+        Vector3d w_x = 0.5 * (it.gyr_0 + _gyr_1) - it.linearized_bg;
+        Vector3d a_0_x = it.acc_0 - it.linearized_ba;
+        Vector3d a_1_x = _acc_1 - it.linearized_ba;
+        Matrix3d R_w_x = Utility::skewSymmetric(w_x);
+        Matrix3d R_a_0_x = Utility::skewSymmetric(a_0_x);
+        Matrix3d R_a_1_x = Utility::skewSymmetric(a_1_x);
+
+        MatrixXd F = MatrixXd::Zero(15, 15);
+        F.block<3, 3>(0, 0) = Matrix3d::Identity();
+        F.block<3, 3>(0, 3) = -0.25 * delta_q.toRotationMatrix() * R_a_0_x * _dt * _dt + 
+                              -0.25 * result_delta_q.toRotationMatrix() * R_a_1_x * (Matrix3d::Identity() - R_w_x * _dt) * _dt * _dt;
+        F.block<3, 3>(0, 6) = MatrixXd::Identity(3,3) * _dt;
+        F.block<3, 3>(0, 9) = -0.25 * (delta_q.toRotationMatrix() + result_delta_q.toRotationMatrix()) * _dt * _dt;
+        F.block<3, 3>(0, 12) = -0.25 * result_delta_q.toRotationMatrix() * R_a_1_x * _dt * _dt * -_dt;
+        F.block<3, 3>(3, 3) = Matrix3d::Identity() - R_w_x * _dt;
+        F.block<3, 3>(3, 12) = -1.0 * MatrixXd::Identity(3,3) * _dt;
+        F.block<3, 3>(6, 3) = -0.5 * delta_q.toRotationMatrix() * R_a_0_x * _dt + 
+                              -0.5 * result_delta_q.toRotationMatrix() * R_a_1_x * (Matrix3d::Identity() - R_w_x * _dt) * _dt;
+        F.block<3, 3>(6, 6) = Matrix3d::Identity();
+        F.block<3, 3>(6, 9) = -0.5 * (delta_q.toRotationMatrix() + result_delta_q.toRotationMatrix()) * _dt;
+        F.block<3, 3>(6, 12) = -0.5 * result_delta_q.toRotationMatrix() * R_a_1_x * _dt * -_dt;
+        F.block<3, 3>(9, 9) = Matrix3d::Identity();
+        F.block<3, 3>(12, 12) = Matrix3d::Identity();
+
+        MatrixXd V = MatrixXd::Zero(15,18);
+        V.block<3, 3>(0, 0) =  0.25 * delta_q.toRotationMatrix() * _dt * _dt;
+        V.block<3, 3>(0, 3) =  0.25 * -result_delta_q.toRotationMatrix() * R_a_1_x  * _dt * _dt * 0.5 * _dt;
+        V.block<3, 3>(0, 6) =  0.25 * result_delta_q.toRotationMatrix() * _dt * _dt;
+        V.block<3, 3>(0, 9) =  V.block<3, 3>(0, 3);
+        V.block<3, 3>(3, 3) =  0.5 * MatrixXd::Identity(3,3) * _dt;
+        V.block<3, 3>(3, 9) =  0.5 * MatrixXd::Identity(3,3) * _dt;
+        V.block<3, 3>(6, 0) =  0.5 * delta_q.toRotationMatrix() * _dt;
+        V.block<3, 3>(6, 3) =  0.5 * -result_delta_q.toRotationMatrix() * R_a_1_x  * _dt * 0.5 * _dt;
+        V.block<3, 3>(6, 6) =  0.5 * result_delta_q.toRotationMatrix() * _dt;
+        V.block<3, 3>(6, 9) =  V.block<3, 3>(6, 3);
+        V.block<3, 3>(9, 12) = MatrixXd::Identity(3,3) * _dt;
+        V.block<3, 3>(12, 15) = MatrixXd::Identity(3,3) * _dt;
+
+        it.jacobian = F * it.jacobian;
+        it.covariance = F * it.covariance * F.transpose() + V * it.noise * V.transpose();
+
+        it.delta_p = result_delta_p;
+        it.delta_q = result_delta_q;
+        it.delta_v = result_delta_v;
+        it.delta_q.normalize();
+        it.sum_dt += _dt;
+        it.acc_0 = _acc_1;
+        it.gyr_0 = _gyr_1;
+    }
+
+    IntegrationBase integration;
+};
+
+static double maxRelativeDiff(const Eigen::Matrix<double, 15, 15> &a, const Eigen::Matrix<double, 15, 15> &b)
+{
+    return (a - b).cwiseAbs().maxCoeff() / std::max(b.cwiseAbs().maxCoeff(), 1e-300);
+}
+
+int main(int argc, char **argv)
+{
+    const int imu_rate = argc > 1 ? atoi(argv[1]) : 400;
+    const double window_time = argc > 2 ? atof(argv[2]) : 1.0;
+    const int repeat = argc > 3 ? atoi(argv[3]) : 200;
+
+    imu_info imu;
+    imu.acc_n_ = 0.1;
+    imu.gyr_n_ = 0.01;
+    imu.acc_w_ = 0.001;
+    imu.gyr_w_ = 0.0001;
+
+    const double dt = 1.0 / imu_rate;
+    const int samples = static_cast<int>(window_time * imu_rate);
+
+    auto acc_at = [](double t) { return Eigen::Vector3d(0.3 * sin(2.0 * t), 0.2 * cos(3.0 * t), 9.81 + 0.1 * sin(5.0 * t)); };
+    auto gyr_at = [](double t) { return Eigen::Vector3d(0.5 * sin(1.5 * t), 0.3 * cos(2.5 * t), 0.2 * sin(0.7 * t)); };
+
+    Eigen::Vector3d ba(0.02, -0.01, 0.03), bg(0.001, 0.002, -0.001);
+    IntegrationBase sparse(acc_at(0.0), gyr_at(0.0), ba, bg, imu);
+    for (int i = 1; i <= samples; i++)
+        sparse.push_back(dt, acc_at(i * dt), gyr_at(i * dt));
+
+    DenseIntegration dense(sparse);
+    dense.repropagate(ba, bg);
+
+    printf("samples: %d, imu rate: %d Hz\n", samples, imu_rate);
+    printf("max relative diff jacobian:   %.3e\n", maxRelativeDiff(sparse.jacobian, dense.integration.jacobian));
+    printf("max relative diff covariance: %.3e\n", maxRelativeDiff(sparse.covariance, dense.integration.covariance));
+    printf("max diff delta p/q/v: %.3e %.3e %.3e\n", (sparse.delta_p - dense.integration.delta_p).cwiseAbs().maxCoeff(),
+           (sparse.delta_q.coeffs() - dense.integration.delta_q.coeffs()).cwiseAbs().maxCoeff(),
+           (sparse.delta_v - dense.integration.delta_v).cwiseAbs().maxCoeff());
+
+    TicToc t_dense;
+    for (int i = 0; i < repeat; i++)
+        dense.repropagate(ba, bg);
+    double dense_ms = t_dense.toc();
+
+    TicToc t_sparse;
+    for (int i = 0; i < repeat; i++)
+        sparse.repropagate(ba, bg);
+    double sparse_ms = t_sparse.toc();
+
+    const double total_samples = static_cast<double>(repeat) * samples;
+    printf("dense  propagation: %8.1f ns/sample\n", dense_ms * 1e6 / total_samples);
+    printf("sparse propagation: %8.1f ns/sample\n", sparse_ms * 1e6 / total_samples);
+    printf("speed up: %.2fx\n", dense_ms / sparse_ms);
+
+    return 0;
+}
@@ -0,0 +1,222 @@
+/*******************************************************
+ * Copyright (C) 2025, Aerial Robotics Group, Hong Kong University of Science and Technology
+ *
+ * This file is part of VINS.
+ *
+ * Licensed under the GNU General Public License v3.0;
+ * you may not use this file except in compliance with the License.
+ *******************************************************/
+
+// compares WindowSolver against ceres DENSE_SCHUR + DOGLEG, as optimization() sets it up, on
+// simulated sliding windows with the projection factors of the estimator
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "../factor/window_solver.h"
+#include "../factor/pose_local_parameterization.h"
+#include "../factor/projectionTwoFrameOneCamFactor.h"
+#include "../utility/tic_toc.h"
+
+using namespace vins_multi;
+
+struct Observation
+{
+    int frame;
+    Eigen::Vector3d pt;
+    Eigen::Vector2d velocity;
+};
+
+struct Window
+{
+    std::vector<Eigen::Vector3d> P;
+    std::vector<Eigen::Quaterniond> Q;
+    std::vector<double> inv_depth;
+    std::vector<std::vector<Observation>> obs;
+};
+
+struct State
+{
+    std::vector<std::array<double, 7>> pose;
+    std::array<double, 7> ex_pose;
+    double td;
+    std::vector<double> inv_depth;
+};
+
+static Window simulateWindow(const int frames, const int landmarks, std::mt19937 &rng)
+{
+    std::uniform_real_distribution<double> uni(-1.0, 1.0);
+    std::normal_distribution<double> pixel_noise(0.0, 0.5 / FOCAL_LENGTH);
+
+    Window w;
+    for (int i = 0; i < frames; i++)
+    {
+        const double t = 0.05 * i;
+        w.P.emplace_back(0.5 * t, 0.1 * sin(2.0 * t), 0.05 * cos(3.0 * t));
+        w.Q.push_back(Eigen::Quaterniond(Eigen::AngleAxisd(0.2 * sin(t), Eigen::Vector3d::UnitY()) *
+                                         Eigen::AngleAxisd(0.1 * t, Eigen::Vector3d::UnitX())));
+    }
+
+    while (static_cast<int>(w.obs.size()) < landmarks)
+    {
+        const int start = std::uniform_int_distribution<int>(0, frames - 3)(rng);
+        const int end = std::min(frames - 1, start + std::uniform_int_distribution<int>(2, 15)(rng));
+        const Eigen::Vector3d pt_c(4.0 * uni(rng), 3.0 * uni(rng), 5.5 + 2.5 * uni(rng));
+        const Eigen::Vector3d pt_w = w.Q[start] * pt_c + w.P[start];
+
+        std::vector<Observation> obs;
+        for (int i = start; i <= end; i++)
+        {
+            const Eigen::Vector3d pt_i = w.Q[i].inverse() * (pt_w - w.P[i]);
+            if (pt_i.z() < 1.0)
+                break;
+            Observation o;
+            o.frame = i;
+            o.pt = pt_i / pt_i.z();
+            o.pt.x() += pixel_noise(rng);
+            o.pt.y() += pixel_noise(rng);
+            o.velocity = Eigen::Vector2d(0.1 * uni(rng), 0.1 * uni(rng));
+            obs.push_back(o);
+        }
+        if (obs.size() < 3)
+            continue;
+        w.inv_depth.push_back(1.0 / pt_c.z());
+        w.obs.push_back(obs);
+    }
+    return w;
+}
+
+static State perturbedState(const Window &w, std::mt19937 &rng)
+{
+    std::normal_distribution<double> noise(0.0, 1.0);
+    State s;
+    for (size_t i = 0; i < w.P.size(); i++)
+    {
+        Eigen::Vector3d p = w.P[i];
+        Eigen::Quaterniond q = w.Q[i];
+        if (i > 0)
+        {
+            p += 0.05 * Eigen::Vector3d(noise(rng), noise(rng), noise(rng));
+            q = (q * Utility::deltaQ(0.01 * Eigen::Vector3d(noise(rng), noise(rng), noise(rng)))).normalized();
+        }
+        s.pose.push_back({p.x(), p.y(), p.z(), q.x(), q.y(), q.z(), q.w()});
+    }
+    s.ex_pose = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 1.0};
+    s.td = 0.002;
+    for (auto d : w.inv_depth)
+        s.inv_depth.push_back(d * (1.0 + 0.1 * noise(rng)));
+    return s;
+}
+
+// same blocks, parameterization, fixed first pose and loss as Estimator::buildProblem
+static void buildProblem(ceres::Problem &problem, const Window &w, State &s, ceres::LossFunction *loss_function)
+{
+    for (auto &pose : s.pose)
+        problem.AddParameterBlock(pose.data(), SIZE_POSE, new PoseLocalParameterization());
+    problem.SetParameterBlockConstant(s.pose[0].data());
+    problem.AddParameterBlock(s.ex_pose.data(), SIZE_POSE, new PoseLocalParameterization());
+    problem.SetParameterBlockConstant(s.ex_pose.data());
+    problem.AddParameterBlock(&s.td, 1);
+
+    for (size_t l = 0; l < w.obs.size(); l++)
+    {
+        const Observation &o_i = w.obs[l].front();
+        for (size_t k = 1; k < w.obs[l].size(); k++)
+        {
+            const Observation &o_j = w.obs[l][k];
+            auto f = new ProjectionTwoFrameOneCamFactor(o_i.pt, o_j.pt, o_i.velocity, o_j.velocity, 0.0, 0.0, 0.0, 0.0, 480, 0.0);
+            problem.AddResidualBlock(f, loss_function, s.pose[o_i.frame].data(), s.pose[o_j.frame].data(), s.ex_pose.data(), &s.inv_depth[l], &s.td);
+        }
+    }
+}
+
+static double positionRmse(const Window &w, const State &s)
+{
+    double sum = 0.0;
+    for (size_t i = 0; i < w.P.size(); i++)
+        sum += (Eigen::Vector3d(s.pose[i][0], s.pose[i][1], s.pose[i][2]) - w.P[i]).squaredNorm();
+    return sqrt(sum / w.P.size());
+}
+
+int main(int argc, char **argv)
+{
+    const int landmarks = argc > 1 ? atoi(argv[1]) : 1000;
+    const int windows = argc > 2 ? atoi(argv[2]) : 20;
+    const int iterations = argc > 3 ? atoi(argv[3]) : 10;
+    const unsigned int threads = argc > 4 ? atoi(argv[4]) : std::max(1U, std::thread::hardware_concurrency());
+    const int frames = WINDOW_SIZE;
+
+    ProjectionTwoFrameOneCamFactor::sqrt_info = FOCAL_LENGTH / 1.5 * Eigen::Matrix2d::Identity();
+    ceres::HuberLoss loss_function(1.0);
+    ThreadPool thread_pool(threads);
+    std::mt19937 rng(42);
+
+    double ceres_ms = 0.0, window_ms = 0.0;
+    double ceres_cost = 0.0, window_cost = 0.0, initial_rmse = 0.0, ceres_rmse = 0.0, window_rmse = 0.0;
+    int ceres_steps = 0, window_steps = 0;
+    for (int n = 0; n < windows; n++)
+    {
+        const Window w = simulateWindow(frames, landmarks, rng);
+        const State initial = perturbedState(w, rng);
+        ceres::Problem::Options problem_options;
+        problem_options.loss_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+
+        State s_ceres = initial;
+        {
+            ceres::Problem problem(problem_options);
+            buildProblem(problem, w, s_ceres, &loss_function);
+
+            ceres::Solver::Options options;
+            options.linear_solver_type = ceres::DENSE_SCHUR;
+            options.num_threads = threads;
+            options.trust_region_strategy_type = ceres::DOGLEG;
+            options.max_num_iterations = iterations;
+            ceres::Solver::Summary summary;
+            TicToc t_ceres;
+            ceres::Solve(options, &problem, &summary);
+            ceres_ms += t_ceres.toc();
+            ceres_cost += summary.final_cost;
+            ceres_steps += summary.num_successful_steps + summary.num_unsuccessful_steps;
+        }
+
+        State s_window = initial;
+        {
+            ceres::Problem problem(problem_options);
+            buildProblem(problem, w, s_window, &loss_function);
+
+            WindowSolver solver;
+            WindowSolver::Options options;
+            options.max_num_iterations = iterations;
+            options.max_solver_time_in_seconds = 1e9;
+            options.thread_pool = &thread_pool;
+            WindowSolver::Summary summary;
+            TicToc t_window;
+            if (!solver.solve(problem, std::vector<double *>{&s_window.td}, options, &summary))
+            {
+                printf("window %d: structure not supported\n", n);
+                return 1;
+            }
+            window_ms += t_window.toc();
+            window_cost += summary.final_cost;
+            window_steps += summary.successful_steps + summary.unsuccessful_steps;
+        }
+
+        initial_rmse += positionRmse(w, initial);
+        ceres_rmse += positionRmse(w, s_ceres);
+        window_rmse += positionRmse(w, s_window);
+    }
+
+    printf("windows: %d, frames: %d, landmarks: %d, threads: %u\n", windows, frames, landmarks, threads);
+    printf("initial position rmse: %.4f m\n", initial_rmse / windows);
+    printf("ceres  : %8.2f ms/solve, %5.1f steps, final cost %.4e, position rmse %.4f m\n",
+           ceres_ms / windows, static_cast<double>(ceres_steps) / windows, ceres_cost / windows, ceres_rmse / windows);
+    printf("window : %8.2f ms/solve, %5.1f steps, final cost %.4e, position rmse %.4f m\n",
+           window_ms / windows, static_cast<double>(window_steps) / windows, window_cost / windows, window_rmse / windows);
+    printf("speed up: %.2fx\n", ceres_ms / window_ms);
+    return 0;
+}
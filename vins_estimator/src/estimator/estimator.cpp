@@ -20,6 +20,9 @@ Estimator::Estimator()
     ROS_INFO("init begins");
     initThreadFlag_ = false;
     last_marginalization_info_ = nullptr;
+    problem_ptr_ = nullptr;
+    problem_loss_function_.reset(new ceres::HuberLoss(1.0));
+    problem_pose_parameterization_.reset(new PoseLocalParameterization());
     clearState();
 }
 
@@ -30,6 +33,30 @@ Estimator::~Estimator()
         // processThread_.join();
         // printf("join thread \n");
     }
+
+    // stop the buffers first, so no task keeps draining frames
+    for (auto& img_tracker : img_trackers_)
+        img_tracker->image_buffer_.stop();
+
+    // the backend marginalizes on the pool, stop it before the pool
+    {
+        std::lock_guard<std::mutex> lock(backend_mutex_);
+        backend_running_ = false;
+    }
+    backend_cv_.notify_one();
+    if (backendThread_.joinable())
+        backendThread_.join();
+
+    thread_pool_.reset();
+    MarginalizationInfo::thread_pool = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock(imu_queue_mutex_);
+        imu_propagate_running_ = false;
+    }
+    imu_queue_cv_.notify_one();
+    if (imuPropagateThread_.joinable())
+        imuPropagateThread_.join();
 }
 
 void Estimator::clearState()
@@ -45,6 +72,7 @@ void Estimator::clearState()
     initial_timestamp_ = -1.0;
     initFirstPoseFlag_ = false;
     last_opt_time_ = -1.0;
+    opt_pending_cams_.clear();
 
     first_imu_ = false,
     sum_of_back_ = 0;
@@ -62,10 +90,24 @@ void Estimator::clearState()
     last_marginalization_info_ = nullptr;
     last_marginalization_parameter_blocks_.clear();
 
+    if (problem_ptr_ != nullptr)
+        delete problem_ptr_;
+    problem_ptr_ = nullptr;
+    problem_frames_.clear();
+    problem_imu_.clear();
+    problem_features_.clear();
+    problem_prior_residual_ = nullptr;
+    problem_const_pose_ = nullptr;
+
     img_trackers_.clear();
 
     failure_occur_ = 0;
 
+    mPropagate_.lock();
+    latest_state_updated_ = false;
+    latest_state_valid_ = false;
+    mPropagate_.unlock();
+
     mProcess_.unlock();
 }
 
@@ -86,6 +128,20 @@ void Estimator::setParameter()
         img_trackers_[i]->set_f_manager_cam_info();
     }
 
+    if(thread_pool_ == nullptr){
+        // one worker per camera at least, so all cameras can be tracked at the same time
+        unsigned int worker_num = max(WORKER_NUM, cam_module_size);
+        if(worker_num > WORKER_NUM){
+            ROS_WARN("worker_num %u is less than the number of cameras, use %u workers", WORKER_NUM, worker_num);
+        }
+        thread_pool_.reset(new ThreadPool(worker_num, WORKER_CPU_AFFINITY));
+        MarginalizationInfo::thread_pool = thread_pool_.get();
+    }
+
+    for(auto& img_tracker : img_trackers_){
+        img_tracker->featureTracker_.thread_pool = thread_pool_.get();
+    }
+
 
     ProjectionTwoFrameOneCamFactor::sqrt_info = FOCAL_LENGTH / 1.5 * Matrix2d::Identity();
     ProjectionTwoFrameTwoCamFactor::sqrt_info = FOCAL_LENGTH / 1.5 * Matrix2d::Identity();
@@ -101,14 +157,9 @@ void Estimator::setParameter()
 #ifdef WITH_CUDA
 
     if(USE_GPU){
-        vector<std::thread> init_gpu_thread_vec;
-        for(auto img_tracker : img_trackers_){
-            init_gpu_thread_vec.emplace_back(initTrackerGPU, img_tracker);
-        }
-
-        for(auto& init_gpu_thread : init_gpu_thread_vec){
-            init_gpu_thread.join();
-        }
+        thread_pool_->parallelFor(img_trackers_.size(), [this](int i){
+            initTrackerGPU(img_trackers_[i]);
+        });
     }
 
 #endif
@@ -122,8 +173,137 @@ void Estimator::setParameter()
 }
 
 void Estimator::start_process_thread(){
+    if(!backendThread_.joinable()){
+        backend_running_ = true;
+        backendThread_ = std::thread(&Estimator::processBackend, this);
+    }
+
+    // frames that arrived before the start are picked up here
+    image_process_started_ = true;
     for(unsigned int unique_id = 0; unique_id < img_trackers_.size(); unique_id++){
-        image_process_thread_vec_.emplace_back(&Estimator::processImageBuffer, this, unique_id);
+        scheduleImageProcess(unique_id);
+    }
+
+    if(USE_IMU && !imu_propagate_running_){
+        imu_propagate_running_ = true;
+        imuPropagateThread_ = std::thread(&Estimator::processIMUPropagation, this);
+    }
+}
+
+void Estimator::processIMUPropagation(){
+
+    // imu states after the latest optimized state, propagated again whenever a new one arrives
+    deque<State> imu_states;
+    State last_state;
+    bool propagate_ready = false;
+    int lpf_idx = 0;
+
+    vector<vector<Eigen::Vector3d>> tic;
+    vector<vector<Eigen::Quaterniond>> ric;
+
+    pair<double, Vector6d> imu_sample;
+    State optimized_state;
+
+    while(imu_propagate_running_){
+
+        if(!imu_queue_.pop(imu_sample)){
+            std::unique_lock<std::mutex> lock(imu_queue_mutex_);
+            // the flag is raised before the queue is checked, see inputIMU
+            imu_queue_cv_.wait(lock, [this]{
+                imu_consumer_sleeping_ = true;
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                return !imu_queue_.empty() || !imu_propagate_running_;
+            });
+            imu_consumer_sleeping_ = false;
+            continue;
+        }
+
+        mIMUBuf_.lock();
+        imu_backend_buf_.emplace_back(imu_sample);
+        mIMUBuf_.unlock();
+
+        if(GYRO_RANSAC || GYRO_PREDICTION){
+            std::lock_guard<std::mutex> lock(mGyroBuf_);
+            if(gyro_hist_.empty() || imu_sample.first > gyro_hist_.back().first){
+                gyro_hist_.emplace_back(imu_sample.first, imu_sample.second.bottomRows(3));
+                if(gyro_hist_.size() > IMU_QUEUE_SIZE){
+                    gyro_hist_.pop_front();
+                }
+            }
+        }
+        latest_imu_time_ = imu_sample.first;
+        first_imu_ = true;
+        if(backend_waiting_imu_){
+            std::lock_guard<std::mutex> lock(backend_mutex_);
+            backend_cv_.notify_one();
+        }
+
+        // out of order samples are only inserted by the backend
+        if(!imu_states.empty() && imu_sample.first <= imu_states.back().t_){
+            continue;
+        }
+
+        imu_states.emplace_back();
+        imu_states.back().type_ = State::IMU;
+        imu_states.back().t_ = imu_sample.first;
+        imu_states.back().imu_data_ = imu_sample.second;
+        if(imu_states.size() > IMU_QUEUE_SIZE){
+            imu_states.pop_front();
+        }
+
+        // never wait for the backend, a new state is picked up with the next sample otherwise
+        bool restart = false;
+        if(mPropagate_.try_lock()){
+            if(!latest_state_valid_){
+                propagate_ready = false;
+            }
+            else if(latest_state_updated_){
+                optimized_state = latest_state_;
+                tic = latest_tic_;
+                ric = latest_ric_;
+                latest_state_updated_ = false;
+                restart = true;
+            }
+            mPropagate_.unlock();
+        }
+
+        if(restart){
+            while(!imu_states.empty() && imu_states.front().t_ <= optimized_state.t_){
+                imu_states.pop_front();
+            }
+
+            State base = optimized_state;
+            for(unsigned int i = 0; i + 1 < imu_states.size(); i++){
+                propagateIMU(base, imu_states[i]);
+                base = imu_states[i];
+            }
+
+            // the published odometry is low pass filtered towards the new estimate
+            if(propagate_ready){
+                base.P_lpf_ = last_state.P_lpf_;
+                base.Q_lpf_ = last_state.Q_lpf_;
+                base.V_lpf_ = last_state.V_lpf_;
+            }
+            else{
+                base.P_lpf_ = base.P_;
+                base.Q_lpf_ = base.Q_;
+                base.V_lpf_ = base.V_;
+            }
+
+            last_state = base;
+            lpf_idx = 0;
+            propagate_ready = true;
+        }
+
+        if(!propagate_ready || imu_states.empty()){
+            continue;
+        }
+
+        lpf_idx++;
+        propagateIMULowpass(last_state, imu_states.back(), min(1.0, 0.02*lpf_idx));
+        last_state = imu_states.back();
+
+        pubLatestOdometry(*this, last_state, tic, ric);
     }
 }
 
@@ -139,60 +319,46 @@ void Estimator::initTrackerGPU(shared_ptr<imgTracker> img_tracker){
 
 #endif
 
-void Estimator::inputImageToBuffer(const unsigned int unique_id, double t, const cv::Mat &_img, const cv::Mat &_img1){
+void Estimator::inputImageToBuffer(const unsigned int unique_id, double t, const cv::Mat &_img, const cv::Mat &_img1, shared_ptr<const void> hold, const int color_cvt){
 
     auto& img_tracker = img_trackers_[unique_id];
-    img_tracker->image_buffer_mutex_.lock();
-    img_tracker->image_buffer_.insertImage(t, _img, _img1);
-    img_tracker->image_buffer_mutex_.unlock();
+    if(img_tracker->image_buffer_.insertImage(t, _img, _img1, std::move(hold), color_cvt) > 0 && IMAGE_DROP_POLICY != KEEP_LATEST){
+        ROS_WARN_THROTTLE(1.0, "cam %d image buffer full, dropped %lu of %lu frames", unique_id, img_tracker->image_buffer_.droppedCount(), img_tracker->image_buffer_.receivedCount());
+    }
+
+    if(image_process_started_){
+        scheduleImageProcess(unique_id);
+    }
+}
+
+void Estimator::scheduleImageProcess(const unsigned int unique_id){
+    if(img_trackers_[unique_id]->image_buffer_.schedule()){
+        thread_pool_->submit([this, unique_id]{ processImageBuffer(unique_id); });
+    }
 }
 
 void Estimator::processImageBuffer(const unsigned int unique_id){
 
     auto& img_tracker = img_trackers_[unique_id];
 
-    const std::chrono::duration<double> max_delay_time(0.002); // in seconds
-
-    std::chrono::time_point<std::chrono::system_clock> start_time;
-    std::chrono::duration<double> process_buffer_time;
-
-    while(1){
-
-        start_time = std::chrono::system_clock::now();
-
-        img_tracker->image_buffer_mutex_.lock();
-        auto frame_ptr = img_tracker->image_buffer_.retrieveFrame();
-        img_tracker->image_buffer_mutex_.unlock();
-
-        if(frame_ptr){
-            inputImage(unique_id, frame_ptr->t_, frame_ptr->img_, frame_ptr->img1_);
-
-            img_tracker->image_buffer_mutex_.lock();
-            img_tracker->image_buffer_.releaseImage(frame_ptr);
-            img_tracker->image_buffer_mutex_.unlock();
+    while(auto frame_ptr = img_tracker->image_buffer_.retrieveFrame()){
+        if(frame_ptr->color_cvt_ >= 0){
+            img_tracker->gray_idx_ ^= 1;
+            cv::Mat& gray_img = img_tracker->gray_img_[img_tracker->gray_idx_];
+            cv::cvtColor(frame_ptr->img_, gray_img, frame_ptr->color_cvt_);
+            inputImage(unique_id, frame_ptr->t_, gray_img, frame_ptr->img1_, frame_ptr->arrival_);
         }
-
-        process_buffer_time = std::chrono::system_clock::now() - start_time;
-
-        // if(frame_ptr){
-        //     std::cout<<"process frame in buffer "<<unique_id<<", time: "<<process_buffer_time.count() * 1000<<" ms\n";
-        // }
-        // else{
-        //     std::cout<<"process buffer "<<unique_id<<", time: "<<process_buffer_time.count() * 1000<<" ms\n";
-        // }
-
-
-        if(process_buffer_time < max_delay_time){
-            this_thread::sleep_for(max_delay_time - process_buffer_time);
+        else{
+            inputImage(unique_id, frame_ptr->t_, frame_ptr->img_, frame_ptr->img1_, frame_ptr->arrival_);
         }
-
+        img_tracker->image_buffer_.releaseImage(frame_ptr);
     }
 }
 
-void Estimator::inputImage(const unsigned int unique_id, double t, const cv::Mat &_img, const cv::Mat &_img1)
+void Estimator::inputImage(const unsigned int unique_id, double t, const cv::Mat &_img, const cv::Mat &_img1, const std::chrono::steady_clock::time_point arrival)
 {
     // inputImageCnt_++;
-    map<int, FeaturePerFrame> featurePts;
+    FeatureFrame featurePts;
     TicToc featureTracker_Time;
 
     if(USE_GPU){
@@ -201,7 +367,24 @@ void Estimator::inputImage(const unsigned int unique_id, double t, const cv::Mat
 #endif
     }
     else{
-        featurePts = img_trackers_[unique_id]->featureTracker_.trackImage(t, _img, _img1);
+        if(USE_IMU && (GYRO_RANSAC || GYRO_PREDICTION)){
+            setGyroRotation(unique_id, t);
+        }
+
+        // same test as the first one of CheckKeepImageUpdatePriority, the kept time only grows so
+        // a frame failing it here fails it in the backend as well
+        auto& img_tracker = img_trackers_[unique_id];
+        if(PRE_ADMISSION && t + img_tracker->cam_info_.td_ - img_tracker->last_keep_frame_time_ < MIN_FRAME_INTERVAL_PER_MODULE){
+            img_tracker->featureTracker_.maintainTracks(t, _img);
+            {
+                std::lock_guard<std::mutex> lock(backend_mutex_);
+                backend_queue_.push_back(PendingFrame{unique_id, t, FeatureFrame(), false, arrival});
+            }
+            backend_cv_.notify_one();
+            return;
+        }
+
+        featurePts = img_tracker->featureTracker_.trackImage(t, _img, _img1);
     }
 
     // cout<<"track image time: "<<featureTracker_Time.toc()<<" ms"<<endl;
@@ -214,111 +397,236 @@ void Estimator::inputImage(const unsigned int unique_id, double t, const cv::Mat
         pubTrackImage(imgTrack, t, unique_id);
     }
 
-    double real_img_time = t + img_trackers_[unique_id]->cam_info_.td_;
-
-    // make sure no imu delay
-    int wait_cnt = 0;
-    while(1)
+    // the backend holds the frame until the imu covers it, the worker does not wait
     {
-        if ((!USE_IMU  || IMUAvailable(real_img_time)))
-            break;
-        else
+        std::lock_guard<std::mutex> lock(backend_mutex_);
+        backend_queue_.push_back(PendingFrame{unique_id, t, std::move(featurePts), true, arrival});
+    }
+    backend_cv_.notify_one();
+}
+
+void Estimator::processBackend(){
+    while(true){
         {
-            if(wait_cnt == 0){
-                printf("wait for imu ... \n");
+            std::unique_lock<std::mutex> lock(backend_mutex_);
+            backend_cv_.wait(lock, [this]{ return !backend_running_ || backendFrameReady(); });
+            if(!backend_running_){
+                return;
+            }
+
+            // frames the imu does not cover yet stay queued, per camera they are the latest ones
+            for(auto& frame : backend_queue_){
+                if(frameIMUCovered(frame)){
+                    backend_batch_.push_back(std::move(frame));
+                }
+                else{
+                    backend_held_.push_back(std::move(frame));
+                }
             }
-            std::chrono::milliseconds dura(5);
-            std::this_thread::sleep_for(dura);
+            backend_queue_.swap(backend_held_);
+            backend_held_.clear();
         }
-        wait_cnt++;
-        wait_cnt %= 100;
+
+        // cameras finish tracking in any order, the window only takes increasing times
+        sort(backend_batch_.begin(), backend_batch_.end(), [this](const PendingFrame& a, const PendingFrame& b){
+            return a.t_ + img_trackers_[a.unique_id_]->cam_info_.td_ < b.t_ + img_trackers_[b.unique_id_]->cam_info_.td_;
+        });
+
+        TicToc t_batch;
+        processBatch();
+        ROS_DEBUG("backend batch of %lu frames costs %fms", backend_batch_.size(), t_batch.toc());
+        backend_batch_.clear();
     }
+}
+
+// every frame of the batch is inserted and marginalized as before, only the last one is optimized
+void Estimator::processBatch(){
 
     mBuf_.lock();
+    mProcess_.lock();
+
     if(USE_IMU){
-        if(!initFirstPoseFlag_){
-            if(!IMUInitReady(real_img_time)){
-                mBuf_.unlock();
-                return;
-            }
+        drainIMUBuffer();
+    }
+
+    int last_cam = -1;
+    double last_time = 0.0;
+    bool deferred = false;
+    // arrival of every admitted frame, the earliest one bounds the solve that publishes them all
+    vector<std::chrono::steady_clock::time_point> admitted_arrivals;
+    vector<bool> admitted_cams(img_trackers_.size(), false);
+    vector<bool> published_cams(img_trackers_.size(), false);
+
+    int last_tracked = -1;
+    for(unsigned int i = 0; i < backend_batch_.size(); i++){
+        if(backend_batch_[i].tracked_){
+            last_tracked = i;
         }
-        else{
-            if(real_img_time <= initial_timestamp_){
-                mBuf_.unlock();
-                return;
+    }
+
+    for(unsigned int i = 0; i < backend_batch_.size(); i++){
+        PendingFrame& frame = backend_batch_[i];
+        const unsigned int unique_id = frame.unique_id_;
+        double real_img_time = frame.t_ + img_trackers_[unique_id]->cam_info_.td_;
+
+        if(USE_IMU){
+            if(!initFirstPoseFlag_){
+                if(!IMUInitReady(real_img_time)){
+                    continue;
+                }
+            }
+            else{
+                if(real_img_time <= initial_timestamp_){
+                    continue;
+                }
             }
         }
-    }
 
+        if(!frame.tracked_){
+            recordDroppedFrame(unique_id, real_img_time);
+            continue;
+        }
+
+        if(!CheckKeepImageUpdatePriority(unique_id, real_img_time)){
+            continue;
+        }
 
-    if(!CheckKeepImageUpdatePriority(unique_id, real_img_time)){
-        mBuf_.unlock();
-        return;
-    }
+        State img_state;
+        img_state.type_ = State::IMAGE;
+        img_state.image_frame_ptr_.reset(new ImageFrame{frame.t_, img_trackers_[unique_id]->cam_info_.td_, static_cast<int>(unique_id), std::move(frame.points_)});
+        img_state.t_ = real_img_time;
 
-    State img_state;
-    img_state.type_ = State::IMAGE;
-    img_state.image_frame_ptr_.reset(new ImageFrame{t,img_trackers_[unique_id]->cam_info_.td_, unique_id,featurePts});
-    // ROS_INFO("img_state initial point size: %d", img_state.image_frame_ptr_->points_.size());
-    img_state.t_ = real_img_time;
+        auto img_frame_it =  image_frame_window_.insert(img_state.image_frame_ptr_);
+        list<State>::iterator insert_it = insertState(img_state);
 
-    auto img_frame_it =  image_frame_window_.insert(img_state.image_frame_ptr_);
-    deque<State>::iterator insert_it = insertState(img_state);
+        if(USE_IMU){
+            setImageIMUData(insert_it);
 
-    if(USE_IMU){
-        setImageIMUData(insert_it);
+            if(!initFirstPoseFlag_){
+                initFirstIMUPose(insert_it);
+                initial_timestamp_ = real_img_time;
+                repropagateIMU(insert_it, false);
+                //imu init finish
+            }
+        }
 
-        if(!initFirstPoseFlag_){
-            initFirstIMUPose(insert_it);
-            initial_timestamp_ = real_img_time;
-            repropagateIMU(insert_it, false);
-            //imu init finish
+        // deferring only applies once initialized, the initialization always optimizes
+        const bool defer_opt = static_cast<int>(i) < last_tracked && solver_flag_ == NON_LINEAR;
+        const bool non_linear = solver_flag_ == NON_LINEAR;
+        admitted_arrivals.push_back(frame.arrival_);
+        solve_deadline_ = admitted_arrivals.front() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(LATENCY_BUDGET));
+        solve_deadline_valid_ = LATENCY_BUDGET > 0.0;
+        processImage(insert_it, img_frame_it, defer_opt);
+        deferred = defer_opt;
+        admitted_cams[unique_id] = true;
+        published_cams[unique_id] = non_linear && !defer_opt;
+        last_cam = unique_id;
+        last_time = real_img_time;
+    }
+
+    // the last frame of the batch was dropped, the earlier ones still have to be optimized
+    if(deferred){
+        if(last_time - last_opt_time_ > MIN_OPT_INTERVAL){
+            optimization();
+            last_opt_time_ = last_time;
+            rejectWindowOutliers();
         }
 
+        key_poses_.clear();
+        for(auto frame_it : image_frame_window_.all_image_frame_ptr_){
+            key_poses_.push_back(frame_it.second->T_);
+        }
+        updateLatestStates(last_cam);
+        published_cams[last_cam] = true;
     }
-    TicToc processTime;
-    mProcess_.lock();
-    processImage(insert_it, img_frame_it);
-    mProcess_.unlock();
 
+    // the other cameras of the batch are published from the same optimized window
+    if(solver_flag_ == NON_LINEAR){
+        for(unsigned int unique_id = 0; unique_id < img_trackers_.size(); unique_id++){
+            if(admitted_cams[unique_id] && !published_cams[unique_id]){
+                pubCameraPose(*this, unique_id);
+                pubPointCloud(*this, unique_id);
+            }
+        }
+    }
+
+    // every published frame counts against its own arrival
+    if(solve_deadline_valid_ && solver_flag_ == NON_LINEAR){
+        const auto now = std::chrono::steady_clock::now();
+        for(const auto& arrival : admitted_arrivals){
+            double latency = std::chrono::duration<double>(now - arrival).count();
+            deadline_cnt_++;
+            if(latency > LATENCY_BUDGET){
+                deadline_miss_cnt_++;
+                ROS_WARN_THROTTLE(1.0, "frame latency %f ms over budget, %lu of %lu frames missed", latency * 1e3, deadline_miss_cnt_, deadline_cnt_);
+            }
+        }
+    }
+    solve_deadline_valid_ = false;
+
+    mProcess_.unlock();
     mBuf_.unlock();
-    // printf("process time: %f\n", processTime.toc());
 }
 
 
-void Estimator::inputIMU(double t, const Vector6d &imu_data)
-{
+bool Estimator::frameIMUCovered(const PendingFrame& frame){
+    return !USE_IMU || !frame.tracked_ || IMUAvailable(frame.t_ + img_trackers_[frame.unique_id_]->cam_info_.td_);
+}
 
-    State imu_state;
-    imu_state.imu_data_ = imu_data;
-    imu_state.type_ = State::IMU;
-    imu_state.t_ = t;
+// called with backend_mutex_ held. the flag is raised before the imu time is read, so the propagation
+// thread either sees it and wakes the backend or wrote its sample before the check
+bool Estimator::backendFrameReady(){
+    backend_waiting_imu_ = true;
+    for(auto& frame : backend_queue_){
+        if(frameIMUCovered(frame)){
+            backend_waiting_imu_ = false;
+            return true;
+        }
+    }
+    backend_waiting_imu_ = !backend_queue_.empty();
+    return false;
+}
 
-    first_imu_ = true;
+void Estimator::inputIMU(double t, const Vector6d &imu_data)
+{
+    // never blocks, the backend holds mBuf_ during the whole optimization
+    if(!imu_queue_.push(make_pair(t, imu_data))){
+        ROS_WARN_THROTTLE(1.0, "imu queue full, drop imu at %lf", t);
+        return;
+    }
+    // lock free unless the propagation thread sleeps: it raises the flag before checking the queue,
+    // so either it sees this sample or this sees the flag, and the mutex orders the notify after its wait
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(imu_consumer_sleeping_){
+        {
+            std::lock_guard<std::mutex> lock(imu_queue_mutex_);
+        }
+        imu_queue_cv_.notify_one();
+    }
+}
 
-    // ROS_ERROR("input imu at: %lf", t);
+void Estimator::drainIMUBuffer(){
 
-    mBuf_.lock();
-    auto insert_it = insertState(imu_state);
+    mIMUBuf_.lock();
+    imu_drain_buf_.swap(imu_backend_buf_);
+    mIMUBuf_.unlock();
 
-    if(initFirstPoseFlag_){
-        lpf_idx_++;
-        mPropagate_.lock();
-        repropagateIMU(insert_it, true);
-        mPropagate_.unlock();
-    }
+    for(auto& imu_sample : imu_drain_buf_){
+        State imu_state;
+        imu_state.imu_data_ = imu_sample.second;
+        imu_state.type_ = State::IMU;
+        imu_state.t_ = imu_sample.first;
 
-    if (solver_flag_ == NON_LINEAR)
-    {
-        pubLatestOdometry(*this);
+        auto insert_it = insertState(imu_state);
 
-        // cout<<"propagate imu for "<<t - state_hist_[image_frame_window_.all_image_frame_ptr_.rbegin()->second->state_idx_].t_<<"s"<<endl;
+        if(initFirstPoseFlag_){
+            repropagateIMU(insert_it, false);
+        }
     }
-
-    mBuf_.unlock();
+    imu_drain_buf_.clear();
 }
 
-void Estimator::repropagateIMU(const deque<State>::iterator start_it, const bool low_pass){
+void Estimator::repropagateIMU(const list<State>::iterator start_it, const bool low_pass){
     auto last_it = start_it;
     last_it--;
     for(auto it = start_it; it != state_hist_.end(); it++, last_it++){
@@ -341,8 +649,8 @@ void Estimator::repropagateIMU(const deque<State>::iterator start_it, const bool
     }
 }
 
-void Estimator::setImageIMUData(const deque<State>::iterator img_it){
-    for(deque<State>::reverse_iterator rit(img_it); rit != state_hist_.rend(); rit++){
+void Estimator::setImageIMUData(const list<State>::iterator img_it){
+    for(list<State>::reverse_iterator rit(img_it); rit != state_hist_.rend(); rit++){
         if(rit->type_ == State::IMU){
             img_it->image_frame_ptr_->prev_acc_ = rit->imu_data_.topRows(3);
             img_it->image_frame_ptr_->prev_gyr_ = rit->imu_data_.bottomRows(3);
@@ -364,7 +672,7 @@ void Estimator::setImageIMUData(const deque<State>::iterator img_it){
     }
 }
 
-void Estimator::setImageState(const deque<State>::iterator img_it){
+void Estimator::setImageState(const list<State>::iterator img_it){
     img_it->image_frame_ptr_->R_ = img_it->Q_;
     img_it->image_frame_ptr_->T_ = img_it->P_;
     img_it->image_frame_ptr_->V_ = img_it->V_;
@@ -390,41 +698,55 @@ void Estimator::setStateFromImage(){
     }
 }
 
-deque<State>::iterator Estimator::insertState(const State& state){
-    
-    deque<State>::iterator state_it;
-
-    if(state_hist_.size() == 0 || state.t_ >= state_hist_.back().t_){
-        state_it = state_hist_.insert(state_hist_.end(), state);
+list<State>::iterator Estimator::insertState(const State& state){
 
+    // states mostly arrive in time order, search the position from the back
+    auto insert_pos = state_hist_.end();
+    while(insert_pos != state_hist_.begin() && state.t_ < prev(insert_pos)->t_){
+        insert_pos--;
     }
-    else if(state.t_ < state_hist_.front().t_){
-        state_it = state_hist_.insert(state_hist_.begin(), state);
+
+    // reuse a node of an erased state if there is one
+    list<State>::iterator state_it;
+    if(state_pool_.empty()){
+        state_it = state_hist_.insert(insert_pos, state);
     }
     else{
-        //In the middle
-
-        for(auto rit = state_hist_.rbegin(); rit!= state_hist_.rend(); rit++){
-            if(state.t_ >= rit -> t_){
-
-                state_it = state_hist_.insert(rit.base(), state);
-                break;
-            }
-        }
+        state_hist_.splice(insert_pos, state_pool_, state_pool_.begin());
+        state_it = prev(insert_pos);
+        *state_it = state;
     }
 
     if(state.type_ == State::IMAGE){
+        state_it->image_frame_ptr_->state_it_ = state_it;
+    }
+    else if(insert_pos != state_hist_.end()){
+        imu_insert_epoch_++;
+    }
 
-        state_it->image_frame_ptr_->state_idx_ = std::distance(state_hist_.begin(), state_it);
+    return state_it;
+}
 
-        for(auto frame_it = image_frame_window_.all_image_frame_ptr_.begin(); frame_it != image_frame_window_.all_image_frame_ptr_.end(); frame_it++){
-            if(frame_it->second->t_ + frame_it->second->td_ >state.t_){
-                frame_it->second->state_idx_ ++;
-            }
-        }
+list<State>::iterator Estimator::eraseState(list<State>::iterator state_it){
+    auto next_it = next(state_it);
+    state_it->image_frame_ptr_.reset();
+    state_pool_.splice(state_pool_.end(), state_hist_, state_it);
+    return next_it;
+}
+
+void Estimator::removeOldIMUStates(){
+
+    double remove_imu_min_t = image_frame_window_.all_image_frame_ptr_.begin()->first - 0.01;
+
+    // keep at least 3 states before the first frame
+    auto keep_it = image_frame_window_.all_image_frame_ptr_.begin()->second->state_it_;
+    for(int i = 0; i < 3 && keep_it != state_hist_.begin(); i++){
+        keep_it--;
     }
 
-    return state_it;
+    while(state_hist_.begin() != keep_it && state_hist_.front().t_ < remove_imu_min_t){
+        eraseState(state_hist_.begin());
+    }
 }
 
 void Estimator::updateFeatureTrackerMaxCnt(){
@@ -457,6 +779,12 @@ void Estimator::updateFeatureTrackerMaxCnt(){
     }
 }
 
+// frames dropped before tracking only enter the frame time history, they never touch the kept time or the priority
+void Estimator::recordDroppedFrame(const int cam_unique_id, const double t){
+    img_trackers_[cam_unique_id]->last_frame_time_ = t;
+    img_trackers_[cam_unique_id]->frame_time_hist_.emplace_back(t);
+}
+
 bool Estimator::CheckKeepImageUpdatePriority(const int cam_unique_id, const double t){
 
     double this_priority = img_trackers_[cam_unique_id]->get_total_priority(t);
@@ -580,27 +908,71 @@ bool Estimator::IMUAvailable(double t)
     if(!first_imu_){
         return false;
     }
-    
-    mBuf_.lock();
-    double latest_imu_t = 0.0;
-    for(auto it = state_hist_.rbegin(); it!= state_hist_.rend(); it++){
-        if(it->type_ == State::IMU){
-            latest_imu_t = it->t_;
-            break;
-        }
+
+    return latest_imu_time_ > t;
+}
+
+// midpoint integration of the bias corrected gyro between t0 and t1, samples are interpolated at both ends
+bool Estimator::gyroRotation(const double t0, const double t1, const Eigen::Vector3d &bg, Eigen::Matrix3d &R_0_1)
+{
+    std::lock_guard<std::mutex> lock(mGyroBuf_);
+    if(t1 <= t0 || gyro_hist_.empty() || gyro_hist_.front().first > t0 || gyro_hist_.back().first < t1){
+        return false;
     }
-    bool available = latest_imu_t > t;
-    // cout<<"available: "<<available<<endl;
-    //if(!available){
-        //ROS_WARN("imu t  : %lf", latest_imu_t);
-        //ROS_WARN("image t: %lf", t);
-        //cout<<"dt: "<< latest_imu_t - t<<endl;
-    //}
-    mBuf_.unlock();
 
-    return available;
+    auto interpolate = [](const pair<double, Eigen::Vector3d>& a, const pair<double, Eigen::Vector3d>& b, const double t){
+        double s = (t - a.first) / (b.first - a.first);
+        return Eigen::Vector3d((1.0 - s) * a.second + s * b.second);
+    };
+
+    auto it = upper_bound(gyro_hist_.begin(), gyro_hist_.end(), t0, [](const double t, const pair<double, Eigen::Vector3d>& sample){
+        return t < sample.first;
+    });
+
+    Eigen::Quaterniond q = Eigen::Quaterniond::Identity();
+    double last_t = t0;
+    Eigen::Vector3d last_w = interpolate(*prev(it), *it, t0);
+    for(; it != gyro_hist_.end() && last_t < t1; it++){
+        double cur_t = min(it->first, t1);
+        Eigen::Vector3d cur_w = it->first <= t1 ? it->second : interpolate(*prev(it), *it, t1);
+        q = q * Utility::deltaQ((0.5 * (last_w + cur_w) - bg) * (cur_t - last_t));
+        last_t = cur_t;
+        last_w = cur_w;
+    }
+
+    R_0_1 = q.normalized().toRotationMatrix();
+    return true;
 }
 
+void Estimator::setGyroRotation(const unsigned int unique_id, const double t){
+
+    auto& img_tracker = img_trackers_[unique_id];
+    if(img_tracker->featureTracker_.tracks.size() == 0){
+        return;
+    }
+
+    // bias and extrinsic are taken from the latest optimized state, nothing is known before that
+    Eigen::Vector3d bg;
+    Eigen::Quaterniond ric;
+    {
+        std::lock_guard<std::mutex> lock(mPropagate_);
+        if(!latest_state_valid_){
+            return;
+        }
+        bg = latest_state_.Bg_;
+        ric = latest_ric_[unique_id][0];
+    }
+
+    double td = img_tracker->cam_info_.td_;
+    Eigen::Matrix3d R_prev_cur;
+    if(!gyroRotation(img_tracker->featureTracker_.prev_time + td, t + td, bg, R_prev_cur)){
+        ROS_DEBUG("cam %d no gyro rotation for this frame", unique_id);
+        return;
+    }
+
+    Eigen::Matrix3d R_ic = ric.toRotationMatrix();
+    img_tracker->featureTracker_.setGyroRotation(R_ic.transpose() * R_prev_cur * R_ic);
+}
 
 bool Estimator::IMUInitReady(double img_time){
     for(auto it = state_hist_.begin(); it!=state_hist_.end(); it++)
@@ -619,7 +991,7 @@ bool Estimator::IMUInitReady(double img_time){
     return false;
 }
 
-void Estimator::initFirstIMUPose(const deque<State>::iterator img_it)
+void Estimator::initFirstIMUPose(const list<State>::iterator img_it)
 {
     printf("init first imu pose\n");
     Eigen::Vector3d averAcc(0, 0, 0);
@@ -668,7 +1040,7 @@ void Estimator::initFirstPose(Eigen::Vector3d p, Eigen::Matrix3d r)
 }
 
 
-void Estimator::constructPreintegration(const deque<State>::iterator insert_state_it, const map<double, shared_ptr<ImageFrame>>::iterator insert_frame_it){
+void Estimator::constructPreintegration(const list<State>::iterator insert_state_it, const map<double, shared_ptr<ImageFrame>>::iterator insert_frame_it){
     if(insert_frame_it == image_frame_window_.all_image_frame_ptr_.end()){
         // repeat t or try to insert to the front when not empty, no insertion
         return;
@@ -685,7 +1057,7 @@ void Estimator::constructPreintegration(const deque<State>::iterator insert_stat
 
         auto last_frame_state_it = insert_state_it;
         // ROS_INFO("insert state time: %lf", last_frame_state_it->t_);
-        for(deque<State>::reverse_iterator rit(insert_state_it); rit != state_hist_.rend(); ++rit){
+        for(list<State>::reverse_iterator rit(insert_state_it); rit != state_hist_.rend(); ++rit){
             if(rit->type_ == State::IMAGE){
                 last_frame_state_it = next(rit).base();
                 break;
@@ -695,13 +1067,13 @@ void Estimator::constructPreintegration(const deque<State>::iterator insert_stat
         insert_frame_it->second->pre_integration_.reset(new IntegrationBase{last_frame_state_it->image_frame_ptr_->prev_acc_, last_frame_state_it->image_frame_ptr_->prev_gyr_, last_frame_state_it->Ba_, last_frame_state_it->Bg_, imu_module_});
 
         for(auto it = next(last_frame_state_it); it != next(insert_state_it); ++it){
-            double dt = it->t_ - (it-1)->t_;
+            double dt = it->t_ - prev(it)->t_;
             insert_frame_it->second->pre_integration_->push_back(dt, it->imu_data_.topRows(3), it->imu_data_.bottomRows(3));
             // ROS_WARN("push back integration at time: %lf", it->t_);
         }
 
         // propagate to current frame
-        propagateIMU(*(insert_state_it-1), *insert_state_it);
+        propagateIMU(*prev(insert_state_it), *insert_state_it);
         setImageState(insert_state_it);
 
         // find first imu after frame
@@ -719,8 +1091,8 @@ void Estimator::constructPreintegration(const deque<State>::iterator insert_stat
         }
         else{
             shared_ptr<IntegrationBase> next_frame_integration(new IntegrationBase{insert_state_it->image_frame_ptr_->prev_acc_, insert_state_it->image_frame_ptr_->prev_gyr_, insert_state_it->Ba_, insert_state_it->Bg_, imu_module_});
-            for(auto it = insert_state_it + 1; it != state_hist_.end(); it++){
-                double dt = it->t_ - (it-1)->t_;
+            for(auto it = next(insert_state_it); it != state_hist_.end(); it++){
+                double dt = it->t_ - prev(it)->t_;
                 next_frame_integration->push_back(dt, it->imu_data_.topRows(3), it->imu_data_.bottomRows(3));
                 // ROS_ERROR("push back integration at time: %lf", it->t_);
                 if(it->type_ == State::IMAGE){
@@ -743,45 +1115,73 @@ void Estimator::constructPreintegration(const deque<State>::iterator insert_stat
 
 void Estimator::reconstructPreintegration(){
 
-    bool first_img = true;
-    shared_ptr<IntegrationBase> next_frame_integration;
+    list<State>::iterator last_img_it = state_hist_.end();
     for(auto state_it = state_hist_.begin(); state_it != state_hist_.end(); state_it++){
-        Vector6d& imu_data = state_it->imu_data_;
 
         if(state_it->type_ == State::IMU){
 
-            if(!first_img){
-                next_frame_integration->push_back(state_it->t_ - (state_it-1)->t_, imu_data.topRows(3), imu_data.bottomRows(3));
-                propagateIMU(*(state_it-1), *state_it);
+            if(last_img_it != state_hist_.end()){
+                propagateIMU(*prev(state_it), *state_it);
             }
         }
 
         if(state_it->type_ == State::IMAGE){
 
-            if(!first_img){
+            if(last_img_it != state_hist_.end()){
 
-                next_frame_integration->push_back(state_it->t_ - (state_it-1)->t_, imu_data.topRows(3), imu_data.bottomRows(3));
-                state_it->image_frame_ptr_->pre_integration_ = next_frame_integration;
+                auto& pre_integration = state_it->image_frame_ptr_->pre_integration_;
 
+                // the samples between the two frames did not change, only the ends moved with td and the
+                // linearization bias of the segment has to be updated
+                if(BIAS_CORRECTION && reusePreintegration(last_img_it, state_it)){
+                    pre_integration->updateBias(last_img_it->Ba_, last_img_it->Bg_);
+                }
+                else{
+                    pre_integration.reset(new IntegrationBase{last_img_it->image_frame_ptr_->prev_acc_, last_img_it->image_frame_ptr_->prev_gyr_, last_img_it->Ba_, last_img_it->Bg_, imu_module_});
+                    for(auto it = next(last_img_it); it != next(state_it); it++){
+                        pre_integration->push_back(it->t_ - prev(it)->t_, it->imu_data_.topRows(3), it->imu_data_.bottomRows(3));
+                    }
+                }
+                state_it->image_frame_ptr_->preintegration_span_ = ImageFrame::PreintegrationSpan{pre_integration.get(), last_img_it->t_, state_it->t_,
+                                                                                                   next(last_img_it)->t_, prev(state_it)->t_, imu_insert_epoch_};
             }
 
-            next_frame_integration.reset(new IntegrationBase{state_it->image_frame_ptr_->prev_acc_, state_it->image_frame_ptr_->prev_gyr_, state_it->Ba_, state_it->Bg_, imu_module_});
+            last_img_it = state_it;
+        }
+    }
+}
 
+// O(1) per frame: the summary of the last build tells whether the segment still holds the same imu samples.
+// if so, frames moved by td without passing a sample only shift the ends of the integration
+bool Estimator::reusePreintegration(const list<State>::iterator last_img_it, const list<State>::iterator img_it){
 
-            first_img = false;
-        }
+    const auto& pre_integration = img_it->image_frame_ptr_->pre_integration_;
+    const auto& span = img_it->image_frame_ptr_->preintegration_span_;
+    if(!pre_integration || span.integration != pre_integration.get() || span.imu_epoch != imu_insert_epoch_){
+        return false;
+    }
+
+    const auto first_imu_it = next(last_img_it);
+    const auto last_imu_it = prev(img_it);
+    if(first_imu_it->type_ != State::IMU || last_imu_it->type_ != State::IMU ||
+       first_imu_it->t_ != span.first_imu_t || last_imu_it->t_ != span.last_imu_t){
+        return false;
+    }
+
+    if(last_img_it->t_ != span.t0 || img_it->t_ != span.t1){
+        pre_integration->shiftEnds(last_img_it->t_ - span.t0, img_it->t_ - span.t1);
     }
+    return true;
 }
 
-void Estimator::addPreintegrationToNextFrame(unsigned int remove_frame_state_idx){
+void Estimator::addPreintegrationToNextFrame(const list<State>::iterator start_state_it){
 
-    if(remove_frame_state_idx == 0)
+    if(start_state_it == state_hist_.begin())
         return;
 
-    auto start_state_it = state_hist_.begin() + remove_frame_state_idx;
     auto& next_frame_integration = start_state_it->image_frame_ptr_->pre_integration_;
     for(auto it = next(start_state_it); it != state_hist_.end(); it++){
-        double dt = it->t_ - (it-1)->t_;
+        double dt = it->t_ - prev(it)->t_;
         next_frame_integration->push_back(dt, it->imu_data_.topRows(3), it->imu_data_.bottomRows(3));
         if(it->type_ == State::IMAGE){
             it->image_frame_ptr_->pre_integration_ = next_frame_integration;
@@ -792,7 +1192,7 @@ void Estimator::addPreintegrationToNextFrame(unsigned int remove_frame_state_idx
 
 }
 
-void Estimator::processImage(const deque<State>::iterator img_state_it, const map<double, shared_ptr<ImageFrame>>::iterator img_frame_it)
+void Estimator::processImage(const list<State>::iterator img_state_it, const map<double, shared_ptr<ImageFrame>>::iterator img_frame_it, const bool defer_opt)
 {
     ROS_DEBUG("new image coming ------------------------------------------");
     ROS_DEBUG("Adding feature points %lu", img_state_it->image_frame_ptr_->points_.size());
@@ -802,7 +1202,10 @@ void Estimator::processImage(const deque<State>::iterator img_state_it, const ma
     FeatureManager* f_manager_ptr = &img_trackers_[cam_unique_id]->f_manager_;
 
     TicToc t_add_feature;
-    if ( f_manager_ptr->addFeatureCheckParallax(img_state_it->image_frame_ptr_->points_, img_trackers_[cam_unique_id]->cam_info_.td_))
+    bool is_key_frame = f_manager_ptr->addFeatureCheckParallax(img_state_it->image_frame_ptr_->points_, img_trackers_[cam_unique_id]->cam_info_.td_);
+    // the observations now live in the feature manager, do not keep a second copy in the window
+    FeatureFrame().swap(img_state_it->image_frame_ptr_->points_);
+    if (is_key_frame)
     {
         marginalization_flag_ = MARGIN_OLD;
         img_state_it->image_frame_ptr_->is_key_frame_ = true;
@@ -816,13 +1219,17 @@ void Estimator::processImage(const deque<State>::iterator img_state_it, const ma
     }
     ROS_DEBUG("addFeatureCheckParallax costs: %fms", t_add_feature.toc());
 
+    if(find(opt_pending_cams_.begin(), opt_pending_cams_.end(), cam_unique_id) == opt_pending_cams_.end()){
+        opt_pending_cams_.push_back(cam_unique_id);
+    }
+
 
     ROS_DEBUG("%s", marginalization_flag_ ? "Non-keyframe" : "Keyframe");
     ROS_DEBUG("Solving %d", frame_count_);
     ROS_DEBUG("cam %d, number of feature: %d", cam_unique_id, f_manager_ptr->getFeatureCount());
 
     if(img_frame_it != image_frame_window_.all_image_frame_ptr_.begin())
-        propagateIMU(*(img_state_it-1), *img_state_it);
+        propagateIMU(*prev(img_state_it), *img_state_it);
     setImageState(img_state_it);
     constructPreintegration(img_state_it, img_frame_it);
 
@@ -907,7 +1314,7 @@ void Estimator::processImage(const deque<State>::iterator img_state_it, const ma
                 for (auto& state : state_hist_)
                 {
                     if(state.type_ == State::IMAGE){
-                        state.image_frame_ptr_->pre_integration_->repropagate(zero_vec, state.image_frame_ptr_->Bg_);
+                        state.image_frame_ptr_->pre_integration_->updateBias(zero_vec, state.image_frame_ptr_->Bg_);
                         state.Bg_ = state.image_frame_ptr_->Bg_;
                         last_Bg = state.Bg_;
                     }
@@ -1003,7 +1410,7 @@ void Estimator::processImage(const deque<State>::iterator img_state_it, const ma
                     for (auto& state : state_hist_)
                     {
                         if(state.type_ == State::IMAGE){
-                            state.image_frame_ptr_->pre_integration_->repropagate(zero_vec, state.image_frame_ptr_->Bg_);
+                            state.image_frame_ptr_->pre_integration_->updateBias(zero_vec, state.image_frame_ptr_->Bg_);
                             state.Bg_ = state.image_frame_ptr_->Bg_;
                             last_Bg = state.Bg_;
                         }
@@ -1065,9 +1472,14 @@ void Estimator::processImage(const deque<State>::iterator img_state_it, const ma
         else {
             f_manager_ptr->triangulate(image_frame_window_.cam_wise_image_frame_ptr_[cam_unique_id], img_trackers_[cam_unique_id]->cam_info_.tic_[0], img_trackers_[cam_unique_id]->cam_info_.ric_[0]);
         }
-        processWindow(cam_unique_id);
+        processWindow(cam_unique_id, defer_opt);
         ROS_DEBUG("solver costs: %fms", t_solve.toc());
 
+        // the backend optimizes and publishes once the whole batch is in
+        if(defer_opt){
+            return;
+        }
+
         // if (! MULTIPLE_THREAD)
         // {
         //     featureTracker_ptr->removeOutliers(removeIndex);
@@ -1099,13 +1511,13 @@ inline bool Estimator::needMarginalization(){
     return image_frame_window_.all_image_frame_ptr_.size() >= WINDOW_SIZE;
 }
 
-void Estimator::processWindow(const int img_cam_unique_id){
+void Estimator::processWindow(const int img_cam_unique_id, const bool defer_opt){
 
     TicToc tt;
 
     auto current_frame = image_frame_window_.cam_wise_image_frame_ptr_[img_cam_unique_id].back();
     double current_time = current_frame->t_ + current_frame->td_;
-    bool need_opt = current_time - last_opt_time_ > MIN_OPT_INTERVAL;
+    bool need_opt = !defer_opt && current_time - last_opt_time_ > MIN_OPT_INTERVAL;
 
     if(need_opt){
         // tt.tic();
@@ -1115,6 +1527,10 @@ void Estimator::processWindow(const int img_cam_unique_id){
 
         // cout<<"td "<<img_cam_unique_id<<": "<<current_frame->td_<<endl;
     }
+    else{
+        // the window changed since the last solve, its linearization is no use for the marginalization
+        window_solver_.releaseLinearization();
+    }
 
     // reorderWindow();
     // if(needMarginalization())
@@ -1135,20 +1551,11 @@ void Estimator::processWindow(const int img_cam_unique_id){
 
 
     if(need_opt){
-        tt.tic();
-        FeatureManager* f_manager_ptr = &img_trackers_[img_cam_unique_id]->f_manager_;
-        f_manager_ptr->outliersRejection();
-        f_manager_ptr->removeFailures();
-        ROS_DEBUG("outlier time: %lf ms", tt.toc());
-
-        if(ESTIMATE_TD){
-            reorderWindow();
-            reconstructPreintegration();
-        }
+        rejectWindowOutliers();
     }
 
     if(needMarginalization()){
-        // tt.tic();
+        tt.tic();
         constructMarginalizationFator();
         // printf("marginalization factor time: %lf ms\n", tt.toc());
         // tt.tic();
@@ -1156,10 +1563,32 @@ void Estimator::processWindow(const int img_cam_unique_id){
         slideWindow(frame_to_margin_);
         // printf("slide window time: %lf ms\n", tt.toc());
 
+        // only the marginalization following a solve is on the path to the published state
+        if(need_opt){
+            double margin_time = tt.toc();
+            margin_cost_ = margin_cost_ > 0.0 ? 0.9 * margin_cost_ + 0.1 * margin_time : margin_time;
+        }
     }
 
 }
 
+void Estimator::rejectWindowOutliers(){
+
+    TicToc tt;
+    for(auto cam_unique_id : opt_pending_cams_){
+        FeatureManager* f_manager_ptr = &img_trackers_[cam_unique_id]->f_manager_;
+        f_manager_ptr->outliersRejection();
+        f_manager_ptr->removeFailures();
+    }
+    opt_pending_cams_.clear();
+    ROS_DEBUG("outlier time: %lf ms", tt.toc());
+
+    if(ESTIMATE_TD){
+        reorderWindow();
+        reconstructPreintegration();
+    }
+}
+
 void Estimator::vector2double()
 {
     auto& frame0ptr = image_frame_window_.all_image_frame_ptr_.begin()->second; 
@@ -1187,6 +1616,7 @@ void Estimator::double2vector()
         failure_occur_ = false;
     }
 
+    origin_rot_diff_.setIdentity();
     if(USE_IMU)
     {
         auto para_pose = frame0ptr->para_Pose_;
@@ -1207,6 +1637,7 @@ void Estimator::double2vector()
                                            para_pose[5]).toRotationMatrix().transpose();
         }
 
+        origin_rot_diff_ = rot_diff;
         Vector3d opt_P0 = frame0ptr->T_;
 
         int frame_i = 0;
@@ -1290,17 +1721,81 @@ void Estimator::double2vector()
 //     return false;
 // }
 
-void Estimator::optimization()
-{
-    TicToc t_whole, t_prepare;
-    vector2double();
+void Estimator::addObservationResidual(ceres::Problem* problem, const unsigned int cam_unique_id, FeaturePerId& feature, const int imu_i, const int imu_j,
+                                       FeaturePerFrame& feature_per_frame, vector<ceres::ResidualBlockId>* residual_ids){
+
+    imgTracker& image_tracker = *img_trackers_[cam_unique_id];
+    auto& para_Ex_Pose = image_tracker.cam_info_.para_Ex_Pose_;
+    auto& para_Td = image_tracker.cam_info_.td_;
+    auto& para_Feature = feature.inv_depth;
+
+    const int img_rows = image_tracker.cam_info_.img_height_;
+    const double tr = image_tracker.cam_info_.tr_;
+
+    ceres::LossFunction* loss_function = problem_loss_function_.get();
+
+    auto frame_i_ptr = image_frame_window_.cam_wise_image_frame_ptr_[cam_unique_id][imu_i];
+    auto frame_j_ptr = image_frame_window_.cam_wise_image_frame_ptr_[cam_unique_id][imu_j];
+
+    const FeaturePerFrame& front_per_frame = feature.feature_per_frame.front();
+    Vector3d pts_i = front_per_frame.point;
+    double depth_i = front_per_frame.depth;
+
+    ceres::ResidualBlockId residual_id = nullptr;
+
+    if (imu_i != imu_j)
+    {
+        Vector3d pts_j = feature_per_frame.point;
+        double depth_j = feature_per_frame.depth;
+        if( image_tracker.cam_info_.depth_ && feature_per_frame.is_depth){
+            ProjectionTwoFrameOneCamDepthFactor *f_dep = new ProjectionTwoFrameOneCamDepthFactor(pts_i, pts_j, front_per_frame.velocity, feature_per_frame.velocity,
+                                                        front_per_frame.cur_td, feature_per_frame.cur_td, depth_j, front_per_frame.uv.y(), feature_per_frame.uv.y(), img_rows, tr);
+            residual_id = problem->AddResidualBlock(f_dep, loss_function, frame_i_ptr->para_Pose_, frame_j_ptr->para_Pose_, para_Ex_Pose[0], &para_Feature, &para_Td);
+        }
+        else{
+            ProjectionTwoFrameOneCamFactor *f_td = new ProjectionTwoFrameOneCamFactor(pts_i, pts_j, front_per_frame.velocity, feature_per_frame.velocity,
+                                                        front_per_frame.cur_td, feature_per_frame.cur_td, front_per_frame.uv.y(), feature_per_frame.uv.y(), img_rows, tr);
+            residual_id = problem->AddResidualBlock(f_td, loss_function, frame_i_ptr->para_Pose_, frame_j_ptr->para_Pose_, para_Ex_Pose[0], &para_Feature, &para_Td);
+        }
+        if(residual_ids)
+            residual_ids->emplace_back(residual_id);
+    }
+    else{
+        if(image_tracker.cam_info_.depth_ && feature_per_frame.is_depth){
+            depthFactor *f_dep = new depthFactor(depth_i);
+            residual_id = problem->AddResidualBlock(f_dep, loss_function, &para_Feature);
+            if(residual_ids)
+                residual_ids->emplace_back(residual_id);
+        }
+    }
+
+    if(image_tracker.cam_info_.stereo_ && feature_per_frame.is_stereo)
+    {
+        Vector3d pts_j_right = feature_per_frame.pointRight;
+        if(imu_i != imu_j)
+        {
+            ProjectionTwoFrameTwoCamFactor *f = new ProjectionTwoFrameTwoCamFactor(pts_i, pts_j_right, front_per_frame.velocity, feature_per_frame.velocityRight,
+                                                        front_per_frame.cur_td, feature_per_frame.cur_td);
+            residual_id = problem->AddResidualBlock(f, loss_function, frame_i_ptr->para_Pose_, frame_j_ptr->para_Pose_, para_Ex_Pose[0], para_Ex_Pose[1], &para_Feature, &para_Td);
+        }
+        else
+        {
+            ProjectionOneFrameTwoCamFactor *f = new ProjectionOneFrameTwoCamFactor(pts_i, pts_j_right, front_per_frame.velocity, feature_per_frame.velocityRight,
+                                                        front_per_frame.cur_td, feature_per_frame.cur_td);
+            residual_id = problem->AddResidualBlock(f, loss_function, para_Ex_Pose[0], para_Ex_Pose[1], &para_Feature, &para_Td);
+        }
+        if(residual_ids)
+            residual_ids->emplace_back(residual_id);
+    }
+}
 
-    problem_ptr_ = new ceres::Problem();
-    ceres::LossFunction *loss_function;
-    //loss_function = NULL;
-    loss_function = new ceres::HuberLoss(1.0);
-    //loss_function = new ceres::CauchyLoss(1.0 / FOCAL_LENGTH);
-    //ceres::LossFunction* loss_function = new ceres::HuberLoss(1.0);
+void Estimator::buildProblem(vector<unsigned int>& long_track_feature_num){
+
+    if(problem_ptr_)
+        delete problem_ptr_;
+    ceres::Problem::Options problem_options;
+    problem_options.loss_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+    problem_ptr_ = new ceres::Problem(problem_options);
 
     for(auto frame_it = image_frame_window_.all_image_frame_ptr_.begin(); frame_it != image_frame_window_.all_image_frame_ptr_.end(); frame_it++){
         ceres::LocalParameterization *local_parameterization = new PoseLocalParameterization();
@@ -1315,16 +1810,6 @@ void Estimator::optimization()
     // else
     //     problem_ptr_->SetParameterBlockConstant(image_frame_window_.all_image_frame_ptr_.begin()->second->para_Pose_);
 
-    bool v_enough = true;
-    for(auto& frame_it : image_frame_window_.all_image_frame_ptr_){
-        // auto& v = image_frame_window_.all_image_frame_ptr_.begin()->second->V_;
-        auto& v = frame_it.second->V_;
-        if(v.norm() < 0.2){
-            v_enough = false;
-            break;
-        }
-    }
-
     for (unsigned int cam_unique_id = 0; cam_unique_id < img_trackers_.size(); cam_unique_id++)
     {
         ceres::LocalParameterization *local_parameterization = new PoseLocalParameterization();
@@ -1337,25 +1822,7 @@ void Estimator::optimization()
             problem_ptr_->AddParameterBlock(para_Ex_Pose[1], SIZE_POSE, local_parameterization);
         }
 
-        // if ((ESTIMATE_EXTRINSIC && v_enough))
-        // {
-        //     // ROS_INFO("estimate extinsic param");
-        //     openExEstimation_ = 1;
-        // }
-        // else
-        // {
-        //     // ROS_INFO("fix extinsic param");
-        //     for(unsigned int j = 0; j < para_Ex_Pose.size(); j++){
-        //         problem_ptr_->SetParameterBlockConstant(para_Ex_Pose[j]);
-        //     }
-        // }
-
         problem_ptr_->AddParameterBlock(&para_Td, 1);
-
-
-        // if (!ESTIMATE_TD || !v_enough){
-        //     problem_ptr_->SetParameterBlockConstant(&para_Td);
-        // }
     }
 
     // cout<<"num param blocks: "<< problem_ptr_->NumParameterBlocks()<<endl;
@@ -1369,14 +1836,6 @@ void Estimator::optimization()
                                  last_marginalization_parameter_blocks_);
     }
 
-    // prior factor
-    // if (last_prior_ptr_) {
-    //     // last_prior_ptr_->getKeepParamsPointers();
-    //     problem_ptr_->AddResidualBlock(last_prior_ptr_, nullptr, last_prior_ptr_->getKeepParamsPointers());
-    //     // marginalizer_->addPrior(last_prior_ptr_);
-    // }
-
-
     if(USE_IMU)
     {
         for(auto frame_it = image_frame_window_.all_image_frame_ptr_.begin(); next(frame_it) != image_frame_window_.all_image_frame_ptr_.end(); frame_it++){
@@ -1394,144 +1853,360 @@ void Estimator::optimization()
 
     int f_m_cnt = 0;
     for (unsigned int cam_unique_id = 0; cam_unique_id < img_trackers_.size(); cam_unique_id++){
-        imgTracker& image_tracker = *img_trackers_[cam_unique_id];
-        FeatureManager &f_manager_ref = image_tracker.f_manager_;
-        camera_module_info& cam_info = image_tracker.cam_info_;
-        auto& para_Ex_Pose = img_trackers_[cam_unique_id]->cam_info_.para_Ex_Pose_;
-        auto& para_Td = img_trackers_[cam_unique_id]->cam_info_.td_;
-
-        const int img_rows = img_trackers_[cam_unique_id]->cam_info_.img_height_;
-        const double tr = img_trackers_[cam_unique_id]->cam_info_.tr_;
-
-        unsigned int long_track_feature_num = 0;
-
-        int depth_factor_cnt = 0;
-        int depth_reproj_factor_cnt = 0;
-        int reproj_factor_cnt = 0;
-        int stereo_2f2c_factor_cnt = 0;
-        int stereo_2f1c_factor_cnt = 0;
-
+        FeatureManager &f_manager_ref = img_trackers_[cam_unique_id]->f_manager_;
 
         for (auto &it_per_id : f_manager_ref.feature_)
         {
             if (it_per_id.second.solve_flag != FeaturePerId::LONGTRACK || it_per_id.second.feature_per_frame.size() < 2)
                 continue;
 
-            auto& para_Feature = it_per_id.second.inv_depth;
             it_per_id.second.solve_flag = FeaturePerId::ESTIMATED;
-            long_track_feature_num++;
-
+            long_track_feature_num[cam_unique_id]++;
 
             int imu_i = it_per_id.second.start_frame, imu_j = imu_i - 1;
 
-            auto frame_i_ptr = image_frame_window_.cam_wise_image_frame_ptr_[cam_unique_id][imu_i];
-
-            Vector3d pts_i = it_per_id.second.feature_per_frame.front().point;
-            double depth_i = it_per_id.second.feature_per_frame.front().depth;
-
             for (auto &it_per_frame : it_per_id.second.feature_per_frame)
             {
                 imu_j++;
-                auto frame_j_ptr = image_frame_window_.cam_wise_image_frame_ptr_[cam_unique_id][imu_j];
-                if (imu_i != imu_j)
-                {
-                    Vector3d pts_j = it_per_frame.point;
-                    double depth_j = it_per_frame.depth;
-                    if( image_tracker.cam_info_.depth_ && it_per_frame.is_depth){
-                        ProjectionTwoFrameOneCamDepthFactor *f_dep = new ProjectionTwoFrameOneCamDepthFactor(pts_i, pts_j, it_per_id.second.feature_per_frame.front().velocity, it_per_frame.velocity,
-                                                                    it_per_id.second.feature_per_frame.front().cur_td, it_per_frame.cur_td, depth_j, it_per_id.second.feature_per_frame.front().uv.y(), it_per_frame.uv.y(), img_rows, tr);
-                        problem_ptr_->AddResidualBlock(f_dep, loss_function, frame_i_ptr->para_Pose_, frame_j_ptr->para_Pose_, para_Ex_Pose[0], &para_Feature, &para_Td);
-                        depth_reproj_factor_cnt++;
+                addObservationResidual(problem_ptr_, cam_unique_id, it_per_id.second, imu_i, imu_j, it_per_frame);
+                f_m_cnt++;
+            }
+        }
+    }
+    ROS_DEBUG("visual measurement count: %d", f_m_cnt);
+}
+
+// keep problem_ptr_ alive across solves: drop every residual/parameter block that no longer matches the window first,
+// then add the blocks of new frames, new imu links and new observations of LONGTRACK features.
+// stale frames are held by problem_frames_ until removed, so their addresses can not be reused in between.
+void Estimator::updateIncrementalProblem(vector<unsigned int>& long_track_feature_num){
+
+    if(!problem_ptr_){
+        ceres::Problem::Options problem_options;
+        problem_options.enable_fast_removal = true;
+        problem_options.loss_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+        problem_options.local_parameterization_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+        problem_ptr_ = new ceres::Problem(problem_options);
+
+        for (unsigned int cam_unique_id = 0; cam_unique_id < img_trackers_.size(); cam_unique_id++){
+            auto& para_Ex_Pose = img_trackers_[cam_unique_id]->cam_info_.para_Ex_Pose_;
+            problem_ptr_->AddParameterBlock(para_Ex_Pose[0], SIZE_POSE, problem_pose_parameterization_.get());
+            if(img_trackers_[cam_unique_id]->cam_info_.stereo_){
+                problem_ptr_->AddParameterBlock(para_Ex_Pose[1], SIZE_POSE, problem_pose_parameterization_.get());
+            }
+            problem_ptr_->AddParameterBlock(&img_trackers_[cam_unique_id]->cam_info_.td_, 1);
+        }
+        problem_features_.assign(img_trackers_.size(), unordered_map<int, ProblemFeatureBlock>());
+    }
+
+    auto& all_frames = image_frame_window_.all_image_frame_ptr_;
+
+    unordered_map<ImageFrame*, shared_ptr<ImageFrame>> prev_frame_in_window;
+    shared_ptr<ImageFrame> prev_frame;
+    for(auto& frame_it : all_frames){
+        prev_frame_in_window[frame_it.second.get()] = prev_frame;
+        prev_frame = frame_it.second;
+    }
+
+    // remove stale residuals
+    if(problem_prior_residual_){
+        problem_ptr_->RemoveResidualBlock(problem_prior_residual_);
+        problem_prior_residual_ = nullptr;
+    }
+
+    for(auto imu_it = problem_imu_.begin(); imu_it != problem_imu_.end();){
+        auto prev_it = prev_frame_in_window.find(imu_it->first.get());
+        auto& pre_integration = imu_it->first->pre_integration_;
+        if(prev_it == prev_frame_in_window.end() || prev_it->second != imu_it->second.prev_frame_ ||
+           pre_integration != imu_it->second.pre_integration_ || pre_integration->dt_buf.size() != imu_it->second.imu_num_){
+            problem_ptr_->RemoveResidualBlock(imu_it->second.residual_);
+            imu_it = problem_imu_.erase(imu_it);
+        }
+        else{
+            imu_it++;
+        }
+    }
+
+    for (unsigned int cam_unique_id = 0; cam_unique_id < img_trackers_.size(); cam_unique_id++){
+        auto& f_manager_ref = img_trackers_[cam_unique_id]->f_manager_;
+        auto& cam_frames = image_frame_window_.cam_wise_image_frame_ptr_[cam_unique_id];
+
+        for(auto block_it = problem_features_[cam_unique_id].begin(); block_it != problem_features_[cam_unique_id].end();){
+            auto feature_it = f_manager_ref.feature_.find(block_it->first);
+            bool keep_block = feature_it != f_manager_ref.feature_.end() &&
+                              feature_it->second.solve_flag == FeaturePerId::LONGTRACK &&
+                              feature_it->second.feature_per_frame.size() >= 2 &&
+                              cam_frames[feature_it->second.start_frame] == block_it->second.anchor_frame_;
+
+            if(keep_block){
+                const unsigned int start_frame = feature_it->second.start_frame;
+                const unsigned int end_frame = start_frame + feature_it->second.feature_per_frame.size();
+                for(auto res_it = block_it->second.residuals_.begin(); res_it != block_it->second.residuals_.end();){
+                    bool observed = false;
+                    for(unsigned int i = start_frame; i < end_frame; i++){
+                        if(cam_frames[i] == res_it->first){
+                            observed = true;
+                            break;
+                        }
+                    }
+                    if(observed){
+                        res_it++;
                     }
                     else{
-                        ProjectionTwoFrameOneCamFactor *f_td = new ProjectionTwoFrameOneCamFactor(pts_i, pts_j, it_per_id.second.feature_per_frame.front().velocity, it_per_frame.velocity,
-                                                                    it_per_id.second.feature_per_frame.front().cur_td, it_per_frame.cur_td, it_per_id.second.feature_per_frame.front().uv.y(), it_per_frame.uv.y(), img_rows, tr);
-                        problem_ptr_->AddResidualBlock(f_td, loss_function, frame_i_ptr->para_Pose_, frame_j_ptr->para_Pose_, para_Ex_Pose[0], &para_Feature, &para_Td);
-                        reproj_factor_cnt++;
+                        for(auto residual_id : res_it->second)
+                            problem_ptr_->RemoveResidualBlock(residual_id);
+                        res_it = block_it->second.residuals_.erase(res_it);
                     }
-
                 }
-                else{
-                    if(image_tracker.cam_info_.depth_ && it_per_frame.is_depth){
-                        depthFactor *f_dep = new depthFactor(depth_i);
-                        problem_ptr_->AddResidualBlock(f_dep, loss_function, &para_Feature);
-                        depth_factor_cnt++;
-                    }
+                block_it++;
+            }
+            else{
+                for(auto& res_it : block_it->second.residuals_){
+                    for(auto residual_id : res_it.second)
+                        problem_ptr_->RemoveResidualBlock(residual_id);
                 }
+                if(problem_ptr_->HasParameterBlock(block_it->second.inv_depth_))
+                    problem_ptr_->RemoveParameterBlock(block_it->second.inv_depth_);
+                block_it = problem_features_[cam_unique_id].erase(block_it);
+            }
+        }
+    }
 
-                if(image_tracker.cam_info_.stereo_ && it_per_frame.is_stereo)
-                {
-                    Vector3d pts_j_right = it_per_frame.pointRight;
-                    if(imu_i != imu_j)
-                    {
-                        ProjectionTwoFrameTwoCamFactor *f = new ProjectionTwoFrameTwoCamFactor(pts_i, pts_j_right, it_per_id.second.feature_per_frame.front().velocity, it_per_frame.velocityRight,
-                                                                    it_per_id.second.feature_per_frame.front().cur_td, it_per_frame.cur_td);
-                        problem_ptr_->AddResidualBlock(f, loss_function, frame_i_ptr->para_Pose_, frame_j_ptr->para_Pose_, para_Ex_Pose[0], para_Ex_Pose[1], &para_Feature, &para_Td);
-                        stereo_2f1c_factor_cnt++;
-                    }
-                    else
-                    {
-                        ProjectionOneFrameTwoCamFactor *f = new ProjectionOneFrameTwoCamFactor(pts_i, pts_j_right, it_per_id.second.feature_per_frame.front().velocity, it_per_frame.velocityRight,
-                                                                    it_per_id.second.feature_per_frame.front().cur_td, it_per_frame.cur_td);
-                        problem_ptr_->AddResidualBlock(f, loss_function, para_Ex_Pose[0], para_Ex_Pose[1], &para_Feature, &para_Td);
-                        stereo_2f2c_factor_cnt++;
-                    }
+    // remove stale frames
+    for(auto frame_it = problem_frames_.begin(); frame_it != problem_frames_.end();){
+        if(prev_frame_in_window.count(frame_it->get())){
+            frame_it++;
+            continue;
+        }
+        if(problem_const_pose_ == (*frame_it)->para_Pose_)
+            problem_const_pose_ = nullptr;
+        problem_ptr_->RemoveParameterBlock((*frame_it)->para_Pose_);
+        if(USE_IMU)
+            problem_ptr_->RemoveParameterBlock((*frame_it)->para_SpeedBias_);
+        frame_it = problem_frames_.erase(frame_it);
+    }
 
-                }
+    // add new frames
+    for(auto& frame_it : all_frames){
+        if(problem_frames_.insert(frame_it.second).second){
+            problem_ptr_->AddParameterBlock(frame_it.second->para_Pose_, SIZE_POSE, problem_pose_parameterization_.get());
+            if(USE_IMU)
+                problem_ptr_->AddParameterBlock(frame_it.second->para_SpeedBias_, SIZE_SPEEDBIAS);
+        }
+    }
+
+    double* const_pose = (!USE_IMU || !last_marginalization_info_) ? all_frames.begin()->second->para_Pose_ : nullptr;
+    if(const_pose != problem_const_pose_){
+        if(problem_const_pose_)
+            problem_ptr_->SetParameterBlockVariable(problem_const_pose_);
+        if(const_pose)
+            problem_ptr_->SetParameterBlockConstant(const_pose);
+        problem_const_pose_ = const_pose;
+    }
+
+    if (last_marginalization_info_ && last_marginalization_info_->valid)
+    {
+        MarginalizationFactor *marginalization_factor = new MarginalizationFactor(last_marginalization_info_);
+        problem_prior_residual_ = problem_ptr_->AddResidualBlock(marginalization_factor, NULL,
+                                 last_marginalization_parameter_blocks_);
+    }
+
+    if(USE_IMU)
+    {
+        for(auto frame_it = all_frames.begin(); next(frame_it) != all_frames.end(); frame_it++){
+            auto next_frame_ptr = next(frame_it)->second;
+            auto pre_integration = next_frame_ptr->pre_integration_;
+            if (pre_integration->sum_dt > 10.0 || problem_imu_.count(next_frame_ptr))
+                continue;
+            auto frame_ptr = frame_it->second;
+            IMUFactor* imu_factor = new IMUFactor(pre_integration);
+            ProblemIMUBlock& imu_block = problem_imu_[next_frame_ptr];
+            imu_block.prev_frame_ = frame_ptr;
+            imu_block.pre_integration_ = pre_integration;
+            imu_block.imu_num_ = pre_integration->dt_buf.size();
+            imu_block.residual_ = problem_ptr_->AddResidualBlock(imu_factor, NULL, frame_ptr->para_Pose_, frame_ptr->para_SpeedBias_, next_frame_ptr->para_Pose_, next_frame_ptr->para_SpeedBias_);
+        }
+    }
+
+    int f_m_cnt = 0;
+    for (unsigned int cam_unique_id = 0; cam_unique_id < img_trackers_.size(); cam_unique_id++){
+        auto& cam_frames = image_frame_window_.cam_wise_image_frame_ptr_[cam_unique_id];
+
+        for (auto &it_per_id : img_trackers_[cam_unique_id]->f_manager_.feature_)
+        {
+            if (it_per_id.second.solve_flag != FeaturePerId::LONGTRACK || it_per_id.second.feature_per_frame.size() < 2)
+                continue;
+
+            it_per_id.second.solve_flag = FeaturePerId::ESTIMATED;
+            long_track_feature_num[cam_unique_id]++;
+
+            int imu_i = it_per_id.second.start_frame, imu_j = imu_i - 1;
+
+            auto block_it = problem_features_[cam_unique_id].find(it_per_id.first);
+            if(block_it == problem_features_[cam_unique_id].end()){
+                block_it = problem_features_[cam_unique_id].emplace(it_per_id.first, ProblemFeatureBlock()).first;
+                block_it->second.inv_depth_ = &it_per_id.second.inv_depth;
+                block_it->second.anchor_frame_ = cam_frames[imu_i];
+            }
+
+            for (auto &it_per_frame : it_per_id.second.feature_per_frame)
+            {
+                imu_j++;
+                auto emplace_res = block_it->second.residuals_.emplace(cam_frames[imu_j], vector<ceres::ResidualBlockId>());
+                if(!emplace_res.second)
+                    continue;
+                addObservationResidual(problem_ptr_, cam_unique_id, it_per_id.second, imu_i, imu_j, it_per_frame, &emplace_res.first->second);
                 f_m_cnt++;
             }
         }
+    }
+    ROS_DEBUG("new visual measurement count: %d", f_m_cnt);
+}
+
+void Estimator::optimization()
+{
+    TicToc t_whole, t_prepare;
+    vector2double();
 
-        if(!ESTIMATE_EXTRINSIC || long_track_feature_num < 10 || !v_enough){
+    bool v_enough = true;
+    for(auto& frame_it : image_frame_window_.all_image_frame_ptr_){
+        // auto& v = image_frame_window_.all_image_frame_ptr_.begin()->second->V_;
+        auto& v = frame_it.second->V_;
+        if(v.norm() < 0.2){
+            v_enough = false;
+            break;
+        }
+    }
+
+    vector<unsigned int> long_track_feature_num(img_trackers_.size(), 0);
+
+    if(INCREMENTAL_PROBLEM){
+        updateIncrementalProblem(long_track_feature_num);
+    }
+    else{
+        buildProblem(long_track_feature_num);
+    }
+
+    for (unsigned int cam_unique_id = 0; cam_unique_id < img_trackers_.size(); cam_unique_id++){
+        auto& para_Ex_Pose = img_trackers_[cam_unique_id]->cam_info_.para_Ex_Pose_;
+        auto& para_Td = img_trackers_[cam_unique_id]->cam_info_.td_;
+
+        if(!ESTIMATE_EXTRINSIC || long_track_feature_num[cam_unique_id] < 10 || !v_enough){
             for(unsigned int j = 0; j < para_Ex_Pose.size(); j++){
                 problem_ptr_->SetParameterBlockConstant(para_Ex_Pose[j]);
             }
         }
+        else if(INCREMENTAL_PROBLEM){
+            for(unsigned int j = 0; j < para_Ex_Pose.size(); j++){
+                problem_ptr_->SetParameterBlockVariable(para_Ex_Pose[j]);
+            }
+        }
 
-        if(!ESTIMATE_TD || long_track_feature_num < 10 || !v_enough){
+        if(!ESTIMATE_TD || long_track_feature_num[cam_unique_id] < 10 || !v_enough){
             problem_ptr_->SetParameterBlockConstant(&para_Td);
         }
-
-        // ROS_WARN("cam %d depth_factor_cnt: %d, depth_reproj_factor_cnt: %d, reproj_factor_cnt: %d, long_track_feature_num: %ld, stereo_2f1c_factor_cnt: %d, stereo_2f2c_factor_cnt: %d", cam_unique_id, depth_factor_cnt, depth_reproj_factor_cnt, reproj_factor_cnt, long_track_feature_num, stereo_2f1c_factor_cnt, stereo_2f2c_factor_cnt);
+        else if(INCREMENTAL_PROBLEM){
+            problem_ptr_->SetParameterBlockVariable(&para_Td);
+        }
     }
-    ROS_DEBUG("visual measurement count: %d", f_m_cnt);
     // printf("prepare for ceres: %f \n", t_prepare.toc());
 
     // cout<<"num res blocks: "<< problem_ptr_->NumResidualBlocks()<<endl;
     // cout<<"num res: "<< problem_ptr_->NumResiduals()<<endl;
 
-    ceres::Solver::Options options;
+    double solver_time = marginalization_flag_ == MARGIN_OLD ? SOLVER_TIME * 4.0 / 5.0 : SOLVER_TIME;
+    int num_iterations = NUM_ITERATIONS;
+    if (solve_deadline_valid_)
+        setSolverBudget(solver_time, num_iterations);
+
+    TicToc t_solver;
+    int steps = 0;
+    double minimizer_time = 0.0;
+    bool solved = false;
+    if (WINDOW_SOLVER)
+    {
+        WindowSolver::Options solver_options;
+        solver_options.max_num_iterations = num_iterations;
+        solver_options.max_solver_time_in_seconds = solver_time;
+        solver_options.thread_pool = thread_pool_.get();
+        solver_options.linearize_solution = marginalization_flag_ == MARGIN_OLD;
+
+        vector<double *> td_blocks;
+        for (auto& img_tracker : img_trackers_)
+            td_blocks.push_back(&img_tracker->cam_info_.td_);
+
+        WindowSolver::Summary solver_summary;
+        solved = window_solver_.solve(*problem_ptr_, td_blocks, solver_options, &solver_summary);
+        if (solved)
+        {
+            steps = solver_summary.successful_steps + solver_summary.unsuccessful_steps;
+            minimizer_time = solver_summary.total_time_ms;
+            ROS_DEBUG("window solver cost %f -> %f, %d steps, %d linearizations, %f ms", solver_summary.initial_cost, solver_summary.final_cost,
+                      steps, solver_summary.linearizations, minimizer_time);
+        }
+        else
+            ROS_WARN_THROTTLE(1.0, "window solver cannot handle the problem, solved with ceres");
+    }
+
+    if (!solved)
+    {
+        ceres::Solver::Options options;
 
-    options.linear_solver_type = ceres::DENSE_SCHUR;
-    //options.num_threads = 2;
-    options.trust_region_strategy_type = ceres::DOGLEG;
-    options.max_num_iterations = NUM_ITERATIONS;
+        options.linear_solver_type = ceres::DENSE_SCHUR;
+        options.num_threads = SOLVER_THREAD_NUM;
+        options.trust_region_strategy_type = ceres::DOGLEG;
 
 #ifndef CERES_NO_CUDA
-    options.dense_linear_algebra_library_type = ceres::CUDA;
+        options.dense_linear_algebra_library_type = ceres::CUDA;
 #endif
 
-    //options.use_explicit_schur_complement = true;
-    // options.minimizer_progress_to_stdout = true;
-    //options.use_nonmonotonic_steps = true;
-    if (marginalization_flag_ == MARGIN_OLD)
-        options.max_solver_time_in_seconds = SOLVER_TIME * 4.0 / 5.0;
-    else
-        options.max_solver_time_in_seconds = SOLVER_TIME;
-    TicToc t_solver;
-    ceres::Solver::Summary summary;
-    ceres::Solve(options, problem_ptr_, &summary);
+        //options.use_explicit_schur_complement = true;
+        // options.minimizer_progress_to_stdout = true;
+        //options.use_nonmonotonic_steps = true;
+        options.max_solver_time_in_seconds = solver_time;
+        options.max_num_iterations = num_iterations;
+        ceres::Solver::Summary summary;
+        ceres::Solve(options, problem_ptr_, &summary);
+        steps = summary.num_successful_steps + summary.num_unsuccessful_steps;
+        minimizer_time = summary.minimizer_time_in_seconds * 1e3;
+    }
+
+    if (steps > 0)
+    {
+        double iteration_time = minimizer_time / steps;
+        iteration_cost_ = iteration_cost_ > 0.0 ? 0.9 * iteration_cost_ + 0.1 * iteration_time : iteration_time;
+    }
     // cout << summary.BriefReport() << endl;
     // printf("solver costs: %f \n", t_solver.toc());
     double2vector();
 }
 
 
+// the solve gets what is left of the latency budget of the frame once the marginalization after it is
+// paid, split with the frames already waiting for the backend. the static limits stay the upper bound
+void Estimator::setSolverBudget(double& solver_time, int& num_iterations){
+
+    size_t backlog;
+    {
+        std::lock_guard<std::mutex> lock(backend_mutex_);
+        backlog = backend_queue_.size();
+    }
+
+    double remaining = std::chrono::duration<double>(solve_deadline_ - std::chrono::steady_clock::now()).count() - margin_cost_ * 1e-3;
+    remaining /= 1.0 + backlog;
+
+    solver_time = min(solver_time, max(remaining, MIN_SOLVER_TIME_RATIO * solver_time));
+    if(iteration_cost_ > 0.0){
+        num_iterations = min(NUM_ITERATIONS, max(1, static_cast<int>(solver_time * 1e3 / iteration_cost_)));
+    }
+    ROS_DEBUG("solver budget %f ms, %d iterations, backlog %lu", solver_time * 1e3, num_iterations, backlog);
+}
+
 void Estimator::constructMarginalizationFator(){
 
     TicToc t_whole_marginalization;
     int img_cam_unique_id = frame_to_margin_->cam_module_unique_id_;
-    ceres::LossFunction* loss_function = new ceres::HuberLoss(1.0);
+    ceres::LossFunction* loss_function = problem_loss_function_.get();
     if (marginalization_flag_ == MARGIN_OLD)
     {
         MarginalizationInfo *marginalization_info = new MarginalizationInfo();
@@ -1548,7 +2223,7 @@ void Estimator::constructMarginalizationFator(){
             }
             // construct new marginlization_factor
             MarginalizationFactor *marginalization_factor = new MarginalizationFactor(last_marginalization_info_);
-            ResidualBlockInfo *residual_block_info = new ResidualBlockInfo(marginalization_factor, NULL,
+            ResidualBlockInfo *residual_block_info = ResidualBlockInfo::create(marginalization_factor, NULL,
                                                                            last_marginalization_parameter_blocks_,
                                                                            drop_set);
             marginalization_info->addResidualBlockInfo(residual_block_info);
@@ -1563,9 +2238,9 @@ void Estimator::constructMarginalizationFator(){
             if (frame1ptr->pre_integration_->sum_dt < 10.0)
             {
                 IMUFactor* imu_factor = new IMUFactor(frame1ptr->pre_integration_);
-                ResidualBlockInfo *residual_block_info = new ResidualBlockInfo(imu_factor, NULL,
-                                                                           vector<double *>{frame0ptr->para_Pose_, frame0ptr->para_SpeedBias_, frame1ptr->para_Pose_, frame1ptr->para_SpeedBias_},
-                                                                           vector<int>{0, 1});
+                ResidualBlockInfo *residual_block_info = ResidualBlockInfo::create(imu_factor, NULL,
+                                                                           {frame0ptr->para_Pose_, frame0ptr->para_SpeedBias_, frame1ptr->para_Pose_, frame1ptr->para_SpeedBias_},
+                                                                           {0, 1});
                 marginalization_info->addResidualBlockInfo(residual_block_info);
             }
         }
@@ -1613,26 +2288,26 @@ void Estimator::constructMarginalizationFator(){
                         if(image_tracker.cam_info_.depth_ && it_per_frame.is_depth){
                             ProjectionTwoFrameOneCamDepthFactor *f_dep = new ProjectionTwoFrameOneCamDepthFactor(pts_i, pts_j, it_per_id.second.feature_per_frame.front().velocity, it_per_frame.velocity,
                                                                  it_per_id.second.feature_per_frame.front().cur_td, it_per_frame.cur_td, depth_j, it_per_id.second.feature_per_frame.front().uv.y(), it_per_frame.uv.y(), img_rows, tr);
-                            ResidualBlockInfo *residual_block_info = new ResidualBlockInfo(f_dep, loss_function,
-                                                                                        vector<double *>{frame_i_ptr->para_Pose_, frame_j_ptr->para_Pose_, para_Ex_Pose[0], &para_Feature, &para_Td},
-                                                                                        vector<int>{0, 3});
+                            ResidualBlockInfo *residual_block_info = ResidualBlockInfo::create(f_dep, loss_function,
+                                                                                        {frame_i_ptr->para_Pose_, frame_j_ptr->para_Pose_, para_Ex_Pose[0], &para_Feature, &para_Td},
+                                                                                        {0, 3});
                             marginalization_info->addResidualBlockInfo(residual_block_info);
                         }
                         else{
                             ProjectionTwoFrameOneCamFactor *f_td = new ProjectionTwoFrameOneCamFactor(pts_i, pts_j, it_per_id.second.feature_per_frame.front().velocity, it_per_frame.velocity,
                                                                           it_per_id.second.feature_per_frame.front().cur_td, it_per_frame.cur_td, it_per_id.second.feature_per_frame.front().uv.y(), it_per_frame.uv.y(), img_rows, tr);
-                            ResidualBlockInfo *residual_block_info = new ResidualBlockInfo(f_td, loss_function,
-                                                                                        vector<double *>{frame_i_ptr->para_Pose_, frame_j_ptr->para_Pose_, para_Ex_Pose[0], &para_Feature, &para_Td},
-                                                                                        vector<int>{0, 3});
+                            ResidualBlockInfo *residual_block_info = ResidualBlockInfo::create(f_td, loss_function,
+                                                                                        {frame_i_ptr->para_Pose_, frame_j_ptr->para_Pose_, para_Ex_Pose[0], &para_Feature, &para_Td},
+                                                                                        {0, 3});
                             marginalization_info->addResidualBlockInfo(residual_block_info);
                         }
                     }
                     else{
                         if(image_tracker.cam_info_.depth_ && it_per_frame.is_depth){
                             depthFactor *f_dep = new depthFactor(depth_i);
-                            ResidualBlockInfo *residual_block_info = new ResidualBlockInfo(f_dep, loss_function,
-                                                                                        vector<double *>{&para_Feature},
-                                                                                        vector<int>{0});
+                            ResidualBlockInfo *residual_block_info = ResidualBlockInfo::create(f_dep, loss_function,
+                                                                                        {&para_Feature},
+                                                                                        {0});
                             marginalization_info->addResidualBlockInfo(residual_block_info);
                         }
                     }
@@ -1644,18 +2319,18 @@ void Estimator::constructMarginalizationFator(){
                         {
                             ProjectionTwoFrameTwoCamFactor *f = new ProjectionTwoFrameTwoCamFactor(pts_i, pts_j_right, it_per_id.second.feature_per_frame.front().velocity, it_per_frame.velocityRight,
                                                                           it_per_id.second.feature_per_frame.front().cur_td, it_per_frame.cur_td);
-                            ResidualBlockInfo *residual_block_info = new ResidualBlockInfo(f, loss_function,
-                                                                                           vector<double *>{frame_i_ptr->para_Pose_, frame_j_ptr->para_Pose_, para_Ex_Pose[0], para_Ex_Pose[1], &para_Feature, &para_Td},
-                                                                                           vector<int>{0, 4});
+                            ResidualBlockInfo *residual_block_info = ResidualBlockInfo::create(f, loss_function,
+                                                                                           {frame_i_ptr->para_Pose_, frame_j_ptr->para_Pose_, para_Ex_Pose[0], para_Ex_Pose[1], &para_Feature, &para_Td},
+                                                                                           {0, 4});
                             marginalization_info->addResidualBlockInfo(residual_block_info);
                         }
                         else
                         {
                             ProjectionOneFrameTwoCamFactor *f = new ProjectionOneFrameTwoCamFactor(pts_i, pts_j_right, it_per_id.second.feature_per_frame.front().velocity, it_per_frame.velocityRight,
                                                                           it_per_id.second.feature_per_frame.front().cur_td, it_per_frame.cur_td);
-                            ResidualBlockInfo *residual_block_info = new ResidualBlockInfo(f, loss_function,
-                                                                                           vector<double *>{para_Ex_Pose[0], para_Ex_Pose[1], &para_Feature, &para_Td},
-                                                                                           vector<int>{2});
+                            ResidualBlockInfo *residual_block_info = ResidualBlockInfo::create(f, loss_function,
+                                                                                           {para_Ex_Pose[0], para_Ex_Pose[1], &para_Feature, &para_Td},
+                                                                                           {2});
                             marginalization_info->addResidualBlockInfo(residual_block_info);
                         }
                     }
@@ -1664,6 +2339,7 @@ void Estimator::constructMarginalizationFator(){
         }
 
         TicToc t_pre_margin;
+        takeSolverLinearization(marginalization_info);
         marginalization_info->preMarginalize();
         ROS_DEBUG("pre marginalization %f ms", t_pre_margin.toc());
 
@@ -1717,7 +2393,7 @@ void Estimator::constructMarginalizationFator(){
                 }
                 // construct new marginlization_factor
                 MarginalizationFactor *marginalization_factor = new MarginalizationFactor(last_marginalization_info_);
-                ResidualBlockInfo *residual_block_info = new ResidualBlockInfo(marginalization_factor, NULL,
+                ResidualBlockInfo *residual_block_info = ResidualBlockInfo::create(marginalization_factor, NULL,
                                                                                last_marginalization_parameter_blocks_,
                                                                                drop_set);
 
@@ -1769,39 +2445,47 @@ void Estimator::constructMarginalizationFator(){
 
 }
 
+// the visual factors of the marginalization are the ones the window solver just linearized at the solution.
+// double2vector turned the window about the origin since, which leaves the visual residuals as they are but
+// turns the position jacobians of the frame poses with it
+void Estimator::takeSolverLinearization(MarginalizationInfo* marginalization_info){
+
+    unordered_set<const double*> frame_poses;
+    for(auto& frame_it : image_frame_window_.all_image_frame_ptr_)
+        frame_poses.insert(frame_it.second->para_Pose_);
+
+    int linearized_cnt = 0;
+    for(auto factor : marginalization_info->factors){
+        if(!window_solver_.takeLinearization(*factor))
+            continue;
+
+        if(USE_IMU){
+            for(unsigned int i = 0; i < factor->parameter_blocks.size(); i++){
+                if(frame_poses.count(factor->parameter_blocks[i]))
+                    factor->jacobians[i].leftCols(3) = factor->jacobians[i].leftCols(3) * origin_rot_diff_.transpose();
+            }
+        }
+        factor->linearized = true;
+        linearized_cnt++;
+    }
+    ROS_DEBUG("marginalization factors linearized by the solver: %d / %lu", linearized_cnt, marginalization_info->factors.size());
+}
 
 void Estimator::slideWindow(const int img_cam_unique_id){
 
     if(marginalization_flag_ == MARGIN_OLD){
         img_trackers_[img_cam_unique_id]->f_manager_.removeFront();
-        unsigned int remove_state_idx = image_frame_window_.pop_front(img_cam_unique_id);
-        state_hist_.erase(state_hist_.begin() + remove_state_idx);
+        auto remove_state_it = image_frame_window_.pop_front(img_cam_unique_id);
+        eraseState(remove_state_it);
 
     }
     else if(marginalization_flag_ == MARGIN_SECOND_NEW){
         img_trackers_[img_cam_unique_id]->f_manager_.removeSecondBack();
-        unsigned int remove_state_idx = image_frame_window_.erase_second_new(img_cam_unique_id);
-        state_hist_.erase(state_hist_.begin() + remove_state_idx);
-    }
-
-
-    double remove_imu_min_t = image_frame_window_.all_image_frame_ptr_.begin()->first - 0.01;
-
-    int remove_imu_cnt = 0;
-
-    int max_remove_num = image_frame_window_.all_image_frame_ptr_.begin()->second->state_idx_ - 3;
-
-    for(; state_hist_.front().t_ < remove_imu_min_t; state_hist_.pop_front(), remove_imu_cnt++){
-        if(remove_imu_cnt >= max_remove_num){
-            break;
-        }
+        auto remove_state_it = image_frame_window_.erase_second_new(img_cam_unique_id);
+        eraseState(remove_state_it);
     }
 
-    if(remove_imu_cnt > 0){
-        for(auto frame_it = image_frame_window_.all_image_frame_ptr_.begin(); frame_it != image_frame_window_.all_image_frame_ptr_.end(); frame_it++){
-            frame_it->second->state_idx_ -= remove_imu_cnt;
-        }
-    }
+    removeOldIMUStates();
 }
 
 void Estimator::slideWindow(shared_ptr<ImageFrame>& frame_ptr){
@@ -1821,53 +2505,34 @@ void Estimator::slideWindow(shared_ptr<ImageFrame>& frame_ptr){
     }
 
     img_trackers_[cam_unique_id]->f_manager_.remove(cam_wise_idx);
-    unsigned int remove_state_idx = image_frame_window_.erase(cam_unique_id, cam_wise_idx);
+    auto remove_state_it = image_frame_window_.erase(cam_unique_id, cam_wise_idx);
 
-    double remove_time = state_hist_[remove_state_idx].t_;
+    double remove_time = remove_state_it->t_;
 
     if(image_frame_window_.all_image_frame_ptr_.rbegin()->first > remove_time && image_frame_window_.all_image_frame_ptr_.begin()->first < remove_time){
         tt.tic();
-        addPreintegrationToNextFrame(remove_state_idx);
+        addPreintegrationToNextFrame(remove_state_it);
         // ROS_INFO("add pre integration to next frame time: %lf ms", tt.toc());
     }
 
-    state_hist_.erase(state_hist_.begin() + remove_state_idx);
+    eraseState(remove_state_it);
 
-
-    double remove_imu_min_t = image_frame_window_.all_image_frame_ptr_.begin()->first - 0.01;
-
-    int remove_imu_cnt = 0;
-
-    int max_remove_num = image_frame_window_.all_image_frame_ptr_.begin()->second->state_idx_ - 3;
-
-    for(; state_hist_.front().t_ < remove_imu_min_t; state_hist_.pop_front(), remove_imu_cnt++){
-        if(remove_imu_cnt >= max_remove_num){
-            break;
-        }
-    }
-
-    if(remove_imu_cnt > 0){
-        for(auto frame_it = image_frame_window_.all_image_frame_ptr_.begin(); frame_it != image_frame_window_.all_image_frame_ptr_.end(); frame_it++){
-            frame_it->second->state_idx_ -= remove_imu_cnt;
-        }
-    }
+    removeOldIMUStates();
 }
 
 void Estimator::reorderWindow(){
 
     image_frame_window_.reorder();
-    std::sort(state_hist_.begin(), state_hist_.end(), State::compare);
+    // stable, the state handles of the frames stay valid
+    state_hist_.sort(State::compare);
 
-    unsigned int state_idx = 0;
     Vector6d& prev_imu_data = state_hist_.begin()->imu_data_;
     auto img_state_it = state_hist_.begin();
     bool img_flag = false;
 
-    for(auto state_it = state_hist_.begin(); state_it != state_hist_.end(); state_it++, state_idx++){
+    for(auto state_it = state_hist_.begin(); state_it != state_hist_.end(); state_it++){
 
         if(state_it->type_ == State::IMAGE){
-            state_it->image_frame_ptr_->state_idx_ = state_idx;
-
             state_it->image_frame_ptr_->prev_acc_ = prev_imu_data.topRows(3);
             state_it->image_frame_ptr_->prev_gyr_ = prev_imu_data.bottomRows(3);
 
@@ -2029,10 +2694,29 @@ void Estimator::updateLatestStates(const int unique_id)
     last_R0_ = image_frame_window_.all_image_frame_ptr_.begin()->second->R_;
     last_P0_ = image_frame_window_.all_image_frame_ptr_.begin()->second->T_;
 
-    unsigned int last_image_state_idx = image_frame->state_idx_;
-    repropagateIMU(state_hist_.begin()+last_image_state_idx+1, false);
-    lpf_idx_ = 0;
-    // printf("propagate imu time: %lf s\n", state_hist_.back().t_ -  state_hist_[last_image_state_idx].t_);
+    auto last_image_state_it = image_frame->state_it_;
+    repropagateIMU(next(last_image_state_it), false);
+
+    // hand the optimized state over to the imu propagation thread
+    mPropagate_.lock();
+    latest_state_ = *last_image_state_it;
+    latest_state_.image_frame_ptr_.reset();
+    latest_state_.t_ = latest_time_;
+    latest_state_.P_ = latest_P_;
+    latest_state_.Q_ = latest_Q_;
+    latest_state_.V_ = latest_V_;
+    latest_state_.Ba_ = latest_Ba_;
+    latest_state_.Bg_ = latest_Bg_;
+    latest_tic_.resize(img_trackers_.size());
+    latest_ric_.resize(img_trackers_.size());
+    for(unsigned int i = 0; i < img_trackers_.size(); i++){
+        latest_tic_[i].assign(img_trackers_[i]->cam_info_.tic_.begin(), img_trackers_[i]->cam_info_.tic_.end());
+        latest_ric_[i].assign(img_trackers_[i]->cam_info_.ric_.begin(), img_trackers_[i]->cam_info_.ric_.end());
+    }
+    latest_state_updated_ = true;
+    latest_state_valid_ = true;
+    mPropagate_.unlock();
+    // printf("propagate imu time: %lf s\n", state_hist_.back().t_ -  last_image_state_it->t_);
 
     // for(unsigned int i = 0; i< img_trackers_.size(); i++){
     //     ROS_DEBUG("td %d: %lf", i, img_trackers_[i]->cam_info_.td_);
@@ -10,11 +10,14 @@
 #pragma once
  
 #include <thread>
+#include <atomic>
+#include <condition_variable>
 #include <chrono>
 #include <std_msgs/Header.h>
 #include <std_msgs/Float32.h>
 #include <ceres/ceres.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <queue>
 #include <list>
 #include <opencv2/core/eigen.hpp>
@@ -32,6 +35,7 @@
 #include "../factor/imu_factor.h"
 #include "../factor/pose_local_parameterization.h"
 #include "../factor/marginalization_factor.h"
+#include "../factor/window_solver.h"
 #include "../factor/projectionTwoFrameOneCamFactor.h"
 #include "../factor/projectionTwoFrameTwoCamFactor.h"
 #include "../factor/projectionOneFrameTwoCamFactor.h"
@@ -39,6 +43,8 @@
 // #include "../factor/reprojectionDepthFactor.h"
 #include "../factor/projectionTwoFrameOneCamDepthFactor.h"
 #include "../featureTracker/feature_tracker.h"
+#include "../utility/spsc_queue.h"
+#include "../utility/thread_pool.h"
 
 namespace vins_multi{
 
@@ -50,74 +56,148 @@ class Estimator
     public:
         rawImageFrame() : t_(-1.0), img_(cv::Mat()), img1_(cv::Mat()){}
         rawImageFrame(double t, const cv::Mat& img, const cv::Mat& img1) : t_(t), img_(img), img1_(img1){}
-        void setImageFrame(double t, const cv::Mat& img, const cv::Mat& img1){
+        void setImageFrame(double t, const cv::Mat& img, const cv::Mat& img1, shared_ptr<const void> hold = nullptr, const int color_cvt = -1){
             t_ = t;
             img_ = img;
             img1_ = img1;
+            hold_ = std::move(hold);
+            color_cvt_ = color_cvt;
+            arrival_ = std::chrono::steady_clock::now();
+        }
+
+        void clear(){
+            setImageFrame(-1.0, cv::Mat(), cv::Mat());
         }
 
         bool valid_ = false;
         double t_;
         cv::Mat img_;
         cv::Mat img1_;
+        // owner of the memory img_ and img1_ point to when they wrap a message
+        shared_ptr<const void> hold_;
+        // cv::cvtColor code to gray, -1 if img_ is gray already
+        int color_cvt_ = -1;
+        // when the callback handed the frame over, the latency budget starts here
+        std::chrono::steady_clock::time_point arrival_;
     };
 
+    // bounded frame queue between the image callback and the processing thread of one camera
     class imageBuffer{
     public:
-        imageBuffer(const unsigned int buffer_size){
-            unsigned int buffer_real_size = max(1U,buffer_size);
-            for(unsigned int i = 0U; i < buffer_real_size; i++){
+        imageBuffer(const unsigned int buffer_size, const int drop_policy): capacity_(max(1U,buffer_size)), drop_policy_(drop_policy){
+            // one more frame than the capacity, it is held by the processing task
+            for(unsigned int i = 0U; i < capacity_ + 1; i++){
                 free_memory_buffer_.emplace_back(new rawImageFrame());
             }    
         }
 
-        void insertImage(double t, const cv::Mat &_img, const cv::Mat &_img1 = cv::Mat()){
-            if(free_memory_buffer_.empty()){
-
-                if(image_buffer_.empty()){
-
+        // returns the number of frames dropped by this insertion
+        unsigned int insertImage(double t, const cv::Mat &_img, const cv::Mat &_img1 = cv::Mat(), shared_ptr<const void> hold = nullptr, const int color_cvt = -1){
+            unsigned int drop_cnt = 0;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                received_cnt_++;
+
+                if(drop_policy_ == KEEP_LATEST){
+                    drop_cnt = image_buffer_.size();
+                    for(auto& frame_ptr : image_buffer_){
+                        frame_ptr->clear();
+                    }
+                    free_memory_buffer_.splice(free_memory_buffer_.end(), image_buffer_);
                 }
-                else{
-                    image_buffer_.back()->setImageFrame(t, _img, _img1);
+                else if(image_buffer_.size() >= capacity_){
+                    drop_cnt = 1;
+                    if(drop_policy_ == DROP_NEWEST){
+                        dropped_cnt_++;
+                        return drop_cnt;
+                    }
+                    image_buffer_.front()->clear();
+                    free_memory_buffer_.splice(free_memory_buffer_.end(), image_buffer_, image_buffer_.begin());
                 }
+                dropped_cnt_ += drop_cnt;
 
+                if(free_memory_buffer_.empty()){
+                    free_memory_buffer_.emplace_back(new rawImageFrame());
+                }
+                image_buffer_.splice(image_buffer_.end(), free_memory_buffer_, free_memory_buffer_.begin());
+                image_buffer_.back()->setImageFrame(t, _img, _img1, std::move(hold), color_cvt);
             }
-            else{
-                image_buffer_.emplace_back(free_memory_buffer_.front());
-                free_memory_buffer_.pop_front();
-                image_buffer_.back()->setImageFrame(t, _img, _img1);
-
-            }
+            return drop_cnt;
         }
 
         void releaseImage(shared_ptr<rawImageFrame> frame_ptr){
-
+            frame_ptr->clear();
+            std::lock_guard<std::mutex> lock(mutex_);
             free_memory_buffer_.emplace_back(frame_ptr);
-            
         }
 
+        // true if the caller has to start a consumer, only one consumer is active at a time
+        // so frames of one camera are still processed in order
+        bool schedule(){
+            std::lock_guard<std::mutex> lock(mutex_);
+            if(consumer_active_ || image_buffer_.empty() || stopped_){
+                return false;
+            }
+            consumer_active_ = true;
+            return true;
+        }
+
+        // nullptr once the buffer is empty or stopped, the consumer has to return then
         shared_ptr<rawImageFrame> retrieveFrame(){
-            if(image_buffer_.empty()){
+            std::lock_guard<std::mutex> lock(mutex_);
+            if(image_buffer_.empty() || stopped_){
+                consumer_active_ = false;
                 return shared_ptr<rawImageFrame>(nullptr);
             }
-            else{
-                shared_ptr<rawImageFrame> frame_ptr = image_buffer_.front();
-                image_buffer_.pop_front();
-                return frame_ptr;
-            }
+            shared_ptr<rawImageFrame> frame_ptr = image_buffer_.front();
+            image_buffer_.pop_front();
+            return frame_ptr;
+        }
+
+        void stop(){
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopped_ = true;
+        }
+
+        bool stopped(){
+            std::lock_guard<std::mutex> lock(mutex_);
+            return stopped_;
+        }
+
+        unsigned long receivedCount(){
+            std::lock_guard<std::mutex> lock(mutex_);
+            return received_cnt_;
+        }
+
+        unsigned long droppedCount(){
+            std::lock_guard<std::mutex> lock(mutex_);
+            return dropped_cnt_;
         }
 
     private:
 
+        const unsigned int capacity_;
+        const int drop_policy_;
+
+        std::mutex mutex_;
+        bool consumer_active_ = false;
+        bool stopped_ = false;
+
+        unsigned long received_cnt_ = 0;
+        unsigned long dropped_cnt_ = 0;
+
         list<shared_ptr<rawImageFrame>> image_buffer_;
         list<shared_ptr<rawImageFrame>> free_memory_buffer_;
     };
 
     class imgTracker{
         public:
-            imgTracker(camera_module_info& cam_module, vector<shared_ptr<ImageFrame>>& image_frame_ptr, int max_feature_per_module): cam_info_{cam_module}, featureTracker_{cam_module.depth_, cam_module.stereo_, max_feature_per_module}, f_manager_(cam_module.depth_, cam_module.stereo_, image_frame_ptr), image_buffer_(5U){
+            imgTracker(camera_module_info& cam_module, vector<shared_ptr<ImageFrame>>& image_frame_ptr, int max_feature_per_module): cam_info_{cam_module}, featureTracker_{cam_module.depth_, cam_module.stereo_, max_feature_per_module}, f_manager_(cam_module.depth_, cam_module.stereo_, image_frame_ptr), image_buffer_(IMAGE_BUFFER_SIZE, IMAGE_DROP_POLICY){
                 ROS_WARN("set tracker, id %d", cam_module.module_id_);
                 featureTracker_.readIntrinsicParameter(cam_module.calib_file_);
+                if(ADAPTIVE_LK){
+                    featureTracker_.setLKBounds(cam_module.lk_win_min_, cam_module.lk_win_max_, cam_module.lk_level_min_, cam_module.lk_level_max_);
+                }
             }
 
 
@@ -187,7 +267,8 @@ class Estimator
             FeatureManager f_manager_;
 
             double last_frame_time_ = -1.0;
-            double last_keep_frame_time_ = -1.0;
+            // read by the tracking task to skip frames the backend would drop
+            std::atomic<double> last_keep_frame_time_{-1.0};
             double frame_time_priority_ratio_ = 1.0;
 
             double max_frame_time_priority = 1.0;
@@ -195,7 +276,9 @@ class Estimator
             deque<double> frame_time_hist_;
 
             imageBuffer image_buffer_;
-            mutex image_buffer_mutex_;
+            // gray conversion targets of color frames, alternated since the tracker keeps the previous frame
+            cv::Mat gray_img_[2];
+            unsigned int gray_idx_ = 0;
     };
 
 
@@ -211,36 +294,47 @@ class Estimator
     static void initTrackerGPU(shared_ptr<imgTracker> img_tracker);
 
     void start_process_thread();
+    void processIMUPropagation();
 
     // interface
     void initFirstPose(Eigen::Vector3d p, Eigen::Matrix3d r);
     void inputIMU(double t, const Vector3d &linearAcceleration, const Vector3d &angularVelocity);
     void inputIMU(double t, const Vector6d &imu_data);
-    void inputImageToBuffer(const unsigned int unique_id, double t, const cv::Mat &_img, const cv::Mat &_img1 = cv::Mat());
+    void inputImageToBuffer(const unsigned int unique_id, double t, const cv::Mat &_img, const cv::Mat &_img1 = cv::Mat(), shared_ptr<const void> hold = nullptr, const int color_cvt = -1);
+    void scheduleImageProcess(const unsigned int unique_id);
     void processImageBuffer(const unsigned int unique_id);
-    void inputImage(const unsigned int unique_id, double t, const cv::Mat &_img, const cv::Mat &_img1 = cv::Mat());
+    void inputImage(const unsigned int unique_id, double t, const cv::Mat &_img, const cv::Mat &_img1 = cv::Mat(),
+                    const std::chrono::steady_clock::time_point arrival = std::chrono::steady_clock::now());
     
     void updateFeatureTrackerMaxCnt();
     bool CheckKeepImageUpdatePriority(const int cam_unique_id, const double t);
-    deque<State>::iterator insertState(const State& state);
+    void recordDroppedFrame(const int cam_unique_id, const double t);
+    list<State>::iterator insertState(const State& state);
+    list<State>::iterator eraseState(list<State>::iterator state_it);
+    void removeOldIMUStates();
 
-    void setImageIMUData(const deque<State>::iterator img_it);
-    void setImageState(const deque<State>::iterator img_it);
+    void setImageIMUData(const list<State>::iterator img_it);
+    void setImageState(const list<State>::iterator img_it);
     void setStateFromImage();
     
     void processIMU(double t, double dt, const Vector3d &linear_acceleration, const Vector3d &angular_velocity);
-    void processImage(const deque<State>::iterator img_it, const map<double, shared_ptr<ImageFrame>>::iterator img_frame_it);
-    void processMeasurements(const deque<State>::iterator img_it);
+    void processImage(const list<State>::iterator img_it, const map<double, shared_ptr<ImageFrame>>::iterator img_frame_it, const bool defer_opt = false);
+    void processBackend();
+    void processBatch();
+    void rejectWindowOutliers();
+    void processMeasurements(const list<State>::iterator img_it);
 
-    void processWindow(const int img_cam_unique_id);
+    void processWindow(const int img_cam_unique_id, const bool defer_opt = false);
 
-    void constructPreintegration(const deque<State>::iterator insert_state_it, const map<double, shared_ptr<ImageFrame>>::iterator insert_frame_it);
+    void constructPreintegration(const list<State>::iterator insert_state_it, const map<double, shared_ptr<ImageFrame>>::iterator insert_frame_it);
     void reconstructPreintegration();
-    void addPreintegrationToNextFrame(unsigned int remove_frame_state_idx);
+    bool reusePreintegration(const list<State>::iterator last_img_it, const list<State>::iterator img_it);
+    void addPreintegrationToNextFrame(const list<State>::iterator start_state_it);
 
     // void constructMarginalizationInfo();
     // void constructPriorFactor(shared_ptr<ImageFrame>& frame_ptr_to_margin);
     void constructMarginalizationFator();
+    void takeSolverLinearization(MarginalizationInfo* marginalization_info);
 
 
 
@@ -257,6 +351,11 @@ class Estimator
     void reorderWindow();
 
     void optimization();
+    void setSolverBudget(double& solver_time, int& num_iterations);
+    void buildProblem(vector<unsigned int>& long_track_feature_num);
+    void updateIncrementalProblem(vector<unsigned int>& long_track_feature_num);
+    void addObservationResidual(ceres::Problem* problem, const unsigned int cam_unique_id, FeaturePerId& feature, const int imu_i, const int imu_j,
+                                FeaturePerFrame& feature_per_frame, vector<ceres::ResidualBlockId>* residual_ids = nullptr);
     void vector2double();
     void double2vector();
     // bool failureDetection();
@@ -271,13 +370,16 @@ class Estimator
     void updateLatestStates(const int unique_id);
     // void fastPredictIMU(double t, Eigen::Vector3d linear_acceleration, Eigen::Vector3d angular_velocity);
     
-    void repropagateIMU(const deque<State>::iterator start_it, const bool low_pass);
+    void drainIMUBuffer();
+    void repropagateIMU(const list<State>::iterator start_it, const bool low_pass);
     void propagateIMU(const State& x, State& x_next);
     void propagateIMULowpass(const State& x, State& x_next, const double& alpha);
     bool IMUAvailable(double t);
+    bool gyroRotation(const double t0, const double t1, const Eigen::Vector3d &bg, Eigen::Matrix3d &R_0_1);
+    void setGyroRotation(const unsigned int unique_id, const double t);
     bool IMUInitReady(double img_time);
     // void initFirstIMUPose(vector<pair<double, Eigen::Vector3d>> &accVector);
-    void initFirstIMUPose(const deque<State>::iterator img_it);
+    void initFirstIMUPose(const list<State>::iterator img_it);
 
     inline bool needMarginalization();
 
@@ -296,10 +398,15 @@ class Estimator
     std::mutex mProcess_;
     std::mutex mBuf_;
     std::mutex mPropagate_;
+    std::mutex mIMUBuf_;
     // queue<pair<double, Eigen::Vector3d>> accBuf_;
     // queue<pair<double, Eigen::Vector3d>> gyrBuf_;
 
-    deque<State> state_hist_;
+    // list nodes are stable, frames keep a handle to their state; erased nodes are recycled through state_pool_
+    list<State> state_hist_;
+    list<State> state_pool_;
+    // bumped when an imu state is inserted before the newest state, the sample sets of segments may have changed
+    unsigned long imu_insert_epoch_ = 0;
 
     queue<ImageFrame> featureBuf_;
     double prevTime_, curTime_;
@@ -326,6 +433,8 @@ class Estimator
     Matrix3d back_R0_, last_R_, last_R0_;
     Vector3d back_P0_, last_P_, last_P0_;
     Vector3d origin_R0, origin_P0;
+    // rotation double2vector turned the window by after the last solve
+    Matrix3d origin_rot_diff_;
     double Headers_[(WINDOW_SIZE + 1)];
 
     // IntegrationBase *pre_integrations_[(WINDOW_SIZE + 1)];
@@ -346,7 +455,7 @@ class Estimator
     // MotionEstimator m_estimator;
     // InitialEXRotation initial_ex_rotation;
 
-    bool first_imu_;
+    std::atomic<bool> first_imu_;
     bool is_valid, is_key_;
     bool failure_occur_;
 
@@ -366,6 +475,30 @@ class Estimator
 
     MarginalizationInfo *last_marginalization_info_;
     ceres::Problem* problem_ptr_;
+
+    // book keeping of the persistent problem (INCREMENTAL_PROBLEM)
+    struct ProblemFeatureBlock{
+        double* inv_depth_;
+        shared_ptr<ImageFrame> anchor_frame_;
+        map<shared_ptr<ImageFrame>, vector<ceres::ResidualBlockId>> residuals_;
+    };
+
+    struct ProblemIMUBlock{
+        shared_ptr<ImageFrame> prev_frame_;
+        shared_ptr<IntegrationBase> pre_integration_;
+        size_t imu_num_;
+        ceres::ResidualBlockId residual_;
+    };
+
+    unique_ptr<ceres::LossFunction> problem_loss_function_;
+    unique_ptr<ceres::LocalParameterization> problem_pose_parameterization_;
+    // used instead of ceres::Solve with window_solver
+    WindowSolver window_solver_;
+    set<shared_ptr<ImageFrame>> problem_frames_;
+    map<shared_ptr<ImageFrame>, ProblemIMUBlock> problem_imu_;
+    vector<unordered_map<int, ProblemFeatureBlock>> problem_features_;
+    ceres::ResidualBlockId problem_prior_residual_;
+    double* problem_const_pose_;
     // unique_ptr<Marginalizer> marginalizer_;
     // PriorFactor* last_prior_ptr_;
     vector<double *> last_marginalization_parameter_blocks_;
@@ -395,7 +528,64 @@ class Estimator
     bool initFirstPoseFlag_;
     bool initThreadFlag_;
 
-    std::vector<std::thread>image_process_thread_vec_;
+    // image processing, marginalization and gpu warm up share these workers
+    unique_ptr<ThreadPool> thread_pool_;
+    std::atomic<bool> image_process_started_{false};
+
+    // imu callback -> propagation thread, the propagation thread forwards the samples to imu_backend_buf_
+    SPSCQueue<pair<double, Vector6d>> imu_queue_{IMU_QUEUE_SIZE};
+    std::mutex imu_queue_mutex_;
+    std::condition_variable imu_queue_cv_;
+    std::atomic<bool> imu_consumer_sleeping_{false};
+    vector<pair<double, Vector6d>> imu_backend_buf_;
+    vector<pair<double, Vector6d>> imu_drain_buf_;
+    std::atomic<double> latest_imu_time_{-1.0};
+    // recent raw gyro samples for the frontend, the state history is held by the backend during optimization
+    deque<pair<double, Eigen::Vector3d>> gyro_hist_;
+    std::mutex mGyroBuf_;
+    std::atomic<bool> imu_propagate_running_{false};
+    std::thread imuPropagateThread_;
+
+    // tracked frame waiting for the backend
+    struct PendingFrame{
+        unsigned int unique_id_;
+        double t_;
+        FeatureFrame points_;
+        // false for frames dropped before tracking, they only update the camera priorities
+        bool tracked_;
+        std::chrono::steady_clock::time_point arrival_;
+    };
+    bool frameIMUCovered(const PendingFrame& frame);
+    bool backendFrameReady();
+
+    // the trackers only enqueue, one backend thread inserts everything pending and optimizes once
+    std::mutex backend_mutex_;
+    std::condition_variable backend_cv_;
+    vector<PendingFrame> backend_queue_;
+    vector<PendingFrame> backend_batch_;
+    vector<PendingFrame> backend_held_;
+    // queued frames all wait for imu, the propagation thread wakes the backend on new samples
+    std::atomic<bool> backend_waiting_imu_{false};
+    bool backend_running_ = false;
+    std::thread backendThread_;
+    // cameras with new frames since the last optimization, their outliers are removed after it
+    vector<unsigned int> opt_pending_cams_;
+
+    // solver budget from the latency budget of the frame being optimized, see setSolverBudget
+    std::chrono::steady_clock::time_point solve_deadline_;
+    bool solve_deadline_valid_ = false;
+    // running averages in ms, the marginalization after a solve and one solver iteration
+    double margin_cost_ = 0.0;
+    double iteration_cost_ = 0.0;
+    unsigned long deadline_cnt_ = 0;
+    unsigned long deadline_miss_cnt_ = 0;
+
+    // latest optimized state for the propagation thread, guarded by mPropagate_
+    State latest_state_;
+    vector<vector<Eigen::Vector3d>> latest_tic_;
+    vector<vector<Eigen::Quaterniond>> latest_ric_;
+    bool latest_state_updated_ = false;
+    bool latest_state_valid_ = false;
 };
 
 }
\ No newline at end of file
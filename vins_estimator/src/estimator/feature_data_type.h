@@ -10,6 +10,10 @@
 #pragma once
 
 #include <eigen3/Eigen/Eigen>
+#include <array>
+#include <algorithm>
+#include <iterator>
+#include <utility>
 #include <vector>
 #include <list>
 #include <mutex>
@@ -61,6 +65,137 @@ class FeaturePerFrame
     bool is_stereo, is_depth;
 };
 
+// observations of one landmark, oldest first, stored contiguously. most tracks are short, so only
+// N observations are inline and longer tracks spill to the heap, where the buffer keeps its capacity.
+// pop_front only moves the start offset and erasing the second newest moves one element
+template <typename T, int N>
+class ObservationBuffer
+{
+  public:
+    typedef T* iterator;
+    typedef const T* const_iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    ObservationBuffer() {}
+
+    ObservationBuffer(const ObservationBuffer &other)
+    {
+        *this = other;
+    }
+
+    ObservationBuffer(ObservationBuffer &&other)
+    {
+        *this = std::move(other);
+    }
+
+    ObservationBuffer& operator=(const ObservationBuffer &other)
+    {
+        if (this != &other)
+        {
+            clear();
+            for (auto &obs : other)
+                emplace_back(obs);
+        }
+        return *this;
+    }
+
+    // a spilled buffer is taken over, an inline one is moved element by element
+    ObservationBuffer& operator=(ObservationBuffer &&other)
+    {
+        if (this != &other)
+        {
+            if (!other.heap_.empty())
+            {
+                heap_.swap(other.heap_);
+                begin_ = other.begin_;
+                end_ = other.end_;
+            }
+            else
+            {
+                clear();
+                for (auto &obs : other)
+                    emplace_back(std::move(obs));
+            }
+            other.heap_.clear();
+            other.clear();
+        }
+        return *this;
+    }
+
+    size_t size() const { return end_ - begin_; }
+    bool empty() const { return end_ == begin_; }
+    void clear() { begin_ = end_ = 0; }
+
+    iterator begin() { return data() + begin_; }
+    iterator end() { return data() + end_; }
+    const_iterator begin() const { return data() + begin_; }
+    const_iterator end() const { return data() + end_; }
+    reverse_iterator rbegin() { return reverse_iterator(end()); }
+    reverse_iterator rend() { return reverse_iterator(begin()); }
+    const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+    const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+    T& front() { return data()[begin_]; }
+    T& back() { return data()[end_ - 1]; }
+    const T& front() const { return data()[begin_]; }
+    const T& back() const { return data()[end_ - 1]; }
+    T& operator[](const size_t i) { return data()[begin_ + i]; }
+    const T& operator[](const size_t i) const { return data()[begin_ + i]; }
+
+    template <typename Obs>
+    void emplace_back(Obs &&obs)
+    {
+        if (end_ == capacity())
+        {
+            // reuse the slots freed by pop_front before growing
+            if (begin_ > 0)
+            {
+                std::move(begin(), end(), data());
+                end_ -= begin_;
+                begin_ = 0;
+            }
+            else
+            {
+                std::vector<T> bigger(2 * capacity());
+                std::move(begin(), end(), bigger.begin());
+                heap_.swap(bigger);
+            }
+        }
+        data()[end_++] = std::forward<Obs>(obs);
+    }
+
+    void pop_front()
+    {
+        if (++begin_ == end_)
+            clear();
+    }
+
+    iterator erase(iterator pos)
+    {
+        const size_t idx = pos - data();
+        std::move(pos + 1, end(), pos);
+        if (--end_ == begin_)
+        {
+            clear();
+            return end();
+        }
+        return data() + idx;
+    }
+
+  private:
+    size_t capacity() const { return heap_.empty() ? N : heap_.size(); }
+    T* data() { return heap_.empty() ? inline_.data() : heap_.data(); }
+    const T* data() const { return heap_.empty() ? inline_.data() : heap_.data(); }
+
+    std::array<T, N> inline_;
+    std::vector<T> heap_;
+    size_t begin_ = 0, end_ = 0;
+};
+
+// (feature id, observation) of one image sorted by id, the whole frame is one allocation
+typedef vector<pair<int, FeaturePerFrame>> FeatureFrame;
+
 class FeaturePerId
 {
   public:
@@ -75,7 +210,7 @@ class FeaturePerId
 
     const int feature_id;
     int start_frame;
-    list<FeaturePerFrame> feature_per_frame;
+    ObservationBuffer<FeaturePerFrame, 4> feature_per_frame;
     int used_num;
     double estimated_depth;
     double inv_depth;
@@ -93,20 +228,23 @@ class FeaturePerId
     }
 };
 
+class State;
+
 class ImageFrame
 {
     public:
         // ImageFrame(){};
-        ImageFrame(const double _t, double& _td, const int unique_id, const map<int, FeaturePerFrame>& _points):
+        ImageFrame(const double _t, double& _td, const int unique_id, FeatureFrame&& _points):
           t_{_t}, td_{_td}, cam_module_unique_id_{unique_id}, is_key_frame_{false}, 
           R_{&para_Pose_[3]}, T_{&para_Pose_[0]},
-          V_{&para_SpeedBias_[0]}, Ba_{&para_SpeedBias_[3]}, Bg_{&para_SpeedBias_[6]}
+          V_{&para_SpeedBias_[0]}, Ba_{&para_SpeedBias_[3]}, Bg_{&para_SpeedBias_[6]},
+          points_{std::move(_points)}
         {
-            points_ = _points;
         };
         int cam_module_unique_id_;
-        map<int, FeaturePerFrame> points_;
-        unsigned int state_idx_;
+        // released once the feature manager has taken the observations
+        FeatureFrame points_;
+        list<State>::iterator state_it_;
         double t_;
         double& td_;
         double para_Pose_[SIZE_POSE];
@@ -119,6 +257,17 @@ class ImageFrame
         Map<Eigen::Vector3d> Bg_;
         Vector3d prev_acc_, prev_gyr_;
         shared_ptr<IntegrationBase> pre_integration_;
+
+        // segment pre_integration_ was built over by reconstructPreintegration: both ends, the first and
+        // last imu sample inside and the epoch of out of order imu insertions. if the samples are the
+        // same, the integration is kept and only its ends are shifted
+        struct PreintegrationSpan{
+          const IntegrationBase* integration = nullptr;
+          double t0, t1;
+          double first_imu_t, last_imu_t;
+          unsigned long imu_epoch;
+        };
+        PreintegrationSpan preintegration_span_;
         
         bool is_key_frame_;
 };
@@ -138,9 +287,10 @@ class ImageFrameWindow
       all_image_frame_ptr_.clear();
     }
 
-    unsigned int pop_front(const unsigned int cam_unique_id){
+    // the returned state handle is still in the state history, the caller erases it
+    list<State>::iterator pop_front(const unsigned int cam_unique_id){
       auto frame_ptr = cam_wise_image_frame_ptr_[cam_unique_id].front();
-      unsigned int state_idx = frame_ptr->state_idx_; 
+      auto state_it = frame_ptr->state_it_; 
 
       double remove_t = frame_ptr->t_ + frame_ptr->td_;
 
@@ -148,19 +298,13 @@ class ImageFrameWindow
 
       cam_wise_image_frame_ptr_[cam_unique_id].erase(cam_wise_image_frame_ptr_[cam_unique_id].begin());
 
-      for(auto it = all_image_frame_ptr_.begin(); it != all_image_frame_ptr_.end(); it++){
-        if(it->first > remove_t){
-          it->second->state_idx_ --;
-        }
-      }
-
-      return state_idx;
+      return state_it;
 
     }
 
-    unsigned int erase_second_new(const unsigned int cam_unique_id){
+    list<State>::iterator erase_second_new(const unsigned int cam_unique_id){
       auto frame_ptr = *next(cam_wise_image_frame_ptr_[cam_unique_id].rbegin());
-      unsigned int state_idx = frame_ptr->state_idx_;
+      auto state_it = frame_ptr->state_it_;
 
       double remove_t = frame_ptr->t_ + frame_ptr->td_;
 
@@ -168,30 +312,19 @@ class ImageFrameWindow
 
       cam_wise_image_frame_ptr_[cam_unique_id].erase(cam_wise_image_frame_ptr_[cam_unique_id].begin() + cam_wise_image_frame_ptr_[cam_unique_id].size() - 2);
 
-      for(auto it = all_image_frame_ptr_.begin(); it != all_image_frame_ptr_.end(); it++){
-        if(it->first > remove_t){
-          it->second->state_idx_ --;
-        }
-      }
-
       // erase_frame(frame_ptr);      
-      return state_idx;
+      return state_it;
     }
 
-    unsigned int erase(const unsigned int cam_unique_id, const unsigned int cam_wise_idx){
+    list<State>::iterator erase(const unsigned int cam_unique_id, const unsigned int cam_wise_idx){
       auto frame_ptr = cam_wise_image_frame_ptr_[cam_unique_id][cam_wise_idx];
-      unsigned int state_idx = frame_ptr->state_idx_;
+      auto state_it = frame_ptr->state_it_;
       double remove_t = frame_ptr->t_ + frame_ptr->td_;
 
       all_image_frame_ptr_.erase(remove_t);
       cam_wise_image_frame_ptr_[cam_unique_id].erase(cam_wise_image_frame_ptr_[cam_unique_id].begin() + cam_wise_idx);
 
-      for(auto it = all_image_frame_ptr_.begin(); it != all_image_frame_ptr_.end(); it++){
-        if(it->first > remove_t){
-          it->second->state_idx_ --;
-        }
-      }   
-      return state_idx;
+      return state_it;
 
     }
 
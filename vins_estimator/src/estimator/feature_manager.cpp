@@ -86,7 +86,7 @@ shared_ptr<ImageFrame> FeatureManager::getStartFrame(int feature_id){
 //     return corres;
 // }
 
-bool FeatureManager::addFeatureCheckParallax(const map<int,FeaturePerFrame> &feature_pts, double td)
+bool FeatureManager::addFeatureCheckParallax(const FeatureFrame &feature_pts, double td)
 {
     // ROS_INFO("input feature_: %d", (int)feature_pts.size());
     // ROS_INFO("num of feature_: %d", getFeatureCount());
@@ -96,6 +96,8 @@ bool FeatureManager::addFeatureCheckParallax(const map<int,FeaturePerFrame> &fea
     last_average_parallax_ = 0;
     new_feature_num_ = 0;
     long_track_num_ = 0;
+    // both sides are sorted by id, so the lookup walks feature_ once and inserts with a hint
+    auto it = feature_.begin();
     for (auto &id_pts : feature_pts)
     {
         // FeaturePerFrame f_per_fra(id_pts.second[0].second, td);
@@ -130,11 +132,12 @@ bool FeatureManager::addFeatureCheckParallax(const map<int,FeaturePerFrame> &fea
         //         long_track_num_++;
         // }
 
-        auto it = feature_.find(feature_id);
-        if (it == feature_.end()){
-            auto emplace_it = feature_.emplace(feature_id, FeaturePerId(feature_id, num_frame_)).first;
-            emplace_it->second.feature_per_frame.emplace_back(id_pts.second);
-            emplace_it->second.feature_per_frame.back().cur_td = td;
+        while (it != feature_.end() && it->first < feature_id)
+            it++;
+        if (it == feature_.end() || it->first != feature_id){
+            it = feature_.emplace_hint(it, feature_id, FeaturePerId(feature_id, num_frame_));
+            it->second.feature_per_frame.emplace_back(id_pts.second);
+            it->second.feature_per_frame.back().cur_td = td;
             // if(id_pts.second.is_depth)
             //     emplace_it->second.estimated_depth = id_pts.second.depth;
             new_feature_num_++;
@@ -42,7 +42,7 @@ class FeatureManager
     int getFeatureCount();
     double* getFeatureInvDepth(int feature_id);
     shared_ptr<ImageFrame> getStartFrame(int feature_id);
-    bool addFeatureCheckParallax(const map<int,FeaturePerFrame> &feature_pts, double td);
+    bool addFeatureCheckParallax(const FeatureFrame &feature_pts, double td);
     bool checkParallax(vector<shared_ptr<ImageFrame>>& frameHist);
     // vector<pair<Vector3d, Vector3d>> getCorresponding(int frame_count_l, int frame_count_r);
     // //void updateDepth(const VectorXd &x);
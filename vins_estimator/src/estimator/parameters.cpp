@@ -8,6 +8,7 @@
  *******************************************************/
 
 #include "parameters.h"
+#include <thread>
 
 namespace vins_multi{
 
@@ -24,8 +25,12 @@ map<int, Eigen::Vector3d> pts_gt;
 
 double BIAS_ACC_THRESHOLD;
 double BIAS_GYR_THRESHOLD;
+int BIAS_CORRECTION;
 double SOLVER_TIME;
 int NUM_ITERATIONS;
+double LATENCY_BUDGET;
+int WINDOW_SOLVER;
+int INCREMENTAL_PROBLEM;
 int ESTIMATE_EXTRINSIC;
 int ESTIMATE_TD;
 int ROLLING_SHUTTER;
@@ -35,16 +40,29 @@ std::string OUTPUT_FOLDER;
 std::string IMU_TOPIC;
 int USE_IMU;
 int MULTIPLE_THREAD;
+int IMAGE_BUFFER_SIZE;
+int IMAGE_DROP_POLICY;
+unsigned int WORKER_NUM;
+int WORKER_CPU_AFFINITY;
+int SOLVER_THREAD_NUM;
 std::string FISHEYE_MASK;
 int MAX_CNT;
 int MIN_DIST;
 double F_THRESHOLD;
 int SHOW_TRACK;
 int FLOW_BACK;
+int GYRO_RANSAC;
+int GYRO_PREDICTION;
+int ADAPTIVE_LK;
+int PRE_ADMISSION;
 double DEPTH_MIN;
 double DEPTH_MAX;
 
 int EQUALIZE;
+int UNDISTORT_LUT;
+int DETECTOR_GRID_ROW;
+int DETECTOR_GRID_COL;
+double DETECTOR_MIN_RESPONSE;
 
 int MAX_TRACK_NUM_PER_MODULE;
 
@@ -177,6 +195,11 @@ void readParameters(std::string config_file)
             CAM_MODULES[cur_cam_module].tr_ = 0.0;
             ROS_INFO("Global shutter camera.");
         }
+
+        CAM_MODULES[cur_cam_module].lk_win_min_ = (*it)["lk_win_min"].empty() ? 9 : (int)(*it)["lk_win_min"];
+        CAM_MODULES[cur_cam_module].lk_win_max_ = (*it)["lk_win_max"].empty() ? 21 : (int)(*it)["lk_win_max"];
+        CAM_MODULES[cur_cam_module].lk_level_min_ = (*it)["lk_level_min"].empty() ? 0 : (int)(*it)["lk_level_min"];
+        CAM_MODULES[cur_cam_module].lk_level_max_ = (*it)["lk_level_max"].empty() ? 3 : (int)(*it)["lk_level_max"];
          
 
         (*it)["image0_topic"] >> CAM_MODULES[cur_cam_module].img_topic_[0];
@@ -292,8 +315,16 @@ void readParameters(std::string config_file)
     F_THRESHOLD = fsSettings["F_threshold"];
     SHOW_TRACK = fsSettings["show_track"];
     FLOW_BACK = fsSettings["flow_back"];
+    GYRO_RANSAC = fsSettings["gyro_ransac"].empty() ? 0 : (int)fsSettings["gyro_ransac"];
+    GYRO_PREDICTION = fsSettings["gyro_prediction"].empty() ? 0 : (int)fsSettings["gyro_prediction"];
+    ADAPTIVE_LK = fsSettings["adaptive_lk"].empty() ? 0 : (int)fsSettings["adaptive_lk"];
+    PRE_ADMISSION = fsSettings["pre_admission"].empty() ? 0 : (int)fsSettings["pre_admission"];
 
     EQUALIZE = fsSettings["equalize"];
+    UNDISTORT_LUT = fsSettings["undistort_lut"].empty() ? 0 : (int)fsSettings["undistort_lut"];
+    DETECTOR_GRID_ROW = fsSettings["detector_grid_row"].empty() ? 0 : (int)fsSettings["detector_grid_row"];
+    DETECTOR_GRID_COL = fsSettings["detector_grid_col"].empty() ? 0 : (int)fsSettings["detector_grid_col"];
+    DETECTOR_MIN_RESPONSE = fsSettings["detector_min_response"].empty() ? 1e-3 : (double)fsSettings["detector_min_response"];
 
     DEPTH_MIN = fsSettings["depth_min"];
     DEPTH_MAX = fsSettings["depth_max"];
@@ -302,9 +333,26 @@ void readParameters(std::string config_file)
 
     MULTIPLE_THREAD = fsSettings["multiple_thread"];
 
+    IMAGE_BUFFER_SIZE = fsSettings["image_buffer_size"].empty() ? 5 : (int)fsSettings["image_buffer_size"];
+    IMAGE_DROP_POLICY = fsSettings["image_drop_policy"];
+    printf("IMAGE_BUFFER_SIZE: %d, IMAGE_DROP_POLICY: %d\n", IMAGE_BUFFER_SIZE, IMAGE_DROP_POLICY);
+
+    int worker_num = fsSettings["worker_num"].empty() ? 0 : (int)fsSettings["worker_num"];
+    WORKER_NUM = worker_num > 0 ? worker_num : max(1U, std::thread::hardware_concurrency());
+    WORKER_CPU_AFFINITY = fsSettings["worker_cpu_affinity"].empty() ? 0 : (int)fsSettings["worker_cpu_affinity"];
+    printf("WORKER_NUM: %u, WORKER_CPU_AFFINITY: %d\n", WORKER_NUM, WORKER_CPU_AFFINITY);
+    SOLVER_THREAD_NUM = fsSettings["solver_thread_num"].empty() ? 1 : max(1, (int)fsSettings["solver_thread_num"]);
+    printf("SOLVER_THREAD_NUM: %d\n", SOLVER_THREAD_NUM);
+
 
     SOLVER_TIME = fsSettings["max_solver_time"];
     NUM_ITERATIONS = fsSettings["max_num_iterations"];
+    LATENCY_BUDGET = fsSettings["latency_budget"].empty() ? 0.0 : (double)fsSettings["latency_budget"];
+    printf("LATENCY_BUDGET: %f\n", LATENCY_BUDGET);
+    WINDOW_SOLVER = fsSettings["window_solver"].empty() ? 0 : (int)fsSettings["window_solver"];
+    printf("WINDOW_SOLVER: %d\n", WINDOW_SOLVER);
+    INCREMENTAL_PROBLEM = fsSettings["incremental_problem"];
+    printf("INCREMENTAL_PROBLEM: %d\n", INCREMENTAL_PROBLEM);
     MIN_PARALLAX = fsSettings["keyframe_parallax"];
     MIN_PARALLAX = MIN_PARALLAX / FOCAL_LENGTH;
 
@@ -402,8 +450,10 @@ void readParameters(std::string config_file)
     // center_T_imu = T_temp.block<3, 1>(0, 3);
 
     INIT_DEPTH = 5.0;
-    BIAS_ACC_THRESHOLD = 0.1;
-    BIAS_GYR_THRESHOLD = 0.1;
+    BIAS_CORRECTION = fsSettings["bias_correction"];
+    BIAS_ACC_THRESHOLD = fsSettings["bias_acc_threshold"].empty() ? 0.1 : (double)fsSettings["bias_acc_threshold"];
+    BIAS_GYR_THRESHOLD = fsSettings["bias_gyr_threshold"].empty() ? 0.01 : (double)fsSettings["bias_gyr_threshold"];
+    printf("BIAS_CORRECTION: %d, acc threshold %lf, gyr threshold %lf\n", BIAS_CORRECTION, BIAS_ACC_THRESHOLD, BIAS_GYR_THRESHOLD);
 
 
     // ROW = fsSettings["image_height"];
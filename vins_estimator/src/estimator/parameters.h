@@ -58,10 +58,19 @@ const double MIN_FRAME_INTERVAL_PER_MODULE = 0.05;
 const double MIN_PRE_INTEGRATION_INTERVAL = 0.01;
 const double MIN_FRAME_INTERVAL_FOR_OPT = 0.005;
 const int MIN_TRACK_NUM_PER_MODULE = 30;
+const int IMU_QUEUE_SIZE = 4000;
 extern int MAX_TRACK_NUM_PER_MODULE;
 const double FRAME_PRIORITY_CONST = 20.0;
+const double MIN_SOLVER_TIME_RATIO = 0.2;
 //#define UNIT_SPHERE_ERROR
 
+enum ImageDropPolicy
+{
+    DROP_OLDEST = 0,
+    DROP_NEWEST = 1,
+    KEEP_LATEST = 2
+};
+
 struct camera_module_info{
     int module_id_;
     bool depth_;
@@ -70,6 +79,9 @@ struct camera_module_info{
     int img_height_;
     double td_;
     double tr_;
+    // adaptive optical flow bounds
+    int lk_win_min_, lk_win_max_;
+    int lk_level_min_, lk_level_max_;
     vector<std::string> img_topic_;
     vector<std::string> calib_file_;
     vector<Eigen::Map<Eigen::Quaterniond>> ric_;
@@ -176,8 +188,12 @@ extern map<int, Eigen::Vector3d> pts_gt;
 
 extern double BIAS_ACC_THRESHOLD;
 extern double BIAS_GYR_THRESHOLD;
+extern int BIAS_CORRECTION;
 extern double SOLVER_TIME;
 extern int NUM_ITERATIONS;
+extern double LATENCY_BUDGET;
+extern int WINDOW_SOLVER;
+extern int INCREMENTAL_PROBLEM;
 extern int ESTIMATE_EXTRINSIC;
 extern int ESTIMATE_TD;
 extern int ROLLING_SHUTTER;
@@ -187,13 +203,26 @@ extern std::string OUTPUT_FOLDER;
 extern std::string IMU_TOPIC;
 extern int USE_IMU;
 extern int MULTIPLE_THREAD;
+extern int IMAGE_BUFFER_SIZE;
+extern int IMAGE_DROP_POLICY;
+extern unsigned int WORKER_NUM;
+extern int WORKER_CPU_AFFINITY;
+extern int SOLVER_THREAD_NUM;
 extern std::string FISHEYE_MASK;
 extern int MAX_CNT;
 extern int MIN_DIST;
 extern double F_THRESHOLD;
 extern int SHOW_TRACK;
 extern int FLOW_BACK;
+extern int GYRO_RANSAC;
+extern int GYRO_PREDICTION;
+extern int ADAPTIVE_LK;
+extern int PRE_ADMISSION;
 extern int EQUALIZE;
+extern int UNDISTORT_LUT;
+extern int DETECTOR_GRID_ROW;
+extern int DETECTOR_GRID_COL;
+extern double DETECTOR_MIN_RESPONSE;
 extern double DEPTH_MIN;
 extern double DEPTH_MAX;
 
@@ -13,12 +13,13 @@
 #include <ceres/ceres.h>
 #include <Eigen/Dense>
 #include "../utility/utility.h"
+#include "../utility/object_pool.h"
 #include "../utility/tic_toc.h"
 #include "../estimator/parameters.h"
 
 namespace vins_multi{
 
-class depthFactor : public ceres::SizedCostFunction<1, 1>
+class depthFactor : public ceres::SizedCostFunction<1, 1>, public PooledObject<depthFactor>
 {
   public:
     depthFactor(const double _depth);
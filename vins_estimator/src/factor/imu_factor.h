@@ -13,6 +13,7 @@
 #include <eigen3/Eigen/Dense>
 
 #include "../utility/utility.h"
+#include "../utility/object_pool.h"
 #include "../estimator/parameters.h"
 #include "integration_base.h"
 
@@ -20,7 +21,7 @@
 
 namespace vins_multi{
 
-class IMUFactor : public ceres::SizedCostFunction<15, 7, 9, 7, 9>
+class IMUFactor : public ceres::SizedCostFunction<15, 7, 9, 7, 9>, public PooledObject<IMUFactor>
 {
   public:
     IMUFactor() = delete;
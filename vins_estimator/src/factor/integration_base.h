@@ -17,6 +17,28 @@ using namespace Eigen;
 
 namespace vins_multi{
 
+// non trivial blocks of the 15x15 mid-point step jacobian
+struct StepJacobian
+{
+    double dt;
+    Eigen::Matrix3d pr, pba, pbg;
+    Eigen::Matrix3d rr;
+    Eigen::Matrix3d vr, vba, vbg;
+
+    // M = F * M, rows O_BA and O_BG of F are identity
+    void leftMultiply(Eigen::Matrix<double, 15, 15> &M) const
+    {
+        const Eigen::Matrix<double, 3, 15> M_r = M.middleRows<3>(O_R);
+        const Eigen::Matrix<double, 3, 15> M_v = M.middleRows<3>(O_V);
+        const Eigen::Matrix<double, 3, 15> M_ba = M.middleRows<3>(O_BA);
+        const Eigen::Matrix<double, 3, 15> M_bg = M.middleRows<3>(O_BG);
+
+        M.middleRows<3>(O_P) += pr * M_r + dt * M_v + pba * M_ba + pbg * M_bg;
+        M.middleRows<3>(O_R) = rr * M_r - dt * M_bg;
+        M.middleRows<3>(O_V) = vr * M_r + M_v + vba * M_ba + vbg * M_bg;
+    }
+};
+
 class IntegrationBase
 {
   public:
@@ -26,7 +48,10 @@ class IntegrationBase
         : acc_0{_acc_0}, gyr_0{_gyr_0}, linearized_acc{_acc_0}, linearized_gyr{_gyr_0},
           linearized_ba{_linearized_ba}, linearized_bg{_linearized_bg},
             jacobian{Eigen::Matrix<double, 15, 15>::Identity()}, covariance{Eigen::Matrix<double, 15, 15>::Zero()},
-          sum_dt{0.0}, delta_p{Eigen::Vector3d::Zero()}, delta_q{Eigen::Quaterniond::Identity()}, delta_v{Eigen::Vector3d::Zero()}
+          sum_dt{0.0}, delta_p{Eigen::Vector3d::Zero()}, delta_q{Eigen::Quaterniond::Identity()}, delta_v{Eigen::Vector3d::Zero()},
+          integrated_ba{_linearized_ba}, integrated_bg{_linearized_bg},
+          propagated_ba{_linearized_ba}, propagated_bg{_linearized_bg},
+          propagated_delta_p{Eigen::Vector3d::Zero()}, propagated_delta_q{Eigen::Quaterniond::Identity()}, propagated_delta_v{Eigen::Vector3d::Zero()}
 
     {
         noise = Eigen::Matrix<double, 18, 18>::Zero();
@@ -51,6 +76,14 @@ class IntegrationBase
         jacobian.setIdentity();
         covariance.setZero();
 
+        integrated_ba = _linearized_ba;
+        integrated_bg = _linearized_bg;
+        propagated_ba = _linearized_ba;
+        propagated_bg = _linearized_bg;
+        propagated_delta_p.setZero();
+        propagated_delta_q.setIdentity();
+        propagated_delta_v.setZero();
+
         dt_buf.clear();
         acc_buf.clear();
         gyr_buf.clear();
@@ -76,10 +109,81 @@ class IntegrationBase
         linearized_bg = _linearized_bg;
         jacobian.setIdentity();
         covariance.setZero();
+        integrated_ba = _linearized_ba;
+        integrated_bg = _linearized_bg;
+        propagated_ba = _linearized_ba;
+        propagated_bg = _linearized_bg;
+        propagated_delta_p = delta_p;
+        propagated_delta_q = delta_q;
+        propagated_delta_v = delta_v;
         for (int i = 0; i < static_cast<int>(dt_buf.size()); i++)
             propagate(dt_buf[i], acc_buf[i], gyr_buf[i]);
     }
 
+    // first order update of the deltas for a new linearization bias using the bias jacobians,
+    // replays the samples only if the bias moved too far from the one of the last full integration,
+    // so corrections followed by new samples cannot pile up first order error.
+    // jacobian and covariance are kept from the last integration
+    bool correctBias(const Eigen::Vector3d &_linearized_ba, const Eigen::Vector3d &_linearized_bg,
+                     const double acc_threshold, const double gyr_threshold)
+    {
+        if ((_linearized_ba - integrated_ba).norm() > acc_threshold || (_linearized_bg - integrated_bg).norm() > gyr_threshold)
+        {
+            repropagate(_linearized_ba, _linearized_bg);
+            return false;
+        }
+
+        Eigen::Vector3d dba = _linearized_ba - propagated_ba;
+        Eigen::Vector3d dbg = _linearized_bg - propagated_bg;
+
+        delta_p = propagated_delta_p + jacobian.block<3, 3>(O_P, O_BA) * dba + jacobian.block<3, 3>(O_P, O_BG) * dbg;
+        delta_q = (propagated_delta_q * Utility::deltaQ(jacobian.block<3, 3>(O_R, O_BG) * dbg)).normalized();
+        delta_v = propagated_delta_v + jacobian.block<3, 3>(O_V, O_BA) * dba + jacobian.block<3, 3>(O_V, O_BG) * dbg;
+        linearized_ba = _linearized_ba;
+        linearized_bg = _linearized_bg;
+        return true;
+    }
+
+    // first order update for segment ends moved by td without passing an imu sample: start_shift and
+    // end_shift move the start and the end later. the short piece before the first sample is removed with
+    // the start rates, the one after the last sample is added with the end rates. jacobian and
+    // covariance are kept, the shifts are a few ms at most
+    void shiftEnds(const double start_shift, const double end_shift)
+    {
+        const double remaining_dt = sum_dt - start_shift;
+        shiftDeltas(start_shift, end_shift, remaining_dt, linearized_ba, linearized_bg, delta_p, delta_q, delta_v);
+        shiftDeltas(start_shift, end_shift, remaining_dt, propagated_ba, propagated_bg, propagated_delta_p, propagated_delta_q, propagated_delta_v);
+        sum_dt = remaining_dt + end_shift;
+        dt_buf.front() -= start_shift;
+        dt_buf.back() += end_shift;
+    }
+
+    void shiftDeltas(const double start_shift, const double end_shift, const double remaining_dt,
+                     const Eigen::Vector3d &ba, const Eigen::Vector3d &bg,
+                     Eigen::Vector3d &p, Eigen::Quaterniond &q, Eigen::Vector3d &v) const
+    {
+        // the deltas are the removed head composed with the rest: p = p_h + v_h * dt_rest + q_h * p_rest
+        const Eigen::Vector3d acc_h = linearized_acc - ba;
+        const Eigen::Quaterniond q_h_inv = Utility::deltaQ(-(linearized_gyr - bg) * start_shift);
+        const Eigen::Vector3d v_h = acc_h * start_shift;
+        p = q_h_inv * (p - 0.5 * acc_h * start_shift * start_shift - v_h * remaining_dt);
+        v = q_h_inv * (v - v_h);
+        q = (q_h_inv * q).normalized();
+
+        const Eigen::Vector3d acc_t = q * (acc_1 - ba);
+        p += v * end_shift + 0.5 * acc_t * end_shift * end_shift;
+        v += acc_t * end_shift;
+        q = (q * Utility::deltaQ((gyr_1 - bg) * end_shift)).normalized();
+    }
+
+    void updateBias(const Eigen::Vector3d &_linearized_ba, const Eigen::Vector3d &_linearized_bg)
+    {
+        if (BIAS_CORRECTION)
+            correctBias(_linearized_ba, _linearized_bg, BIAS_ACC_THRESHOLD, BIAS_GYR_THRESHOLD);
+        else
+            repropagate(_linearized_ba, _linearized_bg);
+    }
+
     void midPointIntegration(double _dt, 
                             const Eigen::Vector3d &_acc_0, const Eigen::Vector3d &_gyr_0,
                             const Eigen::Vector3d &_acc_1, const Eigen::Vector3d &_gyr_1,
@@ -116,42 +220,64 @@ class IntegrationBase
                 a_1_x(2), 0, -a_1_x(0),
                 -a_1_x(1), a_1_x(0), 0;
 
-            MatrixXd F = MatrixXd::Zero(15, 15);
-            F.block<3, 3>(0, 0) = Matrix3d::Identity();
-            F.block<3, 3>(0, 3) = -0.25 * delta_q.toRotationMatrix() * R_a_0_x * _dt * _dt + 
-                                  -0.25 * result_delta_q.toRotationMatrix() * R_a_1_x * (Matrix3d::Identity() - R_w_x * _dt) * _dt * _dt;
-            F.block<3, 3>(0, 6) = MatrixXd::Identity(3,3) * _dt;
-            F.block<3, 3>(0, 9) = -0.25 * (delta_q.toRotationMatrix() + result_delta_q.toRotationMatrix()) * _dt * _dt;
-            F.block<3, 3>(0, 12) = -0.25 * result_delta_q.toRotationMatrix() * R_a_1_x * _dt * _dt * -_dt;
-            F.block<3, 3>(3, 3) = Matrix3d::Identity() - R_w_x * _dt;
-            F.block<3, 3>(3, 12) = -1.0 * MatrixXd::Identity(3,3) * _dt;
-            F.block<3, 3>(6, 3) = -0.5 * delta_q.toRotationMatrix() * R_a_0_x * _dt + 
-                                  -0.5 * result_delta_q.toRotationMatrix() * R_a_1_x * (Matrix3d::Identity() - R_w_x * _dt) * _dt;
-            F.block<3, 3>(6, 6) = Matrix3d::Identity();
-            F.block<3, 3>(6, 9) = -0.5 * (delta_q.toRotationMatrix() + result_delta_q.toRotationMatrix()) * _dt;
-            F.block<3, 3>(6, 12) = -0.5 * result_delta_q.toRotationMatrix() * R_a_1_x * _dt * -_dt;
-            F.block<3, 3>(9, 9) = Matrix3d::Identity();
-            F.block<3, 3>(12, 12) = Matrix3d::Identity();
-            //cout<<"A"<<endl<<A<<endl;
-
-            MatrixXd V = MatrixXd::Zero(15,18);
-            V.block<3, 3>(0, 0) =  0.25 * delta_q.toRotationMatrix() * _dt * _dt;
-            V.block<3, 3>(0, 3) =  0.25 * -result_delta_q.toRotationMatrix() * R_a_1_x  * _dt * _dt * 0.5 * _dt;
-            V.block<3, 3>(0, 6) =  0.25 * result_delta_q.toRotationMatrix() * _dt * _dt;
-            V.block<3, 3>(0, 9) =  V.block<3, 3>(0, 3);
-            V.block<3, 3>(3, 3) =  0.5 * MatrixXd::Identity(3,3) * _dt;
-            V.block<3, 3>(3, 9) =  0.5 * MatrixXd::Identity(3,3) * _dt;
-            V.block<3, 3>(6, 0) =  0.5 * delta_q.toRotationMatrix() * _dt;
-            V.block<3, 3>(6, 3) =  0.5 * -result_delta_q.toRotationMatrix() * R_a_1_x  * _dt * 0.5 * _dt;
-            V.block<3, 3>(6, 6) =  0.5 * result_delta_q.toRotationMatrix() * _dt;
-            V.block<3, 3>(6, 9) =  V.block<3, 3>(6, 3);
-            V.block<3, 3>(9, 12) = MatrixXd::Identity(3,3) * _dt;
-            V.block<3, 3>(12, 15) = MatrixXd::Identity(3,3) * _dt;
+            // F (15x15) and V (15x18) are block sparse, only their non trivial 3x3 blocks are formed:
+            // F = [I  F_pr  I*dt  F_pba  F_pbg]    V = [V_pa0 V_pg  V_pa1 V_pg  0     0    ]
+            //     [0  F_rr  0     0      -I*dt]        [0     I*dt/2 0    I*dt/2 0    0    ]
+            //     [0  F_vr  I     F_vba  F_vbg]        [V_va0 V_vg  V_va1 V_vg  0     0    ]
+            //     [0  0     0     I      0    ]        [0     0     0     0     I*dt  0    ]
+            //     [0  0     0     0      I    ]        [0     0     0     0     0     I*dt ]
+            StepJacobian F;
+            F.dt = _dt;
+            F.pr = -0.25 * delta_q.toRotationMatrix() * R_a_0_x * _dt * _dt + 
+                   -0.25 * result_delta_q.toRotationMatrix() * R_a_1_x * (Matrix3d::Identity() - R_w_x * _dt) * _dt * _dt;
+            F.pba = -0.25 * (delta_q.toRotationMatrix() + result_delta_q.toRotationMatrix()) * _dt * _dt;
+            F.pbg = -0.25 * result_delta_q.toRotationMatrix() * R_a_1_x * _dt * _dt * -_dt;
+            F.rr = Matrix3d::Identity() - R_w_x * _dt;
+            F.vr = -0.5 * delta_q.toRotationMatrix() * R_a_0_x * _dt + 
+                   -0.5 * result_delta_q.toRotationMatrix() * R_a_1_x * (Matrix3d::Identity() - R_w_x * _dt) * _dt;
+            F.vba = -0.5 * (delta_q.toRotationMatrix() + result_delta_q.toRotationMatrix()) * _dt;
+            F.vbg = -0.5 * result_delta_q.toRotationMatrix() * R_a_1_x * _dt * -_dt;
+
+            Matrix3d V_pa0 = 0.25 * delta_q.toRotationMatrix() * _dt * _dt;
+            Matrix3d V_pg = 0.25 * -result_delta_q.toRotationMatrix() * R_a_1_x  * _dt * _dt * 0.5 * _dt;
+            Matrix3d V_pa1 = 0.25 * result_delta_q.toRotationMatrix() * _dt * _dt;
+            double V_rg = 0.5 * _dt;
+            Matrix3d V_va0 = 0.5 * delta_q.toRotationMatrix() * _dt;
+            Matrix3d V_vg = 0.5 * -result_delta_q.toRotationMatrix() * R_a_1_x  * _dt * 0.5 * _dt;
+            Matrix3d V_va1 = 0.5 * result_delta_q.toRotationMatrix() * _dt;
 
             //step_jacobian = F;
             //step_V = V;
-            jacobian = F * jacobian;
-            covariance = F * covariance * F.transpose() + V * noise * V.transpose();
+            F.leftMultiply(jacobian);
+
+            // F * P * F^T = F * (F * P)^T for symmetric P
+            Eigen::Matrix<double, 15, 15> FP = covariance;
+            F.leftMultiply(FP);
+            covariance = FP.transpose();
+            F.leftMultiply(covariance);
+
+            // V * noise * V^T, noise is block diagonal
+            const Matrix3d N_a0 = noise.block<3, 3>(0, 0);
+            const Matrix3d N_g = noise.block<3, 3>(3, 3) + noise.block<3, 3>(9, 9);
+            const Matrix3d N_a1 = noise.block<3, 3>(6, 6);
+
+            Matrix3d Q_pp = V_pa0 * N_a0 * V_pa0.transpose() + V_pg * N_g * V_pg.transpose() + V_pa1 * N_a1 * V_pa1.transpose();
+            Matrix3d Q_pr = V_pg * N_g * V_rg;
+            Matrix3d Q_pv = V_pa0 * N_a0 * V_va0.transpose() + V_pg * N_g * V_vg.transpose() + V_pa1 * N_a1 * V_va1.transpose();
+            Matrix3d Q_rv = V_rg * N_g * V_vg.transpose();
+            Matrix3d Q_vv = V_va0 * N_a0 * V_va0.transpose() + V_vg * N_g * V_vg.transpose() + V_va1 * N_a1 * V_va1.transpose();
+
+            covariance.block<3, 3>(O_P, O_P) += Q_pp;
+            covariance.block<3, 3>(O_P, O_R) += Q_pr;
+            covariance.block<3, 3>(O_R, O_P) += Q_pr.transpose();
+            covariance.block<3, 3>(O_P, O_V) += Q_pv;
+            covariance.block<3, 3>(O_V, O_P) += Q_pv.transpose();
+            covariance.block<3, 3>(O_R, O_R) += V_rg * V_rg * N_g;
+            covariance.block<3, 3>(O_R, O_V) += Q_rv;
+            covariance.block<3, 3>(O_V, O_R) += Q_rv.transpose();
+            covariance.block<3, 3>(O_V, O_V) += Q_vv;
+            covariance.block<3, 3>(O_BA, O_BA) += (_dt * _dt) * noise.block<3, 3>(12, 12);
+            covariance.block<3, 3>(O_BG, O_BG) += (_dt * _dt) * noise.block<3, 3>(15, 15);
         }
 
     }
@@ -183,6 +309,13 @@ class IntegrationBase
         sum_dt += dt;
         acc_0 = acc_1;
         gyr_0 = gyr_1;  
+
+        // samples pushed after a bias correction are integrated from the corrected deltas
+        propagated_ba = linearized_ba;
+        propagated_bg = linearized_bg;
+        propagated_delta_p = delta_p;
+        propagated_delta_q = delta_q;
+        propagated_delta_v = delta_v;
      
     }
 
@@ -231,6 +364,14 @@ class IntegrationBase
     Eigen::Quaterniond delta_q;
     Eigen::Vector3d delta_v;
 
+    // bias all samples were integrated with in the last full integration, the threshold of correctBias() is measured from it
+    Eigen::Vector3d integrated_ba, integrated_bg;
+    // bias and deltas of the last sample integration, reference point of the correction in correctBias()
+    Eigen::Vector3d propagated_ba, propagated_bg;
+    Eigen::Vector3d propagated_delta_p;
+    Eigen::Quaterniond propagated_delta_q;
+    Eigen::Vector3d propagated_delta_v;
+
     std::vector<double> dt_buf;
     std::vector<Eigen::Vector3d> acc_buf;
     std::vector<Eigen::Vector3d> gyr_buf;
@@ -11,12 +11,58 @@
 
 namespace vins_multi{
 
+std::mutex ResidualBlockInfo::released_mutex;
+std::vector<ResidualBlockInfo *> ResidualBlockInfo::released;
+
+template <typename ParameterBlocks, typename DropSet>
+ResidualBlockInfo* ResidualBlockInfo::reuse(ceres::CostFunction *_cost_function, ceres::LossFunction *_loss_function,
+                                            const ParameterBlocks &_parameter_blocks, const DropSet &_drop_set)
+{
+    ResidualBlockInfo *info = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(released_mutex);
+        if (!released.empty())
+        {
+            info = released.back();
+            released.pop_back();
+        }
+    }
+    if (!info)
+        return new ResidualBlockInfo(_cost_function, _loss_function, std::vector<double *>(_parameter_blocks.begin(), _parameter_blocks.end()),
+                                     std::vector<int>(_drop_set.begin(), _drop_set.end()));
+
+    info->cost_function = _cost_function;
+    info->loss_function = _loss_function;
+    info->parameter_blocks.assign(_parameter_blocks.begin(), _parameter_blocks.end());
+    info->drop_set.assign(_drop_set.begin(), _drop_set.end());
+    info->linearized = false;
+    return info;
+}
+
+ResidualBlockInfo* ResidualBlockInfo::create(ceres::CostFunction *_cost_function, ceres::LossFunction *_loss_function,
+                                             std::initializer_list<double *> _parameter_blocks, std::initializer_list<int> _drop_set)
+{
+    return reuse(_cost_function, _loss_function, _parameter_blocks, _drop_set);
+}
+
+ResidualBlockInfo* ResidualBlockInfo::create(ceres::CostFunction *_cost_function, ceres::LossFunction *_loss_function,
+                                             const std::vector<double *> &_parameter_blocks, const std::vector<int> &_drop_set)
+{
+    return reuse(_cost_function, _loss_function, _parameter_blocks, _drop_set);
+}
+
+void ResidualBlockInfo::release(ResidualBlockInfo *info)
+{
+    std::lock_guard<std::mutex> lock(released_mutex);
+    released.push_back(info);
+}
+
 void ResidualBlockInfo::Evaluate()
 {
     residuals.resize(cost_function->num_residuals());
 
-    std::vector<int> block_sizes = cost_function->parameter_block_sizes();
-    raw_jacobians = new double *[block_sizes.size()];
+    const std::vector<int> &block_sizes = cost_function->parameter_block_sizes();
+    raw_jacobians.resize(block_sizes.size());
     jacobians.resize(block_sizes.size());
 
     for (int i = 0; i < static_cast<int>(block_sizes.size()); i++)
@@ -25,7 +71,7 @@ void ResidualBlockInfo::Evaluate()
         raw_jacobians[i] = jacobians[i].data();
         //dim += block_sizes[i] == 7 ? 6 : block_sizes[i];
     }
-    cost_function->Evaluate(parameter_blocks.data(), residuals.data(), raw_jacobians);
+    cost_function->Evaluate(parameter_blocks.data(), residuals.data(), raw_jacobians.data());
 
     //std::vector<int> tmp_idx(block_sizes.size());
     //Eigen::MatrixXd tmp(dim, dim);
@@ -72,7 +118,10 @@ void ResidualBlockInfo::Evaluate()
 
         for (int i = 0; i < static_cast<int>(parameter_blocks.size()); i++)
         {
-            jacobians[i] = sqrt_rho1_ * (jacobians[i] - alpha_sq_norm_ * residuals * (residuals.transpose() * jacobians[i]));
+            if (alpha_sq_norm_ == 0.0)
+                jacobians[i] *= sqrt_rho1_;
+            else
+                jacobians[i] = sqrt_rho1_ * (jacobians[i] - alpha_sq_norm_ * residuals * (residuals.transpose() * jacobians[i]));
         }
 
         residuals *= residual_scaling_;
@@ -88,12 +137,9 @@ MarginalizationInfo::~MarginalizationInfo()
 
     for (int i = 0; i < (int)factors.size(); i++)
     {
-
-        delete[] factors[i]->raw_jacobians;
-        
         delete factors[i]->cost_function;
 
-        delete factors[i];
+        ResidualBlockInfo::release(factors[i]);
     }
 }
 
@@ -102,7 +148,7 @@ void MarginalizationInfo::addResidualBlockInfo(ResidualBlockInfo *residual_block
     factors.emplace_back(residual_block_info);
 
     std::vector<double *> &parameter_blocks = residual_block_info->parameter_blocks;
-    std::vector<int> parameter_block_sizes = residual_block_info->cost_function->parameter_block_sizes();
+    const std::vector<int> &parameter_block_sizes = residual_block_info->cost_function->parameter_block_sizes();
 
     for (int i = 0; i < static_cast<int>(residual_block_info->parameter_blocks.size()); i++)
     {
@@ -118,12 +164,27 @@ void MarginalizationInfo::addResidualBlockInfo(ResidualBlockInfo *residual_block
     }
 }
 
+ThreadPool* MarginalizationInfo::thread_pool = nullptr;
+
 void MarginalizationInfo::preMarginalize()
 {
+    // the factors are independent, only the parameter block copies below need to be serial
+    const int thread_num = thread_pool ? std::min<int>(thread_pool->size(), factors.size()) : 1;
+    auto evaluate_factors = [this, thread_num](int k)
+    {
+        for (int i = k; i < static_cast<int>(factors.size()); i += thread_num)
+        {
+            if (!factors[i]->linearized)
+                factors[i]->Evaluate();
+        }
+    };
+    if (thread_pool)
+        thread_pool->parallelFor(thread_num, evaluate_factors);
+    else
+        evaluate_factors(0);
+
     for (auto it : factors)
     {
-        it->Evaluate();
-        
         if(it->residuals.hasNaN()){
             std::cout<<it->residuals<<std::endl;
             ROS_ERROR("margin has nan!");
@@ -154,9 +215,8 @@ int MarginalizationInfo::globalSize(int size) const
     return size == 6 ? 7 : size;
 }
 
-void* ThreadsConstructA(void* threadsstruct)
+void ThreadsConstructA(ThreadsStruct* p)
 {
-    ThreadsStruct* p = ((ThreadsStruct*)threadsstruct);
     for (auto it : p->sub_factors)
     {
         for (int i = 0; i < static_cast<int>(it->parameter_blocks.size()); i++)
@@ -184,7 +244,6 @@ void* ThreadsConstructA(void* threadsstruct)
             p->b.segment(idx_i, size_i) += jacobian_i.transpose() * it->residuals;
         }
     }
-    return threadsstruct;
 }
 
 void MarginalizationInfo::marginalize()
@@ -251,32 +310,29 @@ void MarginalizationInfo::marginalize()
 
 
     TicToc t_thread_summing;
-    pthread_t tids[NUM_THREADS];
-    ThreadsStruct threadsstruct[NUM_THREADS];
+    const int thread_num = thread_pool ? std::max(1, std::min<int>(thread_pool->size(), factors.size())) : 1;
+    std::vector<ThreadsStruct> threadsstruct(thread_num);
     int i = 0;
     for (auto it : factors)
     {
         threadsstruct[i].sub_factors.push_back(it);
         i++;
-        i = i % NUM_THREADS;
+        i = i % thread_num;
     }
-    for (int i = 0; i < NUM_THREADS; i++)
+    auto construct_A = [&](int k)
     {
-        TicToc zero_matrix;
-        threadsstruct[i].A = Eigen::MatrixXd::Zero(pos,pos);
-        threadsstruct[i].b = Eigen::VectorXd::Zero(pos);
-        threadsstruct[i].parameter_block_size = parameter_block_size;
-        threadsstruct[i].parameter_block_idx = parameter_block_idx;
-        int ret = pthread_create( &tids[i], NULL, ThreadsConstructA ,(void*)&(threadsstruct[i]));
-        if (ret != 0)
-        {
-            ROS_WARN("pthread_create error");
-            ROS_BREAK();
-        }
-    }
-    for( int i = NUM_THREADS - 1; i >= 0; i--)  
+        threadsstruct[k].A = Eigen::MatrixXd::Zero(pos,pos);
+        threadsstruct[k].b = Eigen::VectorXd::Zero(pos);
+        threadsstruct[k].parameter_block_size = parameter_block_size;
+        threadsstruct[k].parameter_block_idx = parameter_block_idx;
+        ThreadsConstructA(&threadsstruct[k]);
+    };
+    if (thread_pool)
+        thread_pool->parallelFor(thread_num, construct_A);
+    else
+        construct_A(0);
+    for (int i = thread_num - 1; i >= 0; i--)
     {
-        pthread_join( tids[i], NULL ); 
         A += threadsstruct[i].A;
         b += threadsstruct[i].b;
     }
@@ -12,22 +12,33 @@
 #include <ros/ros.h>
 #include <ros/console.h>
 #include <cstdlib>
-#include <pthread.h>
 #include <ceres/ceres.h>
+#include <initializer_list>
+#include <mutex>
 #include <unordered_map>
 
 #include "../utility/utility.h"
+#include "../utility/object_pool.h"
+#include "../utility/thread_pool.h"
 #include "../utility/tic_toc.h"
 
 namespace vins_multi{
 
-const int NUM_THREADS = 4;
-
+// instances are recycled through create/release only, they are never deleted
 struct ResidualBlockInfo
 {
     ResidualBlockInfo(ceres::CostFunction *_cost_function, ceres::LossFunction *_loss_function, std::vector<double *> _parameter_blocks, std::vector<int> _drop_set)
         : cost_function(_cost_function), loss_function(_loss_function), parameter_blocks(_parameter_blocks), drop_set(_drop_set) {}
 
+    // takes a released instance if there is one, it keeps the capacity of its vectors and jacobians,
+    // so building the marginalization factors does not allocate once the window has reached its size
+    static ResidualBlockInfo* create(ceres::CostFunction *_cost_function, ceres::LossFunction *_loss_function,
+                                     std::initializer_list<double *> _parameter_blocks, std::initializer_list<int> _drop_set);
+    static ResidualBlockInfo* create(ceres::CostFunction *_cost_function, ceres::LossFunction *_loss_function,
+                                     const std::vector<double *> &_parameter_blocks, const std::vector<int> &_drop_set);
+    // counterpart of create, the cost function is not touched
+    static void release(ResidualBlockInfo *info);
+
     void Evaluate();
 
     ceres::CostFunction *cost_function;
@@ -35,14 +46,24 @@ struct ResidualBlockInfo
     std::vector<double *> parameter_blocks;
     std::vector<int> drop_set;
 
-    double **raw_jacobians;
+    std::vector<double *> raw_jacobians;
     std::vector<Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>> jacobians;
     Eigen::VectorXd residuals;
+    // jacobians and residuals were handed over from the solver, preMarginalize does not evaluate again
+    bool linearized = false;
 
     int localSize(int size)
     {
         return size == 7 ? 6 : size;
     }
+
+  private:
+    template <typename ParameterBlocks, typename DropSet>
+    static ResidualBlockInfo* reuse(ceres::CostFunction *_cost_function, ceres::LossFunction *_loss_function,
+                                    const ParameterBlocks &_parameter_blocks, const DropSet &_drop_set);
+
+    static std::mutex released_mutex;
+    static std::vector<ResidualBlockInfo *> released;
 };
 
 struct ThreadsStruct
@@ -82,9 +103,12 @@ class MarginalizationInfo
     const double eps = 1e-8;
     bool valid;
 
+    // shared workers for preMarginalize and marginalize, serial if not set
+    static ThreadPool* thread_pool;
+
 };
 
-class MarginalizationFactor : public ceres::CostFunction
+class MarginalizationFactor : public ceres::CostFunction, public PooledObject<MarginalizationFactor>
 {
   public:
     MarginalizationFactor(MarginalizationInfo* _marginalization_info);
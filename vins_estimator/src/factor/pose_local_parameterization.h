@@ -12,10 +12,11 @@
 #include <eigen3/Eigen/Dense>
 #include <ceres/ceres.h>
 #include "../utility/utility.h"
+#include "../utility/object_pool.h"
 
 namespace vins_multi{
 
-class PoseLocalParameterization : public ceres::LocalParameterization
+class PoseLocalParameterization : public ceres::LocalParameterization, public PooledObject<PoseLocalParameterization>
 {
     virtual bool Plus(const double *x, const double *delta, double *x_plus_delta) const;
     virtual bool ComputeJacobian(const double *x, double *jacobian) const;
@@ -13,12 +13,13 @@
 #include <ceres/ceres.h>
 #include <Eigen/Dense>
 #include "../utility/utility.h"
+#include "../utility/object_pool.h"
 #include "../utility/tic_toc.h"
 #include "../estimator/parameters.h"
 
 namespace vins_multi{
 
-class ProjectionOneFrameTwoCamFactor : public ceres::SizedCostFunction<2, 7, 7, 1, 1>
+class ProjectionOneFrameTwoCamFactor : public ceres::SizedCostFunction<2, 7, 7, 1, 1>, public PooledObject<ProjectionOneFrameTwoCamFactor>
 {
   public:
     ProjectionOneFrameTwoCamFactor(const Eigen::Vector3d &_pts_i, const Eigen::Vector3d &_pts_j,
@@ -13,12 +13,13 @@
 #include <ceres/ceres.h>
 #include <Eigen/Dense>
 #include "../utility/utility.h"
+#include "../utility/object_pool.h"
 #include "../utility/tic_toc.h"
 #include "../estimator/parameters.h"
 
 namespace vins_multi{
 
-class ProjectionTwoFrameOneCamDepthFactor : public ceres::SizedCostFunction<3, 7, 7, 7, 1, 1>
+class ProjectionTwoFrameOneCamDepthFactor : public ceres::SizedCostFunction<3, 7, 7, 7, 1, 1>, public PooledObject<ProjectionTwoFrameOneCamDepthFactor>
 {
   public:
     ProjectionTwoFrameOneCamDepthFactor(const Eigen::Vector3d &_pts_i, const Eigen::Vector3d &_pts_j,
@@ -0,0 +1,551 @@
+/*******************************************************
+ * Copyright (C) 2025, Aerial Robotics Group, Hong Kong University of Science and Technology
+ *
+ * This file is part of VINS.
+ *
+ * Licensed under the GNU General Public License v3.0;
+ * you may not use this file except in compliance with the License.
+ *******************************************************/
+
+#include "window_solver.h"
+
+namespace vins_multi{
+
+bool WindowSolver::solve(ceres::Problem &problem, const std::vector<double *> &dense_scalars, const Options &options, Summary *summary)
+{
+    TicToc t_solve;
+    thread_pool_ = options.thread_pool;
+    num_chunks_ = thread_pool_ ? std::max(1U, thread_pool_->size()) : 1;
+    solution_linearized_ = false;
+
+    if (!setup(problem, dense_scalars))
+        return false;
+
+    *summary = Summary();
+    double cost = evaluateCost();
+    summary->initial_cost = summary->final_cost = cost;
+    if (residuals_.empty())
+        return true;
+
+    chunks_.resize(num_chunks_);
+    for (auto &chunk : chunks_)
+    {
+        chunk.H.resize(dense_dim_, dense_dim_);
+        chunk.b.resize(dense_dim_);
+        chunk.diag.resize(dense_dim_);
+    }
+
+    double lambda = options.initial_lambda;
+    bool relinearize = true;
+    Eigen::VectorXd dx;
+    while (summary->successful_steps + summary->unsuccessful_steps < options.max_num_iterations &&
+           t_solve.toc() < options.max_solver_time_in_seconds * 1e3)
+    {
+        if (relinearize)
+        {
+            linearize();
+            summary->linearizations++;
+            relinearize = false;
+        }
+
+        reduce(lambda);
+        Eigen::LLT<Eigen::MatrixXd, Eigen::Upper> llt(H_);
+        if (llt.info() != Eigen::Success)
+        {
+            lambda *= 10.0;
+            summary->unsuccessful_steps++;
+            continue;
+        }
+        dx = llt.solve(b_);
+
+        backup();
+        step(dx);
+        const double new_cost = evaluateCost();
+        if (new_cost < cost && (cost - new_cost) / cost < 1e-6)
+        {
+            // converged, the negligible step is dropped so that the solution keeps its linearization
+            restore();
+            summary->unsuccessful_steps++;
+            break;
+        }
+        else if (new_cost < cost)
+        {
+            cost = new_cost;
+            lambda = std::max(lambda / 3.0, 1e-10);
+            summary->successful_steps++;
+            relinearize = true;
+        }
+        else
+        {
+            // the jacobians are still those of the restored point
+            restore();
+            lambda *= 4.0;
+            summary->unsuccessful_steps++;
+        }
+    }
+
+    if (relinearize && options.linearize_solution && summary->linearizations > 0)
+    {
+        // the evaluations are the ones the marginalization would do anyway
+        linearize();
+        summary->linearizations++;
+        relinearize = false;
+    }
+
+    summary->final_cost = cost;
+    summary->total_time_ms = t_solve.toc();
+    solution_linearized_ = summary->linearizations > 0 && !relinearize;
+    return true;
+}
+
+namespace
+{
+
+template <typename Key, typename Value>
+bool keyLess(const std::pair<Key, Value> &a, const Key &b)
+{
+    return std::less<Key>()(a.first, b);
+}
+
+// index of key in a vector of pairs sorted by key, -1 if missing
+template <typename Key>
+int findIndex(const std::vector<std::pair<Key, int>> &index, const Key &key)
+{
+    auto it = std::lower_bound(index.begin(), index.end(), key, keyLess<Key, int>);
+    return it != index.end() && it->first == key ? it->second : -1;
+}
+
+}
+
+bool WindowSolver::takeLinearization(ResidualBlockInfo &info)
+{
+    if (!solution_linearized_)
+        return false;
+
+    for (double *data : info.parameter_blocks)
+    {
+        const int landmark = findIndex<const double *>(landmark_index_, data);
+        if (landmark < 0)
+            continue;
+        for (const int r : landmarks_[landmark].residuals)
+        {
+            Residual &residual = *residuals_[r];
+            const ResidualBlockInfo &linearized = residual.info;
+            if (!residual.linearized || linearized.parameter_blocks != info.parameter_blocks ||
+                linearized.loss_function != info.loss_function || typeid(*linearized.cost_function) != typeid(*info.cost_function))
+                continue;
+            // swapped, so the storage info had is reused by the next linearization of this entry
+            info.jacobians.swap(residual.info.jacobians);
+            info.residuals.swap(residual.info.residuals);
+            residual.linearized = false;
+            return true;
+        }
+        return false;
+    }
+    return false;
+}
+
+bool WindowSolver::setup(ceres::Problem &problem, const std::vector<double *> &dense_scalars)
+{
+    dense_blocks_.clear();
+    dense_index_.clear();
+    for (auto &landmark : landmarks_)
+        spare_landmarks_.push_back(std::move(landmark));
+    landmarks_.clear();
+    landmark_index_.clear();
+    landmark_refs_.clear();
+    dense_residuals_.clear();
+    dense_dim_ = 0;
+
+    problem.GetResidualBlocks(&residual_ids_);
+    acquireResiduals();
+
+    for (int i = 0; i < static_cast<int>(residuals_.size()); i++)
+    {
+        Residual &residual = *residuals_[i];
+        ResidualBlockInfo &info = residual.info;
+        info.cost_function = const_cast<ceres::CostFunction *>(problem.GetCostFunctionForResidualBlock(residual_ids_[i]));
+        info.loss_function = const_cast<ceres::LossFunction *>(problem.GetLossFunctionForResidualBlock(residual_ids_[i]));
+        problem.GetParameterBlocksForResidualBlock(residual_ids_[i], &info.parameter_blocks);
+        residual.dense_idx.assign(info.parameter_blocks.size(), -1);
+        residual.landmark_param = -1;
+        residual.linearized = false;
+
+        for (int k = 0; k < static_cast<int>(info.parameter_blocks.size()); k++)
+        {
+            double *data = info.parameter_blocks[k];
+            if (problem.IsParameterBlockConstant(data))
+                continue;
+
+            const int size = problem.ParameterBlockSize(data);
+            if (size == 1 && std::find(dense_scalars.begin(), dense_scalars.end(), data) == dense_scalars.end())
+            {
+                if (residual.landmark_param >= 0)
+                {
+                    ROS_DEBUG("window solver: residual block with two landmarks");
+                    return false;
+                }
+                residual.landmark_param = k;
+                landmark_refs_.emplace_back(data, i);
+            }
+            else
+            {
+                auto it = std::lower_bound(dense_index_.begin(), dense_index_.end(), data, keyLess<const double *, int>);
+                if (it == dense_index_.end() || it->first != data)
+                {
+                    const int local_size = problem.ParameterBlockLocalSize(data);
+                    if (local_size > MAX_BLOCK_SIZE)
+                    {
+                        ROS_DEBUG("window solver: parameter block of local size %d", local_size);
+                        return false;
+                    }
+                    it = dense_index_.emplace(it, data, dense_blocks_.size());
+                    dense_blocks_.push_back(DenseBlock{data, size, local_size, dense_dim_, problem.GetParameterization(data)});
+                    dense_dim_ += local_size;
+                }
+                residual.dense_idx[k] = it->second;
+            }
+        }
+
+        if (residual.landmark_param < 0)
+            dense_residuals_.push_back(i);
+    }
+
+    // landmarks in address order, each with its residuals in problem order
+    std::sort(landmark_refs_.begin(), landmark_refs_.end(), [](const std::pair<double *, int> &a, const std::pair<double *, int> &b) {
+        return std::less<double *>()(a.first, b.first) || (a.first == b.first && a.second < b.second);
+    });
+    for (auto &ref : landmark_refs_)
+    {
+        if (landmarks_.empty() || landmarks_.back().data != ref.first)
+        {
+            landmark_index_.emplace_back(ref.first, landmarks_.size());
+            addLandmark(ref.first);
+        }
+        landmarks_.back().residuals.push_back(ref.second);
+    }
+    return true;
+}
+
+// residuals_[i] becomes the entry of residual_ids_[i]: the one of the last solve if the block was already
+// there, otherwise one released by a removed block or, only while the problem grows, a new one
+void WindowSolver::acquireResiduals()
+{
+    residuals_.clear();
+    for (auto residual_id : residual_ids_)
+    {
+        auto it = std::lower_bound(residual_cache_.begin(), residual_cache_.end(), residual_id, keyLess<ceres::ResidualBlockId, Residual *>);
+        if (it != residual_cache_.end() && it->first == residual_id)
+        {
+            residuals_.push_back(it->second);
+            it->second = nullptr;
+        }
+        else
+            residuals_.push_back(nullptr);
+    }
+
+    for (auto &cached : residual_cache_)
+    {
+        if (cached.second)
+            free_residuals_.push_back(cached.second);
+    }
+    residual_cache_.clear();
+
+    for (size_t i = 0; i < residuals_.size(); i++)
+    {
+        if (!residuals_[i])
+        {
+            if (free_residuals_.empty())
+            {
+                residual_storage_.emplace_back(new Residual{ResidualBlockInfo(nullptr, nullptr, std::vector<double *>(), std::vector<int>()), std::vector<int>(), -1, false});
+                residuals_[i] = residual_storage_.back().get();
+            }
+            else
+            {
+                residuals_[i] = free_residuals_.back();
+                free_residuals_.pop_back();
+            }
+        }
+        residual_cache_.emplace_back(residual_ids_[i], residuals_[i]);
+    }
+    std::sort(residual_cache_.begin(), residual_cache_.end(), [](const std::pair<ceres::ResidualBlockId, Residual *> &a, const std::pair<ceres::ResidualBlockId, Residual *> &b) {
+        return std::less<ceres::ResidualBlockId>()(a.first, b.first);
+    });
+}
+
+void WindowSolver::addLandmark(double *data)
+{
+    if (spare_landmarks_.empty())
+        landmarks_.emplace_back();
+    else
+    {
+        landmarks_.push_back(std::move(spare_landmarks_.back()));
+        spare_landmarks_.pop_back();
+    }
+    Landmark &landmark = landmarks_.back();
+    landmark.data = data;
+    landmark.residuals.clear();
+    landmark.w.clear();
+    landmark.h = 0.0;
+    landmark.b = 0.0;
+}
+
+void WindowSolver::linearize()
+{
+    parallelFor(num_chunks_, [&](const int c) {
+        const size_t end = (c + 1) * residuals_.size() / num_chunks_;
+        for (size_t i = c * residuals_.size() / num_chunks_; i < end; i++)
+        {
+            residuals_[i]->info.Evaluate();
+            residuals_[i]->linearized = true;
+        }
+    });
+}
+
+void WindowSolver::accumulateDense(const Residual &residual, Chunk &chunk)
+{
+    const ResidualBlockInfo &info = residual.info;
+    for (size_t k = 0; k < residual.dense_idx.size(); k++)
+    {
+        if (residual.dense_idx[k] < 0)
+            continue;
+        const DenseBlock &block_k = dense_blocks_[residual.dense_idx[k]];
+        const auto J_k = info.jacobians[k].leftCols(block_k.local_size);
+        chunk.b.segment(block_k.offset, block_k.local_size).noalias() -= J_k.transpose() * info.residuals;
+        chunk.diag.segment(block_k.offset, block_k.local_size) += J_k.colwise().squaredNorm().transpose();
+
+        for (size_t j = 0; j < residual.dense_idx.size(); j++)
+        {
+            if (residual.dense_idx[j] < 0 || dense_blocks_[residual.dense_idx[j]].offset < block_k.offset)
+                continue;
+            const DenseBlock &block_j = dense_blocks_[residual.dense_idx[j]];
+            chunk.H.block(block_k.offset, block_j.offset, block_k.local_size, block_j.local_size).noalias() +=
+                J_k.transpose() * info.jacobians[j].leftCols(block_j.local_size);
+        }
+    }
+}
+
+WindowSolver::LandmarkRow &WindowSolver::couplingRow(Landmark &landmark, const int idx)
+{
+    for (auto &w : landmark.w)
+    {
+        if (w.first == idx)
+            return w.second;
+    }
+    landmark.w.emplace_back(idx, LandmarkRow::Zero());
+    return landmark.w.back().second;
+}
+
+// the bulk of the residuals: 2d reprojection errors, done with zero padded fixed size blocks
+void WindowSolver::accumulateProjection(const Residual &residual, Chunk &chunk, Landmark &landmark, double &h, double &b)
+{
+    typedef Eigen::Matrix<double, 2, MAX_BLOCK_SIZE> ProjectionJacobian;
+    ProjectionJacobian J[MAX_PROJECTION_BLOCKS];
+    const DenseBlock *blocks[MAX_PROJECTION_BLOCKS];
+    int num = 0;
+
+    const ResidualBlockInfo &info = residual.info;
+    for (size_t k = 0; k < residual.dense_idx.size(); k++)
+    {
+        if (residual.dense_idx[k] < 0)
+            continue;
+        blocks[num] = &dense_blocks_[residual.dense_idx[k]];
+        J[num].setZero();
+        J[num].leftCols(blocks[num]->local_size) = info.jacobians[k].leftCols(blocks[num]->local_size);
+        num++;
+    }
+
+    const Eigen::Vector2d J_l = info.jacobians[residual.landmark_param].col(0);
+    const Eigen::Vector2d r = info.residuals;
+    h += J_l.squaredNorm();
+    b -= J_l.dot(r);
+
+    for (int a = 0; a < num; a++)
+    {
+        const int offset_a = blocks[a]->offset, size_a = blocks[a]->local_size;
+        couplingRow(landmark, blocks[a] - dense_blocks_.data()).noalias() += J_l.transpose() * J[a];
+        chunk.b.segment(offset_a, size_a) -= (J[a].transpose() * r).head(size_a);
+        chunk.diag.segment(offset_a, size_a) += J[a].colwise().squaredNorm().head(size_a).transpose();
+        for (int c = 0; c < num; c++)
+        {
+            if (blocks[c]->offset < offset_a)
+                continue;
+            const Eigen::Matrix<double, MAX_BLOCK_SIZE, MAX_BLOCK_SIZE> JtJ = J[a].transpose() * J[c];
+            chunk.H.block(offset_a, blocks[c]->offset, size_a, blocks[c]->local_size) += JtJ.topLeftCorner(size_a, blocks[c]->local_size);
+        }
+    }
+}
+
+// damped reduced system H_ dx = b_, every chunk eliminates its own landmarks. only the upper triangle
+// of H_ is built
+void WindowSolver::reduce(const double lambda)
+{
+    parallelFor(num_chunks_, [&](const int c) {
+        Chunk &chunk = chunks_[c];
+        chunk.H.setZero();
+        chunk.b.setZero();
+        chunk.diag.setZero();
+
+        const size_t l_end = (c + 1) * landmarks_.size() / num_chunks_;
+        for (size_t l = c * landmarks_.size() / num_chunks_; l < l_end; l++)
+        {
+            Landmark &landmark = landmarks_[l];
+            double h = 0.0, b = 0.0;
+            landmark.w.clear();
+            for (const int r : landmark.residuals)
+            {
+                const Residual &residual = *residuals_[r];
+                if (residual.info.residuals.size() == 2 && residual.dense_idx.size() <= MAX_PROJECTION_BLOCKS)
+                {
+                    accumulateProjection(residual, chunk, landmark, h, b);
+                    continue;
+                }
+
+                const ResidualBlockInfo &info = residual.info;
+                const auto J_l = info.jacobians[residual.landmark_param].col(0);
+                h += J_l.squaredNorm();
+                b -= J_l.dot(info.residuals);
+                for (size_t k = 0; k < residual.dense_idx.size(); k++)
+                {
+                    const int idx = residual.dense_idx[k];
+                    if (idx < 0)
+                        continue;
+                    const int size = dense_blocks_[idx].local_size;
+                    couplingRow(landmark, idx).head(size).noalias() += J_l.transpose() * info.jacobians[k].leftCols(size);
+                }
+                accumulateDense(residual, chunk);
+            }
+
+            landmark.h = std::max(h * (1.0 + lambda), 1e-8);
+            landmark.b = b;
+            const double inv_h = 1.0 / landmark.h;
+            for (auto &w_a : landmark.w)
+            {
+                const DenseBlock &block_a = dense_blocks_[w_a.first];
+                chunk.b.segment(block_a.offset, block_a.local_size) -= w_a.second.head(block_a.local_size).transpose() * (b * inv_h);
+                for (auto &w_b : landmark.w)
+                {
+                    const DenseBlock &block_b = dense_blocks_[w_b.first];
+                    if (block_b.offset < block_a.offset)
+                        continue;
+                    // full fixed size product, the padding columns are zero
+                    const Eigen::Matrix<double, MAX_BLOCK_SIZE, MAX_BLOCK_SIZE> outer = w_a.second.transpose() * (w_b.second * inv_h);
+                    chunk.H.block(block_a.offset, block_b.offset, block_a.local_size, block_b.local_size) -= outer.topLeftCorner(block_a.local_size, block_b.local_size);
+                }
+            }
+        }
+
+        const size_t r_end = (c + 1) * dense_residuals_.size() / num_chunks_;
+        for (size_t i = c * dense_residuals_.size() / num_chunks_; i < r_end; i++)
+            accumulateDense(*residuals_[dense_residuals_[i]], chunk);
+    });
+
+    H_ = chunks_[0].H;
+    b_ = chunks_[0].b;
+    diag_ = chunks_[0].diag;
+    for (int c = 1; c < num_chunks_; c++)
+    {
+        H_ += chunks_[c].H;
+        b_ += chunks_[c].b;
+        diag_ += chunks_[c].diag;
+    }
+    H_.diagonal() += lambda * diag_.cwiseMax(1e-6);
+}
+
+void WindowSolver::step(const Eigen::VectorXd &dx)
+{
+    double x_plus_delta[MAX_BLOCK_SIZE + 1];
+    for (auto &block : dense_blocks_)
+    {
+        if (block.parameterization)
+        {
+            block.parameterization->Plus(block.data, dx.data() + block.offset, x_plus_delta);
+            std::copy(x_plus_delta, x_plus_delta + block.size, block.data);
+        }
+        else
+        {
+            for (int i = 0; i < block.size; i++)
+                block.data[i] += dx(block.offset + i);
+        }
+    }
+
+    for (auto &landmark : landmarks_)
+    {
+        double rhs = landmark.b;
+        for (auto &w : landmark.w)
+        {
+            const DenseBlock &block = dense_blocks_[w.first];
+            rhs -= w.second.head(block.local_size).dot(dx.segment(block.offset, block.local_size));
+        }
+        landmark.data[0] += rhs / landmark.h;
+    }
+}
+
+double WindowSolver::evaluateCost()
+{
+    chunks_.resize(num_chunks_);
+    parallelFor(num_chunks_, [&](const int c) {
+        Chunk &chunk = chunks_[c];
+        chunk.cost = 0.0;
+        const size_t end = (c + 1) * residuals_.size() / num_chunks_;
+        for (size_t i = c * residuals_.size() / num_chunks_; i < end; i++)
+        {
+            const ResidualBlockInfo &info = residuals_[i]->info;
+            chunk.residuals.resize(info.cost_function->num_residuals());
+            if (!info.cost_function->Evaluate(info.parameter_blocks.data(), chunk.residuals.data(), nullptr))
+            {
+                chunk.cost = std::numeric_limits<double>::infinity();
+                return;
+            }
+            const double sq_norm = chunk.residuals.squaredNorm();
+            if (info.loss_function)
+            {
+                double rho[3];
+                info.loss_function->Evaluate(sq_norm, rho);
+                chunk.cost += 0.5 * rho[0];
+            }
+            else
+                chunk.cost += 0.5 * sq_norm;
+        }
+    });
+
+    double cost = 0.0;
+    for (auto &chunk : chunks_)
+        cost += chunk.cost;
+    return cost;
+}
+
+void WindowSolver::backup()
+{
+    dense_backup_.clear();
+    for (auto &block : dense_blocks_)
+        dense_backup_.insert(dense_backup_.end(), block.data, block.data + block.size);
+    landmark_backup_.resize(landmarks_.size());
+    for (size_t l = 0; l < landmarks_.size(); l++)
+        landmark_backup_[l] = landmarks_[l].data[0];
+}
+
+void WindowSolver::restore()
+{
+    auto it = dense_backup_.begin();
+    for (auto &block : dense_blocks_)
+    {
+        std::copy(it, it + block.size, block.data);
+        it += block.size;
+    }
+    for (size_t l = 0; l < landmarks_.size(); l++)
+        landmarks_[l].data[0] = landmark_backup_[l];
+}
+
+void WindowSolver::parallelFor(const int num, const std::function<void(int)> &f)
+{
+    if (thread_pool_)
+        thread_pool_->parallelFor(num, f);
+    else
+    {
+        for (int i = 0; i < num; i++)
+            f(i);
+    }
+}
+
+}
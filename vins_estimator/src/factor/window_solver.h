@@ -0,0 +1,160 @@
+/*******************************************************
+ * Copyright (C) 2025, Aerial Robotics Group, Hong Kong University of Science and Technology
+ *
+ * This file is part of VINS.
+ *
+ * Licensed under the GNU General Public License v3.0;
+ * you may not use this file except in compliance with the License.
+ *******************************************************/
+
+#pragma once
+
+#include <ceres/ceres.h>
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+#include <eigen3/Eigen/Dense>
+
+#include "marginalization_factor.h"
+#include "../utility/thread_pool.h"
+
+namespace vins_multi{
+
+// levenberg-marquardt on the sliding window problem with the inverse depths eliminated up front.
+// every residual block touches at most one landmark (a size 1 block that is not listed as dense),
+// so the landmark part of the hessian is diagonal and the reduced system over poses, speed biases,
+// extrinsics and td is built landmark by landmark from fixed size rows.
+// as in MarginalizationInfo, the factors give their jacobians in the tangent space in the first
+// LocalSize() columns of every block
+class WindowSolver
+{
+  public:
+    struct Options
+    {
+        int max_num_iterations = 10;
+        double max_solver_time_in_seconds = 0.05;
+        double initial_lambda = 1e-4;
+        // linearize once more if the solve stops right after a step, so that takeLinearization has
+        // the jacobians at the solution. set when a marginalization follows
+        bool linearize_solution = false;
+        // serial if not set
+        ThreadPool *thread_pool = nullptr;
+    };
+
+    struct Summary
+    {
+        int linearizations = 0;
+        int successful_steps = 0;
+        int unsuccessful_steps = 0;
+        double initial_cost = 0.0;
+        double final_cost = 0.0;
+        double total_time_ms = 0.0;
+    };
+
+    // false if the problem does not have the structure above, the parameters are untouched then.
+    // dense_scalars are the size 1 parameter blocks that are no landmarks, e.g. td
+    bool solve(ceres::Problem &problem, const std::vector<double *> &dense_scalars, const Options &options, Summary *summary);
+
+    // moves the jacobians and residuals of the last solve over to info if a residual block of a landmark in it is
+    // the same factor on the same parameter blocks. only if the solve ended at the point of its last linearization,
+    // i.e. not right after a step unless linearize_solution is set, and the parameters did not change since
+    bool takeLinearization(ResidualBlockInfo &info);
+    void releaseLinearization() { solution_linearized_ = false; }
+
+    static const int MAX_BLOCK_SIZE = 9;
+    static const int MAX_PROJECTION_BLOCKS = 6;
+
+  private:
+    typedef Eigen::Matrix<double, 1, MAX_BLOCK_SIZE> LandmarkRow;
+
+    struct DenseBlock
+    {
+        double *data;
+        int size;
+        int local_size;
+        int offset;
+        const ceres::LocalParameterization *parameterization;
+    };
+
+    struct Residual
+    {
+        ResidualBlockInfo info;
+        // per parameter block: index into dense_blocks_, -1 for the landmark and constant blocks
+        std::vector<int> dense_idx;
+        // parameter block index of the landmark, -1 if none
+        int landmark_param;
+        // jacobians and residuals of info belong to the current parameters
+        bool linearized;
+    };
+
+    struct Landmark
+    {
+        double *data;
+        std::vector<int> residuals;
+        // damped diagonal, right hand side and coupling to the dense blocks of the last reduction
+        double h;
+        double b;
+        std::vector<std::pair<int, LandmarkRow>> w;
+    };
+
+    struct Chunk
+    {
+        Eigen::MatrixXd H;
+        Eigen::VectorXd b;
+        // diagonal of the undamped hessian of the dense blocks before the elimination
+        Eigen::VectorXd diag;
+        Eigen::VectorXd residuals;
+        double cost;
+    };
+
+    bool setup(ceres::Problem &problem, const std::vector<double *> &dense_scalars);
+    void acquireResiduals();
+    void addLandmark(double *data);
+    void linearize();
+    void reduce(const double lambda);
+    void accumulateDense(const Residual &residual, Chunk &chunk);
+    void accumulateProjection(const Residual &residual, Chunk &chunk, Landmark &landmark, double &h, double &b);
+    LandmarkRow &couplingRow(Landmark &landmark, const int idx);
+    double evaluateCost();
+    void step(const Eigen::VectorXd &dx);
+    void backup();
+    void restore();
+    void parallelFor(const int num, const std::function<void(int)> &f);
+
+    ThreadPool *thread_pool_ = nullptr;
+    int num_chunks_ = 1;
+
+    // all lookup tables are sorted vectors and all entries are recycled, so that a solve on a problem
+    // of steady size does not allocate
+    std::vector<DenseBlock> dense_blocks_;
+    std::vector<std::pair<const double *, int>> dense_index_;
+    std::vector<Landmark> landmarks_;
+    std::vector<Landmark> spare_landmarks_;
+    std::vector<std::pair<const double *, int>> landmark_index_;
+    std::vector<std::pair<double *, int>> landmark_refs_;
+
+    // the residuals of this solve in problem order. the entries keep their jacobian storage and stay
+    // with their residual block across solves, those of removed blocks are taken by the new ones
+    std::vector<Residual *> residuals_;
+    std::vector<ceres::ResidualBlockId> residual_ids_;
+    std::vector<std::pair<ceres::ResidualBlockId, Residual *>> residual_cache_;
+    std::vector<Residual *> free_residuals_;
+    std::vector<std::unique_ptr<Residual>> residual_storage_;
+    // residuals without a landmark, e.g. imu and prior
+    std::vector<int> dense_residuals_;
+    std::vector<Chunk> chunks_;
+    int dense_dim_ = 0;
+    bool solution_linearized_ = false;
+
+    Eigen::MatrixXd H_;
+    Eigen::VectorXd b_;
+    Eigen::VectorXd diag_;
+    std::vector<double> dense_backup_;
+    std::vector<double> landmark_backup_;
+};
+
+}
@@ -0,0 +1,146 @@
+/*******************************************************
+ * Copyright (C) 2025, Aerial Robotics Group, Hong Kong University of Science and Technology
+ *
+ * This file is part of VINS.
+ *
+ * Licensed under the GNU General Public License v3.0;
+ * you may not use this file except in compliance with the License.
+ *******************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "../utility/thread_pool.h"
+
+namespace vins_multi{
+
+// contrast limited adaptive histogram equalization with the tiling, clipping and bilinear blending
+// of cv::CLAHE. the tile lookup tables are built per tile row and the blending per row band on the
+// shared pool, all buffers are kept across frames
+class Clahe
+{
+  public:
+    Clahe(const double clip_limit = 3.0, const int tiles_x = 8, const int tiles_y = 8)
+        : clip_limit_(clip_limit), tiles_x_(tiles_x), tiles_y_(tiles_y),
+          fallback_(cv::createCLAHE(clip_limit, cv::Size(tiles_x, tiles_y)))
+    {
+    }
+
+    // dst must not share memory with src
+    void apply(const cv::Mat &src, cv::Mat &dst, ThreadPool *pool)
+    {
+        // cv::CLAHE pads images the tiling does not divide, leave those to it
+        if (pool == nullptr || src.type() != CV_8UC1 || src.cols % tiles_x_ != 0 || src.rows % tiles_y_ != 0)
+        {
+            fallback_->apply(src, dst);
+            return;
+        }
+
+        dst.create(src.size(), CV_8UC1);
+        const int tile_w = src.cols / tiles_x_, tile_h = src.rows / tiles_y_;
+        const int tile_area = tile_w * tile_h;
+        const int clip = std::max(1, static_cast<int>(clip_limit_ * tile_area / 256));
+        const float lut_scale = 255.f / tile_area;
+        luts_.create(tiles_x_ * tiles_y_, 256, CV_8UC1);
+
+        pool->parallelFor(tiles_y_, [&](const int ty) {
+            int hist[256];
+            for (int tx = 0; tx < tiles_x_; tx++)
+            {
+                std::fill(hist, hist + 256, 0);
+                for (int y = ty * tile_h; y < (ty + 1) * tile_h; y++)
+                {
+                    const uchar *src_row = src.ptr<uchar>(y) + tx * tile_w;
+                    for (int x = 0; x < tile_w; x++)
+                        hist[src_row[x]]++;
+                }
+
+                int clipped = 0;
+                for (int i = 0; i < 256; i++)
+                {
+                    if (hist[i] > clip)
+                    {
+                        clipped += hist[i] - clip;
+                        hist[i] = clip;
+                    }
+                }
+                const int redist = clipped / 256;
+                int residual = clipped - redist * 256;
+                for (int i = 0; i < 256; i++)
+                    hist[i] += redist;
+                if (residual > 0)
+                {
+                    const int step = std::max(256 / residual, 1);
+                    for (int i = 0; i < 256 && residual > 0; i += step, residual--)
+                        hist[i]++;
+                }
+
+                uchar *lut = luts_.ptr<uchar>(ty * tiles_x_ + tx);
+                int sum = 0;
+                for (int i = 0; i < 256; i++)
+                {
+                    sum += hist[i];
+                    lut[i] = cv::saturate_cast<uchar>(sum * lut_scale);
+                }
+            }
+        });
+
+        // the two neighbouring tiles and the blend weight of every column, shared by all rows
+        if (static_cast<int>(col_lut1_.size()) != src.cols || col_tile_w_ != tile_w)
+        {
+            col_tile_w_ = tile_w;
+            col_lut1_.resize(src.cols);
+            col_lut2_.resize(src.cols);
+            col_weight_.resize(src.cols);
+            const float inv_tw = 1.f / tile_w;
+            for (int x = 0; x < src.cols; x++)
+            {
+                const float txf = x * inv_tw - 0.5f;
+                const int tx1 = cvFloor(txf);
+                col_weight_[x] = txf - tx1;
+                col_lut1_[x] = std::max(tx1, 0) * 256;
+                col_lut2_[x] = std::min(tx1 + 1, tiles_x_ - 1) * 256;
+            }
+        }
+
+        const int bands = std::min(src.rows, static_cast<int>(pool->size()) * 4);
+        const float inv_th = 1.f / tile_h;
+        pool->parallelFor(bands, [&](const int band) {
+            const int y_end = (band + 1) * src.rows / bands;
+            for (int y = band * src.rows / bands; y < y_end; y++)
+            {
+                const float tyf = y * inv_th - 0.5f;
+                const int ty1 = cvFloor(tyf);
+                const float ya = tyf - ty1, ya1 = 1.f - ya;
+                const uchar *lut_row1 = luts_.ptr<uchar>(std::max(ty1, 0) * tiles_x_);
+                const uchar *lut_row2 = luts_.ptr<uchar>(std::min(ty1 + 1, tiles_y_ - 1) * tiles_x_);
+
+                const uchar *src_row = src.ptr<uchar>(y);
+                uchar *dst_row = dst.ptr<uchar>(y);
+                for (int x = 0; x < src.cols; x++)
+                {
+                    const int ind1 = col_lut1_[x] + src_row[x], ind2 = col_lut2_[x] + src_row[x];
+                    const float xa = col_weight_[x], xa1 = 1.f - xa;
+                    const float res = (lut_row1[ind1] * xa1 + lut_row1[ind2] * xa) * ya1 +
+                                      (lut_row2[ind1] * xa1 + lut_row2[ind2] * xa) * ya;
+                    dst_row[x] = cv::saturate_cast<uchar>(res);
+                }
+            }
+        });
+    }
+
+  private:
+    double clip_limit_;
+    int tiles_x_, tiles_y_;
+    cv::Ptr<cv::CLAHE> fallback_;
+
+    cv::Mat luts_;
+    int col_tile_w_ = 0;
+    std::vector<int> col_lut1_, col_lut2_;
+    std::vector<float> col_weight_;
+};
+
+}
@@ -28,7 +28,7 @@ double distance(cv::Point2f pt1, cv::Point2f pt2)
     return sqrt(dx * dx + dy * dy);
 }
 
-void reduceVector(vector<cv::Point2f> &v, vector<uchar> status)
+void reduceVector(vector<cv::Point2f> &v, const vector<uchar> &status)
 {
     int j = 0;
     for (int i = 0; i < int(v.size()); i++)
@@ -37,7 +37,7 @@ void reduceVector(vector<cv::Point2f> &v, vector<uchar> status)
     v.resize(j);
 }
 
-void reduceVector(vector<int> &v, vector<uchar> status)
+void reduceVector(vector<int> &v, const vector<uchar> &status)
 {
     int j = 0;
     for (int i = 0; i < int(v.size()); i++)
@@ -50,22 +50,17 @@ FeatureTracker::FeatureTracker(bool is_depth, bool is_stereo, int feature_max_cn
 {
     n_id = 0;
     hasPrediction = false;
+    thread_pool = nullptr;
+    has_gyro_rotation = false;
+
+    lk_win_min = lk_win_max = 15;
+    lk_level_min = lk_level_max = 3;
+    lk_flow_px = lk_residual_px = -1.0;
 
     n_pts.reserve(feature_max_cnt);
     predict_pts.reserve(feature_max_cnt);
     predict_pts_debug.reserve(feature_max_cnt);
-    prev_pts.reserve(feature_max_cnt);
-    cur_pts.reserve(feature_max_cnt);
-    cur_right_pts.reserve(feature_max_cnt);
-    prev_un_pts.reserve(feature_max_cnt);
-    cur_un_pts.reserve(feature_max_cnt);
-    cur_un_right_pts.reserve(feature_max_cnt);
-    pts_velocity.reserve(feature_max_cnt);
-    right_pts_velocity.reserve(feature_max_cnt);
-    ids.reserve(feature_max_cnt);
-    ids_right.reserve(feature_max_cnt);
-    track_cnt.reserve(feature_max_cnt);
-    pts_depth.reserve(feature_max_cnt);
+    tracks.reserve(feature_max_cnt);
 }
 
 void FeatureTracker::set_max_feature_num(int max_feature_num){
@@ -74,33 +69,113 @@ void FeatureTracker::set_max_feature_num(int max_feature_num){
 
 void FeatureTracker::setMask()
 {
-    mask = cv::Mat(row, col, CV_8UC1, cv::Scalar(255));
-
     // prefer to keep features that are tracked for long time
-    vector<pair<int, pair<cv::Point2f, int>>> cnt_pts_id;
+    mask_order.resize(tracks.size());
+    for (unsigned int i = 0; i < tracks.size(); i++)
+        mask_order[i] = i;
 
-    for (unsigned int i = 0; i < cur_pts.size(); i++)
-        cnt_pts_id.push_back(make_pair(track_cnt[i], make_pair(cur_pts[i], ids[i])));
-
-    sort(cnt_pts_id.begin(), cnt_pts_id.end(), [](const pair<int, pair<cv::Point2f, int>> &a, const pair<int, pair<cv::Point2f, int>> &b)
+    stable_sort(mask_order.begin(), mask_order.end(), [this](int a, int b)
          {
-            return a.first > b.first;
+            return tracks.track_cnt[a] > tracks.track_cnt[b];
          });
 
-    cur_pts.clear();
-    ids.clear();
-    track_cnt.clear();
+    occupancy_grid.reset(col, row, MIN_DIST);
+    mask_status.assign(tracks.size(), 0);
 
-    for (auto &it : cnt_pts_id)
+    for (int idx : mask_order)
     {
-        if (mask.at<uchar>(it.second.first) == 255)
+        if (occupancy_grid.isFree(tracks.cur_pts[idx]))
         {
-            cur_pts.push_back(it.second.first);
-            ids.push_back(it.second.second);
-            track_cnt.push_back(it.first);
-            cv::circle(mask, it.second.first, MIN_DIST, 0, -1);
+            mask_status[idx] = 1;
+            occupancy_grid.insert(tracks.cur_pts[idx]);
         }
     }
+
+    tracks.compact(mask_status);
+}
+
+void FeatureTracker::detectFeaturesGrid(const int n_max_cnt)
+{
+    n_pts.clear();
+
+    const int cell_num = DETECTOR_GRID_ROW * DETECTOR_GRID_COL;
+    const int cell_w = (col + DETECTOR_GRID_COL - 1) / DETECTOR_GRID_COL;
+    const int cell_h = (row + DETECTOR_GRID_ROW - 1) / DETECTOR_GRID_ROW;
+
+    vector<int> occupancy(cell_num, 0);
+    for (auto &pt : tracks.cur_pts)
+    {
+        const int c = min(static_cast<int>(pt.x) / cell_w, DETECTOR_GRID_COL - 1);
+        const int r = min(static_cast<int>(pt.y) / cell_h, DETECTOR_GRID_ROW - 1);
+        occupancy[r * DETECTOR_GRID_COL + c]++;
+    }
+
+    // emptiest cells first, each one is filled up to an even share of max_cnt
+    const int cell_cap = (max_cnt + cell_num - 1) / cell_num;
+    vector<int> cell_order(cell_num);
+    for (int i = 0; i < cell_num; i++)
+        cell_order[i] = i;
+    stable_sort(cell_order.begin(), cell_order.end(), [&occupancy](int a, int b){ return occupancy[a] < occupancy[b]; });
+
+    int budget = n_max_cnt;
+    cv::Mat eig, eig_max;
+    vector<pair<float, cv::Point>> candidates;
+    for (int cell : cell_order)
+    {
+        const int need = min(cell_cap - occupancy[cell], budget);
+        if (need <= 0)
+            continue;
+
+        const cv::Rect roi((cell % DETECTOR_GRID_COL) * cell_w, (cell / DETECTOR_GRID_COL) * cell_h, cell_w, cell_h);
+        const cv::Rect cell_rect = roi & cv::Rect(0, 0, col, row);
+        if (cell_rect.area() == 0)
+            continue;
+
+        // the response is computed one pixel beyond the cell, so the local maximum test at the cell border
+        // sees the neighbours in the next cells. the roi keeps the real image around it for the derivatives
+        const cv::Rect ext_rect = cv::Rect(cell_rect.x - 1, cell_rect.y - 1, cell_rect.width + 2, cell_rect.height + 2) & cv::Rect(0, 0, col, row);
+        cv::cornerMinEigenVal(cur_img(ext_rect), eig, 3);
+        double cell_max_response;
+        cv::minMaxLoc(eig(cell_rect - ext_rect.tl()), nullptr, &cell_max_response);
+        // relative to the cell like goodFeaturesToTrack, with an absolute floor so textureless cells stay empty
+        if (cell_max_response <= 0 || cell_max_response < DETECTOR_MIN_RESPONSE)
+            continue;
+        cv::threshold(eig, eig, max(0.01 * cell_max_response, DETECTOR_MIN_RESPONSE), 0, cv::THRESH_TOZERO);
+        cv::dilate(eig, eig_max, cv::Mat());
+
+        // every pixel of the cell, only the image border is skipped like in goodFeaturesToTrack
+        const int v_begin = max(cell_rect.y, 1) - ext_rect.y, v_end = min(cell_rect.y + cell_rect.height, row - 1) - ext_rect.y;
+        const int u_begin = max(cell_rect.x, 1) - ext_rect.x, u_end = min(cell_rect.x + cell_rect.width, col - 1) - ext_rect.x;
+        candidates.clear();
+        for (int v = v_begin; v < v_end; v++)
+        {
+            const float* eig_ptr = eig.ptr<float>(v);
+            const float* eig_max_ptr = eig_max.ptr<float>(v);
+            for (int u = u_begin; u < u_end; u++)
+            {
+                if (eig_ptr[u] > 0 && eig_ptr[u] == eig_max_ptr[u])
+                    candidates.emplace_back(eig_ptr[u], cv::Point(u + ext_rect.x, v + ext_rect.y));
+            }
+        }
+        sort(candidates.begin(), candidates.end(), [](const pair<float, cv::Point> &a, const pair<float, cv::Point> &b){ return a.first > b.first; });
+
+        // top k with the min distance kept through the occupancy grid, which also covers the neighbouring cells
+        int added = 0;
+        for (auto &candidate : candidates)
+        {
+            if (added >= need)
+                break;
+            const cv::Point2f pt(candidate.second.x, candidate.second.y);
+            if (!occupancy_grid.isFree(pt))
+                continue;
+            n_pts.push_back(pt);
+            occupancy_grid.insert(pt);
+            added++;
+        }
+        budget -= added;
+        if (budget <= 0)
+            break;
+    }
 }
 
 double FeatureTracker::distance(cv::Point2f &pt1, cv::Point2f &pt2)
@@ -111,33 +186,149 @@ double FeatureTracker::distance(cv::Point2f &pt1, cv::Point2f &pt2)
     return sqrt(dx * dx + dy * dy);
 }
 
-map<int, FeaturePerFrame> FeatureTracker::trackImage(double _cur_time, const cv::Mat &_img, const cv::Mat &_img1)
+void FeatureTracker::buildLKPyramid(const cv::Mat &img, std::vector<cv::Mat> &pyr)
+{
+    // never alias the input, the level buffers are recycled across frames. the padding and depth
+    // cover the largest temporal window as well as the fixed stereo one
+    const int win = max(15, lk_win_max);
+    cv::buildOpticalFlowPyramid(img, pyr, cv::Size(win, win), max(3, lk_level_max), true, cv::BORDER_REFLECT_101, cv::BORDER_CONSTANT, false);
+}
+
+void FeatureTracker::setLKBounds(const int win_min, const int win_max, const int level_min, const int level_max)
+{
+    lk_win_min = max(5, win_min) | 1;
+    lk_win_max = max(lk_win_min, win_max) | 1;
+    lk_level_min = max(0, level_min);
+    lk_level_max = max(lk_level_min, level_max);
+}
+
+// smallest pyramid and window that still reach twice the displacement of the last frame, the
+// full bounds are used as long as the motion is unknown or tracking just degraded
+void FeatureTracker::selectLKParams(cv::Size &win_size, int &max_level)
+{
+    const double expected = hasPrediction && lk_residual_px >= 0.0 ? lk_residual_px : lk_flow_px;
+    if (expected < 0.0 || track_percentage < 0.5)
+    {
+        win_size = cv::Size(lk_win_max, lk_win_max);
+        max_level = lk_level_max;
+        return;
+    }
+
+    const double reach = 2.0 * expected;
+    max_level = lk_level_min;
+    while (max_level < lk_level_max && (lk_win_min / 2) * (1 << max_level) < reach)
+        max_level++;
+    int win = static_cast<int>(ceil(2.0 * reach / (1 << max_level))) | 1;
+    win = min(lk_win_max, max(lk_win_min, win));
+    win_size = cv::Size(win, win);
+}
+
+void FeatureTracker::updateLKStats(const vector<uchar> &status)
+{
+    double flow = 0.0, residual = 0.0;
+    int cnt = 0;
+    for (size_t i = 0; i < status.size(); i++)
+    {
+        if (!status[i])
+            continue;
+        flow += distance(tracks.cur_pts[i], tracks.prev_pts[i]);
+        if (hasPrediction)
+            residual += distance(tracks.cur_pts[i], predict_pts[i]);
+        cnt++;
+    }
+
+    if (cnt == 0)
+    {
+        lk_flow_px = lk_residual_px = -1.0;
+        return;
+    }
+    lk_flow_px = flow / cnt;
+    lk_residual_px = hasPrediction ? residual / cnt : -1.0;
+}
+
+cv::Mat FeatureTracker::prepareImage(const cv::Mat &_img, const cv::Mat &_img1)
 {
-    TicToc t_r;
-    cur_time = _cur_time;
-    row = cur_img.rows;
-    col = cur_img.cols;
     cv::Mat rightImg = _img1;
 
     if (EQUALIZE)
     {
-        cv::Mat img_tmp;
-        cv::Ptr<cv::CLAHE> clahe = cv::createCLAHE(3.0, cv::Size(8, 8));
         TicToc t_c;
-        clahe->apply(_img, img_tmp);
-        ROS_DEBUG("CLAHE costs: %fms", t_c.toc());
-        cur_img = img_tmp;
+        std::swap(equalized_img, prev_equalized_img);
+        clahe.apply(_img, equalized_img, thread_pool);
+        cur_img = equalized_img;
 
         if(stereo && !_img1.empty())
         {
-            cv::Ptr<cv::CLAHE> clahe = cv::createCLAHE(3.0, cv::Size(8, 8));
-            clahe->apply(_img1, rightImg);
+            clahe.apply(_img1, equalized_right_img, thread_pool);
+            rightImg = equalized_right_img;
         }
+        ROS_DEBUG("CLAHE costs: %fms", t_c.toc());
     }
     else{
         cur_img = _img;
     }
 
+    buildLKPyramid(cur_img, cur_img_pyr);
+    return rightImg;
+}
+
+// frame that will not enter the window: the tracks are only carried over so the next tracked
+// frame starts from this image. nothing is detected, lifted or published, and the undistorted
+// points and the time of the last tracked frame stay the previous ones
+void FeatureTracker::maintainTracks(double _cur_time, const cv::Mat &_img)
+{
+    TicToc t_m;
+    row = _img.rows;
+    col = _img.cols;
+    prepareImage(_img, cv::Mat());
+
+    if (GYRO_PREDICTION && has_gyro_rotation && !hasPrediction && tracks.size() > 0)
+        predictPtsWithGyro();
+
+    if (tracks.size() > 0)
+    {
+        vector<uchar> status;
+        vector<float> err;
+        // coarse pass: the frame is close to the last one, so the smallest adaptive window and pyramid
+        // and fewer, looser iterations are enough. the next tracked frame refines from here
+        const cv::Size win_size(lk_win_min, lk_win_min);
+        const cv::TermCriteria criteria(cv::TermCriteria::COUNT+cv::TermCriteria::EPS, 10, 0.03);
+
+        if(hasPrediction)
+        {
+            tracks.cur_pts = predict_pts;
+            cv::calcOpticalFlowPyrLK(prev_img_pyr, cur_img_pyr, tracks.prev_pts, tracks.cur_pts, status, err, win_size, min(1, lk_level_min),
+            criteria, cv::OPTFLOW_USE_INITIAL_FLOW);
+        }
+        else
+            cv::calcOpticalFlowPyrLK(prev_img_pyr, cur_img_pyr, tracks.prev_pts, tracks.cur_pts, status, err, win_size, lk_level_min, criteria);
+
+        if (ADAPTIVE_LK)
+            updateLKStats(status);
+
+        for (int i = 0; i < int(tracks.size()); i++){
+            if (status[i] && !inBorder(tracks.cur_pts[i]))
+                status[i] = 0;
+        }
+        tracks.compact(status);
+        tracks.prev_pts = tracks.cur_pts;
+    }
+
+    prev_img = cur_img;
+    prev_img_pyr.swap(cur_img_pyr);
+    hasPrediction = false;
+    has_gyro_rotation = false;
+    ROS_DEBUG("track maintenance at %f keeps %lu tracks, costs %fms", _cur_time, tracks.size(), t_m.toc());
+}
+
+FeatureFrame FeatureTracker::trackImage(double _cur_time, const cv::Mat &_img, const cv::Mat &_img1)
+{
+    TicToc t_r;
+    cur_time = _cur_time;
+    row = _img.rows;
+    col = _img.cols;
+    cv::Mat rightImg = prepareImage(_img, _img1);
+
     /*
     {
         cv::Ptr<cv::CLAHE> clahe = cv::createCLAHE(3.0, cv::Size(8, 8));
@@ -146,43 +337,72 @@ map<int, FeaturePerFrame> FeatureTracker::trackImage(double _cur_time, const cv:
             clahe->apply(rightImg, rightImg);
     }
     */
-    cur_pts.clear();
 
-    if (prev_pts.size() > 0)
+    if (GYRO_PREDICTION && has_gyro_rotation && !hasPrediction && tracks.size() > 0)
+        predictPtsWithGyro();
+
+    if (tracks.size() > 0)
     {
         TicToc t_o;
         vector<uchar> status;
         vector<float> err;
 
-        auto prev_pt_size = prev_pts.size();
+        auto prev_pt_size = tracks.size();
+        cv::Size win_size(15, 15);
+        int max_level = 3;
+        if (ADAPTIVE_LK)
+        {
+            selectLKParams(win_size, max_level);
+            ROS_DEBUG("optical flow window %d, levels %d", win_size.width, max_level + 1);
+        }
+
         if(hasPrediction)
         {
-            cur_pts = predict_pts;
-            cv::calcOpticalFlowPyrLK(prev_img, cur_img, prev_pts, cur_pts, status, err, cv::Size(15, 15), 1,
+            tracks.cur_pts = predict_pts;
+            cv::calcOpticalFlowPyrLK(prev_img_pyr, cur_img_pyr, tracks.prev_pts, tracks.cur_pts, status, err, win_size, ADAPTIVE_LK ? max_level : 1,
             cv::TermCriteria(cv::TermCriteria::COUNT+cv::TermCriteria::EPS, 30, 0.01), cv::OPTFLOW_USE_INITIAL_FLOW);
 
-            int succ_num = 0;
+            // only the tracks the prediction did not work for go through the full pyramid again
+            vector<int> retry_idx;
+            vector<cv::Point2f> retry_prev_pts, retry_cur_pts;
+            vector<uchar> retry_status;
             for (size_t i = 0; i < status.size(); i++)
             {
-                if (status[i])
-                    succ_num++;
+                if (!status[i])
+                {
+                    retry_idx.push_back(i);
+                    retry_prev_pts.push_back(tracks.prev_pts[i]);
+                }
             }
-            if (succ_num < 10)
-            cv::calcOpticalFlowPyrLK(prev_img, cur_img, prev_pts, cur_pts, status, err, cv::Size(15, 15), 3);
+            if (!retry_idx.empty())
+            {
+                cv::calcOpticalFlowPyrLK(prev_img_pyr, cur_img_pyr, retry_prev_pts, retry_cur_pts, retry_status, err, cv::Size(lk_win_max, lk_win_max), lk_level_max);
+                for (size_t k = 0; k < retry_idx.size(); k++)
+                {
+                    status[retry_idx[k]] = retry_status[k];
+                    if (retry_status[k])
+                        tracks.cur_pts[retry_idx[k]] = retry_cur_pts[k];
+                }
+            }
+            ROS_DEBUG("predicted optical flow retried %lu of %lu", retry_idx.size(), status.size());
         }
         else
-            cv::calcOpticalFlowPyrLK(prev_img, cur_img, prev_pts, cur_pts, status, err, cv::Size(15, 15), 3);
+            cv::calcOpticalFlowPyrLK(prev_img_pyr, cur_img_pyr, tracks.prev_pts, tracks.cur_pts, status, err, win_size, max_level);
+
+        if (ADAPTIVE_LK)
+            updateLKStats(status);
+
         // reverse check
         if(FLOW_BACK)
         {
             vector<uchar> reverse_status;
-            vector<cv::Point2f> reverse_pts = prev_pts;
-            cv::calcOpticalFlowPyrLK(cur_img, prev_img, cur_pts, reverse_pts, reverse_status, err, cv::Size(15, 15), 1,
+            vector<cv::Point2f> reverse_pts = tracks.prev_pts;
+            cv::calcOpticalFlowPyrLK(cur_img_pyr, prev_img_pyr, tracks.cur_pts, reverse_pts, reverse_status, err, win_size, 1,
             cv::TermCriteria(cv::TermCriteria::COUNT+cv::TermCriteria::EPS, 30, 0.01), cv::OPTFLOW_USE_INITIAL_FLOW);
             //cv::calcOpticalFlowPyrLK(cur_img, prev_img, cur_pts, reverse_pts, reverse_status, err, cv::Size(15, 15), 3);
             for(size_t i = 0; i < status.size(); i++)
             {
-                if(status[i] && reverse_status[i] && distance(prev_pts[i], reverse_pts[i]) <= 0.5)
+                if(status[i] && reverse_status[i] && distance(tracks.prev_pts[i], reverse_pts[i]) <= 0.5)
                 {
                     status[i] = 1;
                 }
@@ -191,27 +411,27 @@ map<int, FeaturePerFrame> FeatureTracker::trackImage(double _cur_time, const cv:
             }
         }
 
-        for (int i = 0; i < int(cur_pts.size()); i++){
-            if (status[i] && !inBorder(cur_pts[i]))
+        for (int i = 0; i < int(tracks.size()); i++){
+            if (status[i] && !inBorder(tracks.cur_pts[i]))
                 status[i] = 0;
         }
-        reduceVector(prev_pts, status);
-        reduceVector(cur_pts, status);
-        reduceVector(ids, status);
-        reduceVector(track_cnt, status);
+        tracks.compact(status);
         ROS_DEBUG("temporal optical flow costs: %fms", t_o.toc());
-        // printf("track cnt %d\n", (int)ids.size());
+        // printf("track cnt %d\n", (int)tracks.size());
 
-        track_num = static_cast<double>(cur_pts.size());
+        track_num = static_cast<double>(tracks.size());
         track_percentage = track_num / static_cast<double>(prev_pt_size);
     }
 
-    for (auto &n : track_cnt)
+    for (auto &n : tracks.track_cnt)
         n++;
 
     if (1)
     {
-        rejectWithF();
+        if (GYRO_RANSAC && has_gyro_rotation)
+            rejectWithGyro();
+        else
+            rejectWithF();
         ROS_DEBUG("set mask begins");
         TicToc t_m;
         setMask();
@@ -219,193 +439,144 @@ map<int, FeaturePerFrame> FeatureTracker::trackImage(double _cur_time, const cv:
 
         ROS_DEBUG("detect feature begins");
         TicToc t_t;
-        int n_max_cnt = max_cnt - static_cast<int>(cur_pts.size());
+        int n_max_cnt = max_cnt - static_cast<int>(tracks.size());
         if (n_max_cnt > 0)
         {
-            if(mask.empty())
-                cout << "mask is empty " << endl;
-            if (mask.type() != CV_8UC1)
-                cout << "mask type wrong " << endl;
-            cv::goodFeaturesToTrack(cur_img, n_pts, n_max_cnt, 0.01, MIN_DIST, mask);
+            if (DETECTOR_GRID_ROW > 0 && DETECTOR_GRID_COL > 0)
+                detectFeaturesGrid(n_max_cnt);
+            else
+            {
+                // only the full image detector needs a rasterized mask
+                occupancy_grid.rasterize(mask);
+                cv::goodFeaturesToTrack(cur_img, n_pts, n_max_cnt, 0.01, MIN_DIST, mask);
+            }
         }
         else
             n_pts.clear();
         ROS_DEBUG("detect feature %d costs: %f ms",n_max_cnt, t_t.toc());
 
         for (auto &p : n_pts)
-        {
-            cur_pts.push_back(p);
-            ids.push_back(n_id++);
-            track_cnt.push_back(1);
-
-            // if(cur_pts.size() > 0.7 * max_cnt){
-            //     break;
-            // }
-        }
-
-        // return map<int,FeaturePerFrame>();
-        //printf("feature cnt after add %d\n", (int)ids.size());
+            tracks.add(p, n_id++);
     }
 
-    cur_un_pts = undistortedPts(cur_pts, m_camera[0]);
+    FeatureFrame featureFrame = finishFrame(cur_img, rightImg, true);
 
-    pts_velocity = ptsVelocity(ids, cur_un_pts, cur_un_pts_map, prev_un_pts_map);
+    prev_img = cur_img;
+    // swap instead of copy, the old level buffers are reused by the next build
+    prev_img_pyr.swap(cur_img_pyr);
+
+    // printf("feature track whole time %f\n", t_r.toc());
+    return featureFrame;
+}
 
-    if(!_img1.empty() && stereo)
+void FeatureTracker::trackRightImage(const cv::Mat &rightImg)
+{
+    fill(tracks.has_right.begin(), tracks.has_right.end(), 0);
+    if(tracks.size() == 0)
+        return;
+
+    // printf("stereo image; track feature on right image\n");
+    vector<cv::Point2f> reverseLeftPts;
+    vector<uchar> status, statusRightLeft;
+    vector<float> err;
+    buildLKPyramid(rightImg, right_img_pyr);
+    // cur left ---- cur right
+    cv::calcOpticalFlowPyrLK(cur_img_pyr, right_img_pyr, tracks.cur_pts, tracks.cur_right_pts, status, err, cv::Size(15, 15), 3);
+    // reverse check cur right ---- cur left
+    if(FLOW_BACK)
     {
-        ids_right.clear();
-        cur_right_pts.clear();
-        cur_un_right_pts.clear();
-        right_pts_velocity.clear();
-        cur_un_right_pts_map.clear();
-        if(!cur_pts.empty())
+        cv::calcOpticalFlowPyrLK(right_img_pyr, cur_img_pyr, tracks.cur_right_pts, reverseLeftPts, statusRightLeft, err, cv::Size(15, 15), 3);
+        for(size_t i = 0; i < status.size(); i++)
         {
-            // printf("stereo image; track feature on right image\n");
-            vector<cv::Point2f> reverseLeftPts;
-            vector<uchar> status, statusRightLeft;
-            vector<float> err;
-            // cur left ---- cur right
-            cv::calcOpticalFlowPyrLK(cur_img, rightImg, cur_pts, cur_right_pts, status, err, cv::Size(15, 15), 3);
-            // reverse check cur right ---- cur left
-            if(FLOW_BACK)
-            {
-                cv::calcOpticalFlowPyrLK(rightImg, cur_img, cur_right_pts, reverseLeftPts, statusRightLeft, err, cv::Size(15, 15), 3);
-                for(size_t i = 0; i < status.size(); i++)
-                {
-                    if(status[i] && statusRightLeft[i] && inBorder(cur_right_pts[i]) && distance(cur_pts[i], reverseLeftPts[i]) <= 0.5)
-                        status[i] = 1;
-                    else
-                        status[i] = 0;
-                }
-            }
-
-            ids_right = ids;
-            reduceVector(cur_right_pts, status);
-            reduceVector(ids_right, status);
-            // only keep left-right pts
-            /*
-            reduceVector(cur_pts, status);
-            reduceVector(ids, status);
-            reduceVector(track_cnt, status);
-            reduceVector(cur_un_pts, status);
-            reduceVector(pts_velocity, status);
-            */
-            cur_un_right_pts = undistortedPts(cur_right_pts, m_camera[1]);
-            right_pts_velocity = ptsVelocity(ids_right, cur_un_right_pts, cur_un_right_pts_map, prev_un_right_pts_map);
+            if(status[i] && statusRightLeft[i] && inBorder(tracks.cur_right_pts[i]) && distance(tracks.cur_pts[i], reverseLeftPts[i]) <= 0.5)
+                status[i] = 1;
+            else
+                status[i] = 0;
         }
-        prev_un_right_pts_map = cur_un_right_pts_map;
     }
-    else if(!_img1.empty() && depth){
-        // rejectDepth(_img1);
-        setDepth(_img1);
+
+    // only the right column is masked, left-only tracks are kept
+    for(size_t i = 0; i < tracks.size(); i++)
+    {
+        tracks.has_right[i] = status[i];
+        if(status[i])
+            tracks.cur_un_right_pts[i] = liftPoint(tracks.cur_right_pts[i], 1);
+    }
+}
+
+FeatureFrame FeatureTracker::finishFrame(const cv::Mat &img, const cv::Mat &rightImg, const bool track_right)
+{
+    undistortedPts(tracks.cur_pts, 0, tracks.cur_un_pts);
+
+    if(!rightImg.empty() && stereo && track_right)
+        trackRightImage(rightImg);
+    else
+        fill(tracks.has_right.begin(), tracks.has_right.end(), 0);
+
+    ptsVelocity();
+
+    if(!rightImg.empty() && depth){
+        // rejectDepth(rightImg);
+        setDepth(rightImg);
     }
+    else
+        fill(tracks.depth.begin(), tracks.depth.end(), -1.0);
 
     if(SHOW_TRACK)
-        drawTrack(cur_img, rightImg, ids, cur_pts, cur_right_pts, prevLeftPtsMap);
+        drawTrack(img, rightImg);
 
-    prev_img = cur_img;
-    prev_pts = cur_pts;
-    prev_un_pts = cur_un_pts;
-    prev_un_pts_map = cur_un_pts_map;
+    tracks.advance();
     prev_time = cur_time;
     hasPrediction = false;
+    has_gyro_rotation = false;
 
-    prevLeftPtsMap.clear();
-    for(size_t i = 0; i < cur_pts.size(); i++)
-        prevLeftPtsMap[ids[i]] = cur_pts[i];
-
-    // map<int, vector<pair<int, Eigen::VectorXd>>> featureFrame;
+    // rows are sorted by id: new tracks get increasing ids and compaction keeps the order
     FeaturePerFrame featurePt;
-    map<int,FeaturePerFrame> featureFrame;
-    for (size_t i = 0; i < ids.size(); i++)
+    FeatureFrame featureFrame;
+    featureFrame.reserve(tracks.size());
+    for (size_t i = 0; i < tracks.size(); i++)
     {
-        int feature_id = ids[i];
-        // double x, y ,z;
-        // x = cur_un_pts[i].x;
-        // y = cur_un_pts[i].y;
-        // z = 1;
-        // double p_u, p_v;
-        // p_u = cur_pts[i].x;
-        // p_v = cur_pts[i].y;
-        // int camera_id = 0;
-        // double velocity_x, velocity_y;
-        // velocity_x = pts_velocity[i].x;
-        // velocity_y = pts_velocity[i].y;
-
-        featurePt.point.x() = cur_un_pts[i].x;
-        featurePt.point.y() = cur_un_pts[i].y;
+        featurePt.point.x() = tracks.cur_un_pts[i].x;
+        featurePt.point.y() = tracks.cur_un_pts[i].y;
         featurePt.point.z() = 1.0;
 
-        featurePt.uv.x() = cur_pts[i].x;
-        featurePt.uv.y() = cur_pts[i].y;
+        featurePt.uv.x() = tracks.cur_pts[i].x;
+        featurePt.uv.y() = tracks.cur_pts[i].y;
 
-        featurePt.velocity.x() = pts_velocity[i].x;
-        featurePt.velocity.y() = pts_velocity[i].y;
+        featurePt.velocity.x() = tracks.velocity[i].x;
+        featurePt.velocity.y() = tracks.velocity[i].y;
 
         featurePt.is_depth = featurePt.is_stereo = false;
 
-
-        if(depth && pts_depth[i] > 0.0){
-            // Eigen::Matrix<double, 8, 1> xyz_uv_velocity_depth;
-            // xyz_uv_velocity_depth << x, y, z, p_u, p_v, velocity_x, velocity_y, pts_depth[i];
-            // featurePt.pt_data = xyz_uv_velocity_depth;
-            featurePt.depth = pts_depth[i];
+        if(depth && tracks.depth[i] > 0.0){
+            featurePt.depth = tracks.depth[i];
             featurePt.is_depth = true;
-            // featureFrame[feature_id].emplace_back(camera_id,  xyz_uv_velocity_depth);
         } else {
             featurePt.depth = -1.0;
-            // Eigen::Matrix<double, 7, 1> xyz_uv_velocity;
-            // xyz_uv_velocity << x, y, z, p_u, p_v, velocity_x, velocity_y;
-            // featurePt.pt_data = xyz_uv_velocity;
-            // featurePt.depth = false;
-            // featureFrame[feature_id].emplace_back(camera_id,  xyz_uv_velocity);
         }
-        featureFrame[feature_id]=featurePt;
-    }
 
-    if (!_img1.empty() && stereo)
-    {
-        for (size_t i = 0; i < ids_right.size(); i++)
-        {
-            int feature_id = ids_right[i];
-            // double x, y ,z;
-            // x = cur_un_right_pts[i].x;
-            // y = cur_un_right_pts[i].y;
-            // z = 1;
-            // double p_u, p_v;
-            // p_u = cur_right_pts[i].x;
-            // p_v = cur_right_pts[i].y;
-            // int camera_id = 1;
-            // double velocity_x, velocity_y;
-            // velocity_x = right_pts_velocity[i].x;
-            // velocity_y = right_pts_velocity[i].y;
-
-            featureFrame[feature_id].pointRight.x() = cur_un_right_pts[i].x;
-            featureFrame[feature_id].pointRight.y() = cur_un_right_pts[i].y;
-            featureFrame[feature_id].pointRight.z() = 1.0;
-
-            featureFrame[feature_id].uvRight.x() = cur_right_pts[i].x;
-            featureFrame[feature_id].uvRight.y() = cur_right_pts[i].y;
-
-            featureFrame[feature_id].velocityRight.x() = right_pts_velocity[i].x;
-            featureFrame[feature_id].velocityRight.y() = right_pts_velocity[i].y;
-
-            // Eigen::Matrix<double, 7, 1> xyz_uv_velocity;
-            // xyz_uv_velocity << x, y, z, p_u, p_v, velocity_x, velocity_y;
-            // featureFrame[feature_id].emplace_back(camera_id,  xyz_uv_velocity);
-            // featureFrame[feature_id].pt_data_right = xyz_uv_velocity;
-            featureFrame[feature_id].is_stereo = true;
+        if(tracks.has_right[i]){
+            featurePt.pointRight.x() = tracks.cur_un_right_pts[i].x;
+            featurePt.pointRight.y() = tracks.cur_un_right_pts[i].y;
+            featurePt.pointRight.z() = 1.0;
 
+            featurePt.uvRight.x() = tracks.cur_right_pts[i].x;
+            featurePt.uvRight.y() = tracks.cur_right_pts[i].y;
+
+            featurePt.velocityRight.x() = tracks.right_velocity[i].x;
+            featurePt.velocityRight.y() = tracks.right_velocity[i].y;
+
+            featurePt.is_stereo = true;
         }
+        featureFrame.emplace_back(tracks.ids[i], featurePt);
     }
 
-    // printf("feature track whole time %f\n", t_r.toc());
     return featureFrame;
 }
 
 #ifdef WITH_CUDA
 
-map<int, FeaturePerFrame> FeatureTracker::trackImageGPU(double _cur_time, const cv::Mat &_img, const cv::Mat &_img1)
+FeatureFrame FeatureTracker::trackImageGPU(double _cur_time, const cv::Mat &_img, const cv::Mat &_img1)
 {
     TicToc t_r;
     cur_time = _cur_time;
@@ -428,15 +599,14 @@ map<int, FeaturePerFrame> FeatureTracker::trackImageGPU(double _cur_time, const
             clahe->apply(rightImg, rightImg);
     }
     */
-    cur_pts.clear();
 
-    if (prev_pts.size() > 0 && cur_time > 0.0)
+    if (tracks.size() > 0 && cur_time > 0.0)
     {
         TicToc t_o;
         vector<uchar> status;
         vector<float> err;
 
-        auto prev_pt_size = prev_pts.size();
+        auto prev_pt_size = tracks.size();
 
         // gpu_mutex.lock();
         // GPU_MUTEX.lock();
@@ -444,8 +614,8 @@ map<int, FeaturePerFrame> FeatureTracker::trackImageGPU(double _cur_time, const
 
 
         // TicToc gpu_mat_time;
-        cv::cuda::GpuMat prev_gpu_pts(prev_pts);
-        cv::cuda::GpuMat cur_gpu_pts(cur_pts);
+        cv::cuda::GpuMat prev_gpu_pts(tracks.prev_pts);
+        cv::cuda::GpuMat cur_gpu_pts(tracks.cur_pts);
         cv::cuda::GpuMat gpu_status;
         // cout<<"gpu mat construct time: "<<gpu_mat_time.toc()<<endl;
 
@@ -456,7 +626,7 @@ map<int, FeaturePerFrame> FeatureTracker::trackImageGPU(double _cur_time, const
             // d_pyrLK_sparse->calc(prev_gpu_img, cur_gpu_img, prev_gpu_pts, cur_gpu_pts, gpu_status);
             d_pyrLK_sparse->calc(prev_pyr, cur_pyr, prev_gpu_pts, cur_gpu_pts, gpu_status);
 
-            cur_gpu_pts.download(cur_pts);
+            cur_gpu_pts.download(tracks.cur_pts);
             gpu_status.download(status);
 
             // vector<cv::Point2f> tmp_cur_pts(cur_gpu_pts.cols);
@@ -486,7 +656,7 @@ map<int, FeaturePerFrame> FeatureTracker::trackImageGPU(double _cur_time, const
                 // vector<uchar> tmp1_status(gpu_status.cols);
                 // gpu_status.download(tmp1_status);
                 // status = tmp1_status;
-                cur_gpu_pts.download(cur_pts);
+                cur_gpu_pts.download(tracks.cur_pts);
                 gpu_status.download(status);
             }
         }
@@ -501,7 +671,7 @@ map<int, FeaturePerFrame> FeatureTracker::trackImageGPU(double _cur_time, const
             // cout<<"gpu of cal time: "<<gpu_of_time.toc()<<endl;
 
             // TicToc gpu_mat_download_time;
-            cur_gpu_pts.download(cur_pts);
+            cur_gpu_pts.download(tracks.cur_pts);
             gpu_status.download(status);
             // cout<<"gpu mat download time: "<<gpu_mat_download_time.toc()<<endl;
 
@@ -546,7 +716,7 @@ map<int, FeaturePerFrame> FeatureTracker::trackImageGPU(double _cur_time, const
 
             for(size_t i = 0; i < status.size(); i++)
             {
-                if(status[i] && reverse_status[i] && distance(prev_pts[i], reverse_pts[i]) <= 0.5)
+                if(status[i] && reverse_status[i] && distance(tracks.prev_pts[i], reverse_pts[i]) <= 0.5)
                 {
                     status[i] = 1;
                 }
@@ -559,15 +729,15 @@ map<int, FeaturePerFrame> FeatureTracker::trackImageGPU(double _cur_time, const
         // GPU_MUTEX.unlock();
         // printf("gpu temporal optical flow costs: %f ms\n",t_og.toc());
 
-        for (int i = 0; i < int(cur_pts.size()); i++){
-            if (status[i] && !inBorder(cur_pts[i]))
+        for (int i = 0; i < int(tracks.size()); i++){
+            if (status[i] && !inBorder(tracks.cur_pts[i]))
                 status[i] = 0;
 
-            for(int j = i+1;  j < int(cur_pts.size()); j++ ){
-                auto dist = cur_pts[i] - cur_pts[j];
+            for(int j = i+1;  j < int(tracks.size()); j++ ){
+                auto dist = tracks.cur_pts[i] - tracks.cur_pts[j];
 
                 if(dist.x * dist.x + dist.y * dist.y < MIN_DIST * MIN_DIST){
-                    if(track_cnt[i] < track_cnt[j]){
+                    if(tracks.track_cnt[i] < tracks.track_cnt[j]){
                         status[i] = 0;
                     }
                     else{
@@ -576,20 +746,17 @@ map<int, FeaturePerFrame> FeatureTracker::trackImageGPU(double _cur_time, const
                 }
             }
         }
-        reduceVector(prev_pts, status);
-        reduceVector(cur_pts, status);
-        reduceVector(ids, status);
-        reduceVector(track_cnt, status);
+        tracks.compact(status);
         ROS_DEBUG("temporal optical flow costs: %fms", t_o.toc());
         //printf("track cnt %d\n", (int)ids.size());
 
-        track_num = static_cast<double>(cur_pts.size());
+        track_num = static_cast<double>(tracks.size());
         track_percentage = track_num / static_cast<double>(prev_pt_size);
     }
 
     prev_pyr = cur_pyr;
 
-    for (auto &n : track_cnt)
+    for (auto &n : tracks.track_cnt)
         n++;
 
     if (1)
@@ -657,16 +824,16 @@ map<int, FeaturePerFrame> FeatureTracker::trackImageGPU(double _cur_time, const
 
         ROS_DEBUG("detect feature %d costs: %f ms",n_max_cnt, t_t.toc());
 
-        unsigned int cur_pt_size = cur_pts.size();
+        unsigned int cur_pt_size = tracks.size();
 
         for (auto &p : n_pts)
         {
-            if(cur_pts.size() >= max_cnt){
+            if(tracks.size() >= max_cnt){
                 break;
             }
 
             bool close_new_pt = false;
-            for(auto &cur_p : cur_pts){
+            for(auto &cur_p : tracks.cur_pts){
                 auto dist = cur_p - p;
 
                 if(dist.x * dist.x + dist.y * dist.y <= MIN_DIST * MIN_DIST){
@@ -676,9 +843,7 @@ map<int, FeaturePerFrame> FeatureTracker::trackImageGPU(double _cur_time, const
             }
 
             if(!close_new_pt){
-                cur_pts.emplace_back(p);
-                ids.emplace_back(n_id++);
-                track_cnt.emplace_back(1);
+                tracks.add(p, n_id++);
             }
 
             // if(cur_pts.size() > 0.7 * max_cnt){
@@ -690,161 +855,8 @@ map<int, FeaturePerFrame> FeatureTracker::trackImageGPU(double _cur_time, const
         //printf("feature cnt after add %d\n", (int)ids.size());
     }
 
-    cur_un_pts = undistortedPts(cur_pts, m_camera[0]);
-
-    pts_velocity = ptsVelocity(ids, cur_un_pts, cur_un_pts_map, prev_un_pts_map);
-
-    if(!_img1.empty() && stereo)
-    {
-        // ids_right.clear();
-        // cur_right_pts.clear();
-        // cur_un_right_pts.clear();
-        // right_pts_velocity.clear();
-        // cur_un_right_pts_map.clear();
-        // if(!cur_pts.empty())
-        // {
-        //     //printf("stereo image; track feature on right image\n");
-        //     vector<cv::Point2f> reverseLeftPts;
-        //     vector<uchar> status, statusRightLeft;
-        //     vector<float> err;
-        //     // cur left ---- cur right
-        //     cv::calcOpticalFlowPyrLK(cur_img, rightImg, cur_pts, cur_right_pts, status, err, cv::Size(15, 15), 3);
-        //     // reverse check cur right ---- cur left
-        //     if(FLOW_BACK)
-        //     {
-        //         cv::calcOpticalFlowPyrLK(rightImg, cur_img, cur_right_pts, reverseLeftPts, statusRightLeft, err, cv::Size(15, 15), 3);
-        //         for(size_t i = 0; i < status.size(); i++)
-        //         {
-        //             if(status[i] && statusRightLeft[i] && inBorder(cur_right_pts[i]) && distance(cur_pts[i], reverseLeftPts[i]) <= 0.5)
-        //                 status[i] = 1;
-        //             else
-        //                 status[i] = 0;
-        //         }
-        //     }
-
-        //     ids_right = ids;
-        //     reduceVector(cur_right_pts, status);
-        //     reduceVector(ids_right, status);
-        //     // only keep left-right pts
-        //     /*
-        //     reduceVector(cur_pts, status);
-        //     reduceVector(ids, status);
-        //     reduceVector(track_cnt, status);
-        //     reduceVector(cur_un_pts, status);
-        //     reduceVector(pts_velocity, status);
-        //     */
-        //     cur_un_right_pts = undistortedPts(cur_right_pts, m_camera[1]);
-        //     right_pts_velocity = ptsVelocity(ids_right, cur_un_right_pts, cur_un_right_pts_map, prev_un_right_pts_map);
-        // }
-        // prev_un_right_pts_map = cur_un_right_pts_map;
-    }
-    else if(!_img1.empty() && depth){
-        // rejectDepth(_img1);
-        setDepth(_img1);
-    }
-
-    if(SHOW_TRACK)
-        drawTrack(_img, rightImg, ids, cur_pts, cur_right_pts, prevLeftPtsMap);
-
-    // prev_img = _img;
-    prev_pts = cur_pts;
-    prev_un_pts = cur_un_pts;
-    prev_un_pts_map = cur_un_pts_map;
-    prev_time = cur_time;
-    hasPrediction = false;
-
-    prevLeftPtsMap.clear();
-    for(size_t i = 0; i < cur_pts.size(); i++)
-        prevLeftPtsMap[ids[i]] = cur_pts[i];
-
-    // map<int, vector<pair<int, Eigen::VectorXd>>> featureFrame;
-    FeaturePerFrame featurePt;
-    map<int,FeaturePerFrame> featureFrame;
-    for (size_t i = 0; i < ids.size(); i++)
-    {
-        int feature_id = ids[i];
-        // double x, y ,z;
-        // x = cur_un_pts[i].x;
-        // y = cur_un_pts[i].y;
-        // z = 1;
-        // double p_u, p_v;
-        // p_u = cur_pts[i].x;
-        // p_v = cur_pts[i].y;
-        // int camera_id = 0;
-        // double velocity_x, velocity_y;
-        // velocity_x = pts_velocity[i].x;
-        // velocity_y = pts_velocity[i].y;
-
-        featurePt.point.x() = cur_un_pts[i].x;
-        featurePt.point.y() = cur_un_pts[i].y;
-        featurePt.point.z() = 1.0;
-
-        featurePt.uv.x() = cur_pts[i].x;
-        featurePt.uv.y() = cur_pts[i].y;
-
-        featurePt.velocity.x() = pts_velocity[i].x;
-        featurePt.velocity.y() = pts_velocity[i].y;
-
-        featurePt.is_depth = featurePt.is_stereo = false;
-
-
-        if(depth && pts_depth[i] > 0.0){
-            // Eigen::Matrix<double, 8, 1> xyz_uv_velocity_depth;
-            // xyz_uv_velocity_depth << x, y, z, p_u, p_v, velocity_x, velocity_y, pts_depth[i];
-            // featurePt.pt_data = xyz_uv_velocity_depth;
-            featurePt.depth = pts_depth[i];
-            featurePt.is_depth = true;
-            // featureFrame[feature_id].emplace_back(camera_id,  xyz_uv_velocity_depth);
-        }
-        else{
-            featurePt.depth = -1.0;
-            // Eigen::Matrix<double, 7, 1> xyz_uv_velocity;
-            // xyz_uv_velocity << x, y, z, p_u, p_v, velocity_x, velocity_y;
-            // featurePt.pt_data = xyz_uv_velocity;
-            // featurePt.depth = false;
-            // featureFrame[feature_id].emplace_back(camera_id,  xyz_uv_velocity);
-        }
-        featureFrame[feature_id]=featurePt;
-    }
-
-    if (!_img1.empty() && stereo)
-    {
-        for (size_t i = 0; i < ids_right.size(); i++)
-        {
-            int feature_id = ids_right[i];
-            // double x, y ,z;
-            // x = cur_un_right_pts[i].x;
-            // y = cur_un_right_pts[i].y;
-            // z = 1;
-            // double p_u, p_v;
-            // p_u = cur_right_pts[i].x;
-            // p_v = cur_right_pts[i].y;
-            // int camera_id = 1;
-            // double velocity_x, velocity_y;
-            // velocity_x = right_pts_velocity[i].x;
-            // velocity_y = right_pts_velocity[i].y;
-
-            featureFrame[feature_id].pointRight.x() = cur_un_right_pts[i].x;
-            featureFrame[feature_id].pointRight.y() = cur_un_right_pts[i].y;
-            featureFrame[feature_id].pointRight.z() = 1.0;
-
-            featureFrame[feature_id].uvRight.x() = cur_right_pts[i].x;
-            featureFrame[feature_id].uvRight.y() = cur_right_pts[i].y;
-
-            featureFrame[feature_id].velocityRight.x() = right_pts_velocity[i].x;
-            featureFrame[feature_id].velocityRight.y() = right_pts_velocity[i].y;
-
-            // Eigen::Matrix<double, 7, 1> xyz_uv_velocity;
-            // xyz_uv_velocity << x, y, z, p_u, p_v, velocity_x, velocity_y;
-            // featureFrame[feature_id].emplace_back(camera_id,  xyz_uv_velocity);
-            // featureFrame[feature_id].pt_data_right = xyz_uv_velocity;
-            featureFrame[feature_id].is_stereo = true;
-
-        }
-    }
-
-    printf("feature track whole time %f\n", t_r.toc());
-    return featureFrame;
+    // the right image is not tracked on the gpu
+    return finishFrame(_img, rightImg, false);
 }
 
 std::vector<cv::cuda::GpuMat> FeatureTracker::buildImagePyramid(const cv::cuda::GpuMat& img, int maxLevel_) {
@@ -867,38 +879,110 @@ std::vector<cv::cuda::GpuMat> FeatureTracker::buildImagePyramid(const cv::cuda::
 
 void FeatureTracker::rejectWithF()
   {
-    if (cur_pts.size() >= 8)
+    if (tracks.size() >= 8)
     {
         ROS_DEBUG("FM ransac begins");
         TicToc t_f;
-        vector<cv::Point2f> un_cur_pts(cur_pts.size()), un_prev_pts(prev_pts.size());
-        for (unsigned int i = 0; i < cur_pts.size(); i++)
+        vector<cv::Point2f> un_cur_pts, un_prev_pts;
+        undistortedPts(tracks.cur_pts, 0, un_cur_pts);
+        undistortedPts(tracks.prev_pts, 0, un_prev_pts);
+        for (unsigned int i = 0; i < tracks.size(); i++)
         {
-            Eigen::Vector3d tmp_p;
-            m_camera[0]->liftProjective(Eigen::Vector2d(cur_pts[i].x, cur_pts[i].y), tmp_p);
-            tmp_p.x() = FOCAL_LENGTH * tmp_p.x() / tmp_p.z() + col / 2.0;
-            tmp_p.y() = FOCAL_LENGTH * tmp_p.y() / tmp_p.z() + row / 2.0;
-            un_cur_pts[i] = cv::Point2f(tmp_p.x(), tmp_p.y());
-
-            m_camera[0]->liftProjective(Eigen::Vector2d(prev_pts[i].x, prev_pts[i].y), tmp_p);
-            tmp_p.x() = FOCAL_LENGTH * tmp_p.x() / tmp_p.z() + col / 2.0;
-            tmp_p.y() = FOCAL_LENGTH * tmp_p.y() / tmp_p.z() + row / 2.0;
-            un_prev_pts[i] = cv::Point2f(tmp_p.x(), tmp_p.y());
+            un_cur_pts[i] = cv::Point2f(FOCAL_LENGTH * un_cur_pts[i].x + col / 2.0, FOCAL_LENGTH * un_cur_pts[i].y + row / 2.0);
+            un_prev_pts[i] = cv::Point2f(FOCAL_LENGTH * un_prev_pts[i].x + col / 2.0, FOCAL_LENGTH * un_prev_pts[i].y + row / 2.0);
         }
 
         vector<uchar> status;
         cv::findFundamentalMat(un_cur_pts, un_prev_pts, cv::FM_RANSAC, F_THRESHOLD, 0.99, status);
-        int size_a = cur_pts.size();
-        reduceVector(prev_pts, status);
-        reduceVector(cur_pts, status);
-        reduceVector(cur_un_pts, status);
-        reduceVector(ids, status);
-        reduceVector(track_cnt, status);
-        ROS_DEBUG("FM ransac: %d -> %lu: %f", size_a, cur_pts.size(), 1.0 * cur_pts.size() / size_a);
+        int size_a = tracks.size();
+        tracks.compact(status);
+        ROS_DEBUG("FM ransac: %d -> %lu: %f", size_a, tracks.size(), 1.0 * tracks.size() / size_a);
         ROS_DEBUG("FM ransac costs: %fms", t_f.toc());
     }
 }
 
+void FeatureTracker::setGyroRotation(const Eigen::Matrix3d &R_prev_cur)
+{
+    gyro_R_prev_cur = R_prev_cur;
+    has_gyro_rotation = true;
+}
+
+// with the rotation known only the translation direction is left, every track constrains it to
+// lie in its epipolar plane, so two tracks give a hypothesis
+void FeatureTracker::rejectWithGyro()
+{
+    const int n = tracks.size();
+    if (n < 8)
+        return;
+
+    ROS_DEBUG("2-point ransac begins");
+    TicToc t_r;
+    // finishFrame lifts the surviving tracks again, prev_un_pts are still valid from the last frame
+    undistortedPts(tracks.cur_pts, 0, tracks.cur_un_pts);
+
+    ransac_normals.resize(n);
+    ransac_rotated.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+        Eigen::Vector3d f_prev(tracks.prev_un_pts[i].x, tracks.prev_un_pts[i].y, 1.0);
+        ransac_rotated[i] = gyro_R_prev_cur * Eigen::Vector3d(tracks.cur_un_pts[i].x, tracks.cur_un_pts[i].y, 1.0);
+        ransac_normals[i] = ransac_rotated[i].cross(f_prev);
+    }
+
+    // distance to the epipolar line in the previous image, in pixels of the virtual camera
+    const double threshold = F_THRESHOLD / FOCAL_LENGTH;
+    auto countInliers = [&](const Eigen::Vector3d &t, vector<uchar> &status)
+    {
+        int cnt = 0;
+        status.resize(n);
+        for (int i = 0; i < n; i++)
+        {
+            Eigen::Vector3d line = t.cross(ransac_rotated[i]);
+            status[i] = fabs(t.dot(ransac_normals[i])) <= threshold * line.head<2>().norm();
+            cnt += status[i];
+        }
+        return cnt;
+    };
+
+    // pure rotation is a valid model as well, the 2-point hypotheses degenerate for it
+    int best_cnt = 0;
+    ransac_best_status.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+        const Eigen::Vector3d &g = ransac_rotated[i];
+        ransac_best_status[i] = g.z() > 0 && (g.head<2>() / g.z() - Eigen::Vector2d(tracks.prev_un_pts[i].x, tracks.prev_un_pts[i].y)).norm() <= threshold;
+        best_cnt += ransac_best_status[i];
+    }
+
+    const int max_iterations = 100;
+    int iterations = max_iterations;
+    for (int it = 0; it < iterations; it++)
+    {
+        int a = ransac_rng.uniform(0, n), b = ransac_rng.uniform(0, n);
+        if (a == b)
+            continue;
+        Eigen::Vector3d t = ransac_normals[a].cross(ransac_normals[b]);
+        double t_norm = t.norm();
+        if (t_norm < 1e-12)
+            continue;
+
+        int cnt = countInliers(t / t_norm, ransac_status);
+        if (cnt > best_cnt)
+        {
+            best_cnt = cnt;
+            ransac_best_status.swap(ransac_status);
+            double w = static_cast<double>(cnt) / n;
+            if (w > 0.999)
+                break;
+            iterations = min(max_iterations, static_cast<int>(ceil(log(0.01) / log(1.0 - w * w))));
+        }
+    }
+
+    tracks.compact(ransac_best_status);
+    ROS_DEBUG("2-point ransac: %d -> %lu: %f", n, tracks.size(), 1.0 * tracks.size() / n);
+    ROS_DEBUG("2-point ransac costs: %fms", t_r.toc());
+}
+
 void FeatureTracker::rejectDepth(const cv::Mat &depth_img){
 
     // ROS_WARN("rej depth");
@@ -906,9 +990,9 @@ void FeatureTracker::rejectDepth(const cv::Mat &depth_img){
 
     // ros::Time t0 = ros::Time::now();
 
-    std::vector<uchar> valid_status(cur_pts.size(), 0);
-    for (unsigned int i = 0; i < cur_pts.size(); i++){
-        double dep = depth_img.at<uint16_t>(cur_pts[i].y, cur_pts[i].x) * 0.001;
+    std::vector<uchar> valid_status(tracks.size(), 0);
+    for (unsigned int i = 0; i < tracks.size(); i++){
+        double dep = depth_img.at<uint16_t>(tracks.cur_pts[i].y, tracks.cur_pts[i].x) * 0.001;
         valid_status[i] = (dep < DEPTH_MAX && dep > DEPTH_MIN) ? 1 : 0;
     }
     // std::multimap<double, unsigned int> cur_pts_idx_sorted;
@@ -961,19 +1045,14 @@ void FeatureTracker::rejectDepth(const cv::Mat &depth_img){
 
     // ROS_WARN("depth cnt: %d", depth_valid_cnt);
 
-    reduceVector(cur_pts, valid_status);
-    reduceVector(ids, valid_status);
-    reduceVector(track_cnt, valid_status);
-    reduceVector(cur_un_pts, valid_status);
-    reduceVector(pts_velocity, valid_status);
+    tracks.compact(valid_status);
 }
 
 void FeatureTracker::setDepth(const cv::Mat &depth_img){
 
-    pts_depth.resize(cur_pts.size());
-    for (unsigned int i = 0; i < cur_pts.size(); i++){
-        double dep = depth_img.at<uint16_t>(cur_pts[i].y, cur_pts[i].x) * 0.001;
-        pts_depth[i] = (dep < DEPTH_MAX && dep > DEPTH_MIN) ? dep : -1.0;
+    for (unsigned int i = 0; i < tracks.size(); i++){
+        double dep = depth_img.at<uint16_t>(tracks.cur_pts[i].y, tracks.cur_pts[i].x) * 0.001;
+        tracks.depth[i] = (dep < DEPTH_MAX && dep > DEPTH_MIN) ? dep : -1.0;
     }
 }
 
@@ -989,6 +1068,32 @@ void FeatureTracker::readIntrinsicParameter(const vector<std::string> &calib_fil
         camodocal::CameraPtr camera_1 = CameraFactory::instance()->generateCameraFromYamlFile(calib_file[1]);
         m_camera.push_back(camera_1);
     }
+
+    lift_table.resize(m_camera.size());
+    if(UNDISTORT_LUT){
+        for(unsigned int i = 0; i < m_camera.size(); i++){
+            buildLiftTable(i);
+        }
+    }
+}
+
+void FeatureTracker::buildLiftTable(const int cam_idx)
+{
+    TicToc t_l;
+    const int width = m_camera[cam_idx]->imageWidth();
+    const int height = m_camera[cam_idx]->imageHeight();
+    // the extra row and column keep the bilinear lookup in range up to the image border
+    cv::Mat& table = lift_table[cam_idx];
+    table.create(height + 1, width + 1, CV_32FC2);
+    for(int v = 0; v <= height; v++){
+        cv::Vec2f* row_ptr = table.ptr<cv::Vec2f>(v);
+        for(int u = 0; u <= width; u++){
+            Eigen::Vector3d b;
+            m_camera[cam_idx]->liftProjective(Eigen::Vector2d(u, v), b);
+            row_ptr[u] = cv::Vec2f(static_cast<float>(b.x() / b.z()), static_cast<float>(b.y() / b.z()));
+        }
+    }
+    ROS_INFO("lift table of camera %s (%d x %d) built in %fms", m_camera[cam_idx]->cameraName().c_str(), width, height, t_l.toc());
 }
 
 void FeatureTracker::showUndistortion(const string &name)
@@ -1028,61 +1133,66 @@ void FeatureTracker::showUndistortion(const string &name)
     // cv::waitKey(0);
 }
 
-vector<cv::Point2f> FeatureTracker::undistortedPts(vector<cv::Point2f> &pts, camodocal::CameraPtr cam)
+cv::Point2f FeatureTracker::liftPoint(const cv::Point2f &pt, const int cam_idx)
 {
-    vector<cv::Point2f> un_pts;
-    for (unsigned int i = 0; i < pts.size(); i++)
+    const cv::Mat& table = lift_table[cam_idx];
+    const float x = pt.x, y = pt.y;
+    if (!table.empty() && x >= 0.f && y >= 0.f && x < table.cols - 1 && y < table.rows - 1)
     {
-        Eigen::Vector2d a(pts[i].x, pts[i].y);
-        Eigen::Vector3d b;
-        cam->liftProjective(a, b);
-        un_pts.emplace_back(b.x() / b.z(), b.y() / b.z());
+        if (UNDISTORT_LUT == 1)
+        {
+            const cv::Vec2f& p = table.at<cv::Vec2f>(cvRound(y), cvRound(x));
+            return cv::Point2f(p[0], p[1]);
+        }
+
+        const int u = static_cast<int>(x), v = static_cast<int>(y);
+        const float du = x - u, dv = y - v;
+        const cv::Vec2f* row0 = table.ptr<cv::Vec2f>(v);
+        const cv::Vec2f* row1 = table.ptr<cv::Vec2f>(v + 1);
+        const float w00 = (1.f - du) * (1.f - dv), w01 = du * (1.f - dv), w10 = (1.f - du) * dv, w11 = du * dv;
+        return cv::Point2f(w00 * row0[u][0] + w01 * row0[u + 1][0] + w10 * row1[u][0] + w11 * row1[u + 1][0],
+                           w00 * row0[u][1] + w01 * row0[u + 1][1] + w10 * row1[u][1] + w11 * row1[u + 1][1]);
     }
-    return un_pts;
+
+    Eigen::Vector2d a(x, y);
+    Eigen::Vector3d b;
+    m_camera[cam_idx]->liftProjective(a, b);
+    return cv::Point2f(b.x() / b.z(), b.y() / b.z());
 }
 
-vector<cv::Point2f> FeatureTracker::ptsVelocity(vector<int> &ids, vector<cv::Point2f> &pts,
-                                            map<int, cv::Point2f> &cur_id_pts, map<int, cv::Point2f> &prev_id_pts)
+void FeatureTracker::undistortedPts(const vector<cv::Point2f> &pts, const int cam_idx, vector<cv::Point2f> &un_pts)
 {
-    vector<cv::Point2f> pts_velocity;
-    cur_id_pts.clear();
-    for (unsigned int i = 0; i < ids.size(); i++)
-    {
-        cur_id_pts.insert(make_pair(ids[i], pts[i]));
-    }
+    un_pts.resize(pts.size());
+    for (unsigned int i = 0; i < pts.size(); i++)
+        un_pts[i] = liftPoint(pts[i], cam_idx);
+}
 
+void FeatureTracker::ptsVelocity()
+{
+    // a row with track_cnt > 1 was seen in the previous frame, its old position is in the same row
     mean_optical_flow_speed = 0.0;
     int optical_flow_pt_cnt = 0;
 
-    // caculate points velocity
-    if (!prev_id_pts.empty())
+    double dt = cur_time - prev_time;
+    for (unsigned int i = 0; i < tracks.size(); i++)
     {
-        double dt = cur_time - prev_time;
-
-        for (unsigned int i = 0; i < pts.size(); i++)
+        const bool tracked = tracks.track_cnt[i] > 1;
+        if (tracked)
         {
-            std::map<int, cv::Point2f>::iterator it;
-            it = prev_id_pts.find(ids[i]);
-            if (it != prev_id_pts.end())
-            {
-                double v_x = (pts[i].x - it->second.x) / dt;
-                double v_y = (pts[i].y - it->second.y) / dt;
-                pts_velocity.emplace_back(v_x, v_y);
-
-                mean_optical_flow_speed += sqrt(v_x * v_x + v_y * v_y);
-                optical_flow_pt_cnt++;
-            }
-            else
-                pts_velocity.emplace_back(0, 0);
+            double v_x = (tracks.cur_un_pts[i].x - tracks.prev_un_pts[i].x) / dt;
+            double v_y = (tracks.cur_un_pts[i].y - tracks.prev_un_pts[i].y) / dt;
+            tracks.velocity[i] = cv::Point2f(v_x, v_y);
 
+            mean_optical_flow_speed += sqrt(v_x * v_x + v_y * v_y);
+            optical_flow_pt_cnt++;
         }
-    }
-    else
-    {
-        for (unsigned int i = 0; i < cur_pts.size(); i++)
-        {
-            pts_velocity.emplace_back(0, 0);
-        }
+        else
+            tracks.velocity[i] = cv::Point2f(0, 0);
+
+        if (tracked && tracks.has_right[i] && tracks.prev_has_right[i])
+            tracks.right_velocity[i] = (tracks.cur_un_right_pts[i] - tracks.prev_un_right_pts[i]) / dt;
+        else
+            tracks.right_velocity[i] = cv::Point2f(0, 0);
     }
 
     if(optical_flow_pt_cnt > 0){
@@ -1091,15 +1201,9 @@ vector<cv::Point2f> FeatureTracker::ptsVelocity(vector<int> &ids, vector<cv::Poi
     else{
         mean_optical_flow_speed = std::numeric_limits<double>::max();
     }
-
-    return pts_velocity;
 }
 
-void FeatureTracker::drawTrack(const cv::Mat &imLeft, const cv::Mat &imRight,
-                               vector<int> &curLeftIds,
-                               vector<cv::Point2f> &curLeftPts,
-                               vector<cv::Point2f> &curRightPts,
-                               map<int, cv::Point2f> &prevLeftPtsMap)
+void FeatureTracker::drawTrack(const cv::Mat &imLeft, const cv::Mat &imRight)
 {
     //int rows = imLeft.rows;
     int cols = imLeft.cols;
@@ -1123,16 +1227,18 @@ void FeatureTracker::drawTrack(const cv::Mat &imLeft, const cv::Mat &imRight,
     }
     cv::cvtColor(imTrack, imTrack, cv::COLOR_GRAY2BGR);
 
-    for (size_t j = 0; j < curLeftPts.size(); j++)
+    for (size_t j = 0; j < tracks.size(); j++)
     {
-        double len = std::min(1.0, 1.0 * track_cnt[j] / 20);
-        cv::circle(imTrack, curLeftPts[j], 2, cv::Scalar(255 * (1 - len), 0, 255 * len), 2);
+        double len = std::min(1.0, 1.0 * tracks.track_cnt[j] / 20);
+        cv::circle(imTrack, tracks.cur_pts[j], 2, cv::Scalar(255 * (1 - len), 0, 255 * len), 2);
     }
     if (!imRight.empty() && stereo)
     {
-        for (size_t i = 0; i < curRightPts.size(); i++)
+        for (size_t i = 0; i < tracks.size(); i++)
         {
-            cv::Point2f rightPt = curRightPts[i];
+            if (!tracks.has_right[i])
+                continue;
+            cv::Point2f rightPt = tracks.cur_right_pts[i];
             rightPt.x += cols;
             cv::circle(imTrack, rightPt, 2, cv::Scalar(0, 255, 0), 2);
             //cv::Point2f leftPt = curLeftPtsTrackRight[i];
@@ -1140,14 +1246,11 @@ void FeatureTracker::drawTrack(const cv::Mat &imLeft, const cv::Mat &imRight,
         }
     }
 
-    map<int, cv::Point2f>::iterator mapIt;
-    for (size_t i = 0; i < curLeftIds.size(); i++)
+    for (size_t i = 0; i < tracks.size(); i++)
     {
-        int id = curLeftIds[i];
-        mapIt = prevLeftPtsMap.find(id);
-        if(mapIt != prevLeftPtsMap.end())
+        if(tracks.track_cnt[i] > 1)
         {
-            cv::arrowedLine(imTrack, curLeftPts[i], mapIt->second, cv::Scalar(0, 255, 0), 1, 8, 0, 0.2);
+            cv::arrowedLine(imTrack, tracks.cur_pts[i], tracks.prev_pts[i], cv::Scalar(0, 255, 0), 1, 8, 0, 0.2);
         }
     }
 
@@ -1165,16 +1268,35 @@ void FeatureTracker::drawTrack(const cv::Mat &imLeft, const cv::Mat &imRight,
 }
 
 
+// a rotation only warp, the translation between two frames is small compared to the depth
+void FeatureTracker::predictPtsWithGyro()
+{
+    hasPrediction = true;
+    predict_pts.resize(tracks.size());
+    Eigen::Matrix3d R_cur_prev = gyro_R_prev_cur.transpose();
+    for (size_t i = 0; i < tracks.size(); i++)
+    {
+        Eigen::Vector3d pts_cur = R_cur_prev * Eigen::Vector3d(tracks.prev_un_pts[i].x, tracks.prev_un_pts[i].y, 1.0);
+        Eigen::Vector2d tmp_uv;
+        if (pts_cur.z() > 0)
+        {
+            m_camera[0]->spaceToPlane(pts_cur, tmp_uv);
+            predict_pts[i] = cv::Point2f(tmp_uv.x(), tmp_uv.y());
+        }
+        else
+            predict_pts[i] = tracks.prev_pts[i];
+    }
+}
+
 void FeatureTracker::setPrediction(map<int, Eigen::Vector3d> &predictPts)
 {
     hasPrediction = true;
     predict_pts.clear();
     predict_pts_debug.clear();
     map<int, Eigen::Vector3d>::iterator itPredict;
-    for (size_t i = 0; i < ids.size(); i++)
+    for (size_t i = 0; i < tracks.size(); i++)
     {
-        //printf("prevLeftId size %d prevLeftPts size %d\n",(int)prevLeftIds.size(), (int)prevLeftPts.size());
-        int id = ids[i];
+        int id = tracks.ids[i];
         itPredict = predictPts.find(id);
         if (itPredict != predictPts.end())
         {
@@ -1184,7 +1306,7 @@ void FeatureTracker::setPrediction(map<int, Eigen::Vector3d> &predictPts)
             predict_pts_debug.push_back(cv::Point2f(tmp_uv.x(), tmp_uv.y()));
         }
         else
-            predict_pts.push_back(prev_pts[i]);
+            predict_pts.push_back(tracks.prev_pts[i]);
     }
 }
 
@@ -1193,18 +1315,16 @@ void FeatureTracker::removeOutliers(set<int> &removePtsIds)
 {
     std::set<int>::iterator itSet;
     vector<uchar> status;
-    for (size_t i = 0; i < ids.size(); i++)
+    for (size_t i = 0; i < tracks.size(); i++)
     {
-        itSet = removePtsIds.find(ids[i]);
+        itSet = removePtsIds.find(tracks.ids[i]);
         if(itSet != removePtsIds.end())
             status.emplace_back(0);
         else
             status.emplace_back(1);
     }
 
-    reduceVector(prev_pts, status);
-    reduceVector(ids, status);
-    reduceVector(track_cnt, status);
+    tracks.compact(status);
 }
 
 
@@ -36,6 +36,9 @@
 #include "../estimator/parameters.h"
 #include "../utility/tic_toc.h"
 #include "../estimator/feature_data_type.h"
+#include "occupancy_grid.h"
+#include "track_table.h"
+#include "clahe.h"
 
 using namespace std;
 using namespace camodocal;
@@ -44,8 +47,8 @@ using namespace Eigen;
 namespace vins_multi{
 
 bool inBorder(const cv::Point2f &pt);
-void reduceVector(vector<cv::Point2f> &v, vector<uchar> status);
-void reduceVector(vector<int> &v, vector<uchar> status);
+void reduceVector(vector<cv::Point2f> &v, const vector<uchar> &status);
+void reduceVector(vector<int> &v, const vector<uchar> &status);
 
 class FeatureTracker
 {
@@ -56,36 +59,54 @@ public:
     ~FeatureTracker(){
         ROS_ERROR("delete feature tracker!");
     }
-    map<int, FeaturePerFrame> trackImage(double _cur_time, const cv::Mat &_img, const cv::Mat &_img1 = cv::Mat());
+    FeatureFrame trackImage(double _cur_time, const cv::Mat &_img, const cv::Mat &_img1 = cv::Mat());
+    void maintainTracks(double _cur_time, const cv::Mat &_img);
     void set_max_feature_num(int max_feature_num);
     void setMask();
+    void detectFeaturesGrid(const int n_max_cnt);
     void readIntrinsicParameter(const vector<std::string> &calib_file);
     void showUndistortion(const string &name);
     void rejectWithF();
+    void rejectWithGyro();
+    void setGyroRotation(const Eigen::Matrix3d &R_prev_cur);
     void rejectDepth(const cv::Mat &depth_img);
     void setDepth(const cv::Mat &depth_img);
     void undistortedPoints();
-    vector<cv::Point2f> undistortedPts(vector<cv::Point2f> &pts, camodocal::CameraPtr cam);
-    vector<cv::Point2f> ptsVelocity(vector<int> &ids, vector<cv::Point2f> &pts, 
-                                    map<int, cv::Point2f> &cur_id_pts, map<int, cv::Point2f> &prev_id_pts);
+    void buildLiftTable(const int cam_idx);
+    cv::Point2f liftPoint(const cv::Point2f &pt, const int cam_idx);
+    void undistortedPts(const vector<cv::Point2f> &pts, const int cam_idx, vector<cv::Point2f> &un_pts);
+    void ptsVelocity();
+    void trackRightImage(const cv::Mat &rightImg);
+    FeatureFrame finishFrame(const cv::Mat &img, const cv::Mat &rightImg, const bool track_right);
     void showTwoImage(const cv::Mat &img1, const cv::Mat &img2, 
                       vector<cv::Point2f> pts1, vector<cv::Point2f> pts2);
-    void drawTrack(const cv::Mat &imLeft, const cv::Mat &imRight, 
-                                   vector<int> &curLeftIds,
-                                   vector<cv::Point2f> &curLeftPts, 
-                                   vector<cv::Point2f> &curRightPts,
-                                   map<int, cv::Point2f> &prevLeftPtsMap);
+    void drawTrack(const cv::Mat &imLeft, const cv::Mat &imRight);
     void setPrediction(map<int, Eigen::Vector3d> &predictPts);
+    void predictPtsWithGyro();
     double distance(cv::Point2f &pt1, cv::Point2f &pt2);
     void removeOutliers(set<int> &removePtsIds);
     cv::Mat& getTrackImage();
     bool inBorder(const cv::Point2f &pt);
+    cv::Mat prepareImage(const cv::Mat &_img, const cv::Mat &_img1);
+    void buildLKPyramid(const cv::Mat &img, std::vector<cv::Mat> &pyr);
+    void setLKBounds(const int win_min, const int win_max, const int level_min, const int level_max);
+    void selectLKParams(cv::Size &win_size, int &max_level);
+    void updateLKStats(const vector<uchar> &status);
 
     int row, col;
     cv::Mat imTrack;
     cv::Mat mask;
+    OccupancyGrid occupancy_grid;
+    vector<int> mask_order;
+    vector<uchar> mask_status;
     cv::Mat fisheye_mask;
     cv::Mat prev_img, cur_img;
+    // equalization state, the previous equalized frame stays alive as prev_img
+    Clahe clahe;
+    cv::Mat equalized_img, prev_equalized_img, equalized_right_img;
+    ThreadPool *thread_pool;
+    // built once per frame and shared by all LK calls, the previous one is kept for the next frame
+    std::vector<cv::Mat> prev_img_pyr, cur_img_pyr, right_img_pyr;
 
 #ifdef WITH_CUDA
 
@@ -95,7 +116,7 @@ public:
 
     std::vector<cv::cuda::GpuMat> prev_pyr;
 
-    map<int, FeaturePerFrame> trackImageGPU(double _cur_time, const cv::Mat &_img, const cv::Mat &_img1 = cv::Mat());
+    FeatureFrame trackImageGPU(double _cur_time, const cv::Mat &_img, const cv::Mat &_img1 = cv::Mat());
     std::vector<cv::cuda::GpuMat> buildImagePyramid(const cv::cuda::GpuMat& prevImg, int maxLevel_);
 
 #endif
@@ -103,26 +124,31 @@ public:
     vector<cv::Point2f> n_pts;
     vector<cv::Point2f> predict_pts;
     vector<cv::Point2f> predict_pts_debug;
-    vector<cv::Point2f> prev_pts, cur_pts, cur_right_pts;
-    vector<cv::Point2f> prev_un_pts, cur_un_pts, cur_un_right_pts;
-    vector<cv::Point2f> pts_velocity, right_pts_velocity;
-    vector<int> ids, ids_right;
-    vector<int> track_cnt;
-    vector<double> prev_depth, pts_depth;
-    map<int, cv::Point2f> cur_un_pts_map, prev_un_pts_map;
-    map<int, cv::Point2f> cur_un_right_pts_map, prev_un_right_pts_map;
-    map<int, cv::Point2f> prevLeftPtsMap;
+    TrackTable tracks;
     vector<camodocal::CameraPtr> m_camera;
+    // normalized image coordinates of every pixel per camera, CV_32FC2 with one extra row and column
+    vector<cv::Mat> lift_table;
     double cur_time;
     double prev_time;
     int n_id;
     bool hasPrediction;
+    // rotation from the current to the previous camera frame, integrated from the gyro
+    bool has_gyro_rotation;
+    Eigen::Matrix3d gyro_R_prev_cur;
+    vector<Eigen::Vector3d> ransac_normals, ransac_rotated;
+    vector<uchar> ransac_status, ransac_best_status;
+    cv::RNG ransac_rng;
     atomic<int> max_cnt;
     atomic<int> track_num;
     atomic<double> track_percentage;
 
     double mean_optical_flow_speed;
 
+    // optical flow bounds and the mean displacement of the last frame in pixels, raw and relative
+    // to the prediction, negative if unknown
+    int lk_win_min, lk_win_max, lk_level_min, lk_level_max;
+    double lk_flow_px, lk_residual_px;
+
     // inline static std::mutex gpu_mutex;
 
     bool depth;
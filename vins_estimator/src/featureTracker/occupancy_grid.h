@@ -0,0 +1,94 @@
+/*******************************************************
+ * Copyright (C) 2025, Aerial Robotics Group, Hong Kong University of Science and Technology
+ *
+ * This file is part of VINS.
+ *
+ * Licensed under the GNU General Public License v3.0;
+ * you may not use this file except in compliance with the License.
+ *******************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+namespace vins_multi{
+
+// spatial hash with cells of one suppression radius, a point only has to be checked
+// against the 3x3 neighbouring cells; buffers are kept across frames
+class OccupancyGrid
+{
+  public:
+    void reset(const int width, const int height, const double radius)
+    {
+        width_ = width;
+        height_ = height;
+        radius_ = radius;
+        cell_size_ = std::max(1.0, radius);
+        cols_ = std::max(1, static_cast<int>(std::ceil(width / cell_size_)));
+        rows_ = std::max(1, static_cast<int>(std::ceil(height / cell_size_)));
+        head_.assign(cols_ * rows_, -1);
+        next_.clear();
+        pts_.clear();
+    }
+
+    // true if no inserted point is within the radius
+    bool isFree(const cv::Point2f &pt) const
+    {
+        const int c = cellCol(pt.x), r = cellRow(pt.y);
+        const double radius_sq = radius_ * radius_;
+        for (int rr = std::max(0, r - 1); rr <= std::min(rows_ - 1, r + 1); rr++)
+        {
+            for (int cc = std::max(0, c - 1); cc <= std::min(cols_ - 1, c + 1); cc++)
+            {
+                for (int i = head_[rr * cols_ + cc]; i >= 0; i = next_[i])
+                {
+                    const double dx = pts_[i].x - pt.x, dy = pts_[i].y - pt.y;
+                    if (dx * dx + dy * dy <= radius_sq)
+                        return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    void insert(const cv::Point2f &pt)
+    {
+        const int cell = cellRow(pt.y) * cols_ + cellCol(pt.x);
+        pts_.push_back(pt);
+        next_.push_back(head_[cell]);
+        head_[cell] = pts_.size() - 1;
+    }
+
+    // full resolution mask for detectors that need one, 0 around every inserted point
+    void rasterize(cv::Mat &mask) const
+    {
+        mask.create(height_, width_, CV_8UC1);
+        mask.setTo(255);
+        for (auto &pt : pts_)
+            cv::circle(mask, pt, radius_, 0, -1);
+    }
+
+  private:
+    int cellCol(const float x) const
+    {
+        return std::min(cols_ - 1, std::max(0, static_cast<int>(x / cell_size_)));
+    }
+
+    int cellRow(const float y) const
+    {
+        return std::min(rows_ - 1, std::max(0, static_cast<int>(y / cell_size_)));
+    }
+
+    int width_ = 0, height_ = 0;
+    int cols_ = 1, rows_ = 1;
+    double radius_ = 0.0, cell_size_ = 1.0;
+
+    std::vector<int> head_;
+    std::vector<int> next_;
+    std::vector<cv::Point2f> pts_;
+};
+
+}
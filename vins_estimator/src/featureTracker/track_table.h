@@ -0,0 +1,134 @@
+/*******************************************************
+ * Copyright (C) 2025, Aerial Robotics Group, Hong Kong University of Science and Technology
+ *
+ * This file is part of VINS.
+ *
+ * Licensed under the GNU General Public License v3.0;
+ * you may not use this file except in compliance with the License.
+ *******************************************************/
+
+#pragma once
+
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+namespace vins_multi{
+
+// structure of arrays with one row per live track, all columns always have size() entries.
+// a row keeps its track's history (prev_*), so no id lookup is needed between frames
+struct TrackTable
+{
+    std::vector<int> ids;
+    std::vector<int> track_cnt;
+    std::vector<cv::Point2f> prev_pts, cur_pts;
+    std::vector<cv::Point2f> prev_un_pts, cur_un_pts;
+    std::vector<cv::Point2f> velocity;
+    std::vector<double> depth;
+
+    std::vector<uchar> prev_has_right, has_right;
+    std::vector<cv::Point2f> cur_right_pts;
+    std::vector<cv::Point2f> prev_un_right_pts, cur_un_right_pts;
+    std::vector<cv::Point2f> right_velocity;
+
+    size_t size() const
+    {
+        return ids.size();
+    }
+
+    void reserve(const size_t n)
+    {
+        ids.reserve(n);
+        track_cnt.reserve(n);
+        prev_pts.reserve(n);
+        cur_pts.reserve(n);
+        prev_un_pts.reserve(n);
+        cur_un_pts.reserve(n);
+        velocity.reserve(n);
+        depth.reserve(n);
+        prev_has_right.reserve(n);
+        has_right.reserve(n);
+        cur_right_pts.reserve(n);
+        prev_un_right_pts.reserve(n);
+        cur_un_right_pts.reserve(n);
+        right_velocity.reserve(n);
+    }
+
+    // new track seen for the first time at pt
+    void add(const cv::Point2f &pt, const int id)
+    {
+        ids.push_back(id);
+        track_cnt.push_back(1);
+        prev_pts.push_back(pt);
+        cur_pts.push_back(pt);
+        prev_un_pts.emplace_back(0.f, 0.f);
+        cur_un_pts.emplace_back(0.f, 0.f);
+        velocity.emplace_back(0.f, 0.f);
+        depth.push_back(-1.0);
+        prev_has_right.push_back(0);
+        has_right.push_back(0);
+        cur_right_pts.emplace_back(0.f, 0.f);
+        prev_un_right_pts.emplace_back(0.f, 0.f);
+        cur_un_right_pts.emplace_back(0.f, 0.f);
+        right_velocity.emplace_back(0.f, 0.f);
+    }
+
+    // drops the rows with status 0 from every column in one pass, order is kept
+    void compact(const std::vector<uchar> &status)
+    {
+        size_t j = 0;
+        for (size_t i = 0; i < size(); i++)
+        {
+            if (!status[i])
+                continue;
+            if (i != j)
+            {
+                ids[j] = ids[i];
+                track_cnt[j] = track_cnt[i];
+                prev_pts[j] = prev_pts[i];
+                cur_pts[j] = cur_pts[i];
+                prev_un_pts[j] = prev_un_pts[i];
+                cur_un_pts[j] = cur_un_pts[i];
+                velocity[j] = velocity[i];
+                depth[j] = depth[i];
+                prev_has_right[j] = prev_has_right[i];
+                has_right[j] = has_right[i];
+                cur_right_pts[j] = cur_right_pts[i];
+                prev_un_right_pts[j] = prev_un_right_pts[i];
+                cur_un_right_pts[j] = cur_un_right_pts[i];
+                right_velocity[j] = right_velocity[i];
+            }
+            j++;
+        }
+        resize(j);
+    }
+
+    // the current frame becomes the previous one
+    void advance()
+    {
+        prev_pts = cur_pts;
+        prev_un_pts = cur_un_pts;
+        prev_has_right = has_right;
+        prev_un_right_pts = cur_un_right_pts;
+    }
+
+  private:
+    void resize(const size_t n)
+    {
+        ids.resize(n);
+        track_cnt.resize(n);
+        prev_pts.resize(n);
+        cur_pts.resize(n);
+        prev_un_pts.resize(n);
+        cur_un_pts.resize(n);
+        velocity.resize(n);
+        depth.resize(n);
+        prev_has_right.resize(n);
+        has_right.resize(n);
+        cur_right_pts.resize(n);
+        prev_un_right_pts.resize(n);
+        cur_un_right_pts.resize(n);
+        right_velocity.resize(n);
+    }
+};
+
+}
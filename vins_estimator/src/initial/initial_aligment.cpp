@@ -45,7 +45,7 @@ void solveGyroscopeBias(map<double, shared_ptr<ImageFrame>>& all_image_frame_ptr
     for (auto frame_i = all_image_frame_ptr.begin(); next(frame_i) != all_image_frame_ptr.end( ); frame_i++)
     {
         auto frame_j = next(frame_i);
-        frame_j->second->pre_integration_->repropagate(Vector3d::Zero(), all_image_frame_ptr.begin()->second->Bg_);
+        frame_j->second->pre_integration_->updateBias(Vector3d::Zero(), all_image_frame_ptr.begin()->second->Bg_);
     }
 }
 
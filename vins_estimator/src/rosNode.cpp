@@ -12,60 +12,35 @@
 
 namespace vins_multi{
 
-cv_bridge::CvImagePtr getImageFromMsg(const sensor_msgs::ImageConstPtr &img_msg)
+// wraps the message without a copy, the returned pointer keeps the message alive.
+// "8UC1" and "16UC1" map to the same cv type as mono8 and mono16, they need no conversion either
+cv_bridge::CvImageConstPtr getImageFromMsg(const sensor_msgs::ImageConstPtr &img_msg)
 {
-    cv_bridge::CvImagePtr ptr;
-    if (img_msg->encoding == "8UC1")
-    {
-        sensor_msgs::Image img;
-        img.header = img_msg->header;
-        img.height = img_msg->height;
-        img.width = img_msg->width;
-        img.is_bigendian = img_msg->is_bigendian;
-        img.step = img_msg->step;
-        img.data = img_msg->data;
-        img.encoding = "mono8";
-        ptr = cv_bridge::toCvCopy(img, sensor_msgs::image_encodings::MONO8);
-
-        // ptr = cv_bridge::toCvShare(img_msg, "mono8");
-    }
-    else{
-        ptr = cv_bridge::toCvCopy(img_msg, img_msg->encoding);
-        // ptr = cv_bridge::toCvShare(img_msg, "mono8");
-
-        // ROS_WARN("convert rgb");
-    }
-
-    return ptr;
+    return cv_bridge::toCvShare(img_msg);
 }
 
-cv_bridge::CvImagePtr getDepthFromMsg(const sensor_msgs::ImageConstPtr &depth_msg)
+cv_bridge::CvImageConstPtr getDepthFromMsg(const sensor_msgs::ImageConstPtr &depth_msg)
 {
-    cv_bridge::CvImagePtr cv_ptr_depth;
-
-    if (depth_msg->encoding == sensor_msgs::image_encodings::TYPE_16UC1)
-    {
-        sensor_msgs::Image* img_ptr = new sensor_msgs::Image;
-        img_ptr->header = depth_msg->header;
-        img_ptr->height = depth_msg->height;
-        img_ptr->width = depth_msg->width;
-        img_ptr->is_bigendian = depth_msg->is_bigendian;
-        img_ptr->step = depth_msg->step;
-        img_ptr->data = depth_msg->data;
-        img_ptr->encoding = sensor_msgs::image_encodings::MONO16;
-        const sensor_msgs::ImagePtr c_img_ptr(img_ptr);
-        cv_ptr_depth = cv_bridge::toCvCopy(*img_ptr, sensor_msgs::image_encodings::MONO16);
-
-    }
-    else{
-        cv_ptr_depth = cv_bridge::toCvCopy(depth_msg, depth_msg->encoding);
-
-    }
-
     if (depth_msg->encoding == sensor_msgs::image_encodings::TYPE_32FC1) {
+        cv_bridge::CvImagePtr cv_ptr_depth = cv_bridge::toCvCopy(depth_msg, depth_msg->encoding);
         (cv_ptr_depth->image).convertTo(cv_ptr_depth->image, CV_16UC1, 0.001);
+        return cv_ptr_depth;
     }
-    return cv_ptr_depth;
+    return cv_bridge::toCvShare(depth_msg);
+}
+
+// color frames are converted by the image processing task into a reused buffer
+int grayConversion(const std::string &encoding)
+{
+    if (encoding == sensor_msgs::image_encodings::RGB8)
+        return cv::COLOR_RGB2GRAY;
+    if (encoding == sensor_msgs::image_encodings::BGR8)
+        return cv::COLOR_BGR2GRAY;
+    if (encoding == sensor_msgs::image_encodings::RGBA8)
+        return cv::COLOR_RGBA2GRAY;
+    if (encoding == sensor_msgs::image_encodings::BGRA8)
+        return cv::COLOR_BGRA2GRAY;
+    return -1;
 }
 
 void VinsNodeBaseClass::set_modules(){
@@ -118,59 +93,26 @@ void VinsNodeBaseClass::restart_callback(const std_msgs::BoolConstPtr &restart_m
 
 void VinsNodeBaseClass::camera_module_info_with_sub::imgs_callback(const sensor_msgs::ImageConstPtr &img0_msg, const sensor_msgs::ImageConstPtr &img1_msg){
 
-    cv_bridge::CvImagePtr img_0;
-    cv_bridge::CvImagePtr img_1;
-
-    img_0 = getImageFromMsg(img0_msg);
+    cv_bridge::CvImageConstPtr img_0 = getImageFromMsg(img0_msg);
+    cv_bridge::CvImageConstPtr img_1;
     if(module_info_.depth_){
         img_1 = getDepthFromMsg(img1_msg);
     } else if(module_info_.stereo_){
         img_1 = getImageFromMsg(img1_msg);
     }
-
-    if(img0_msg->encoding == sensor_msgs::image_encodings::RGB8){
-
-        if(USE_GPU){
-
-#ifdef WITH_CUDA
-            cv::cuda::GpuMat img0_gpu;
-            cv::cuda::GpuMat img0_gray_gpu;
-            img0_gpu.upload(img_0->image);
-            cv::cuda::cvtColor(img0_gpu, img0_gray_gpu, cv::COLOR_RGB2GRAY);
-            img0_gray_gpu.download(img_0->image);
-#endif
-        }
-        else{
-            cv::cvtColor(img_0->image, img_0->image, cv::COLOR_RGB2GRAY);
-        }
-    }
-    else if(img0_msg->encoding == sensor_msgs::image_encodings::BGR8){
-        if(USE_GPU){
-
-#ifdef WITH_CUDA
-            cv::cuda::GpuMat img0_gpu;
-            cv::cuda::GpuMat img0_gray_gpu;
-            img0_gpu.upload(img_0->image);
-            cv::cuda::cvtColor(img0_gpu, img0_gray_gpu, cv::COLOR_BGR2GRAY);
-            img0_gray_gpu.download(img_0->image);
-#endif
-        }
-        else{
-            cv::cvtColor(img_0->image, img_0->image, cv::COLOR_BGR2GRAY);
-        }
+    else{
+        return;
     }
 
-
-    if(module_info_.depth_)
-        estimator_ptr_->inputImageToBuffer(unique_id_, img0_msg->header.stamp.toSec(), img_0->image, img_1->image);
-
-    else if(module_info_.stereo_)
-        estimator_ptr_->inputImageToBuffer(unique_id_, img0_msg->header.stamp.toSec(), img_0->image, img_1->image);
-
+    // the buffered frame points into the messages, they are released with the frame
+    shared_ptr<const void> hold(img_0.get(), [img_0, img_1](const void*){});
+    estimator_ptr_->inputImageToBuffer(unique_id_, img0_msg->header.stamp.toSec(), img_0->image, img_1->image, hold, grayConversion(img0_msg->encoding));
 }
 
 void VinsNodeBaseClass::camera_module_info_with_sub::img_callback(const sensor_msgs::ImageConstPtr &img0_msg){
-    estimator_ptr_->inputImage(unique_id_, img0_msg->header.stamp.toSec(), getImageFromMsg(img0_msg)->image);
+    cv_bridge::CvImageConstPtr img_0 = getImageFromMsg(img0_msg);
+    shared_ptr<const void> hold(img_0.get(), [img_0](const void*){});
+    estimator_ptr_->inputImageToBuffer(unique_id_, img0_msg->header.stamp.toSec(), img_0->image, cv::Mat(), hold, grayConversion(img0_msg->encoding));
 }
 
 void VinsNodeBaseClass::camera_module_info_with_sub::comp_imgs_callback(const sensor_msgs::CompressedImageConstPtr &img1_msg, const sensor_msgs::CompressedImageConstPtr &img2_msg){
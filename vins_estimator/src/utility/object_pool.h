@@ -0,0 +1,110 @@
+/*******************************************************
+ * Copyright (C) 2025, Aerial Robotics Group, Hong Kong University of Science and Technology
+ *
+ * This file is part of VINS.
+ *
+ * Licensed under the GNU General Public License v3.0;
+ * you may not use this file except in compliance with the License.
+ *******************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace vins_multi{
+
+// free list of fixed size slots, grows by chunks and never gives memory back,
+// so steady state new/delete of the pooled type does not touch the heap
+template <typename T>
+class ObjectPool
+{
+  public:
+    static ObjectPool& instance()
+    {
+        // never destroyed: pooled objects may outlive static destruction (e.g. owned by a ceres::Problem)
+        static ObjectPool* pool = new ObjectPool();
+        return *pool;
+    }
+
+    void* allocate()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!free_list_)
+            grow();
+        Slot* slot = free_list_;
+        free_list_ = slot->next;
+        return slot->storage;
+    }
+
+    void deallocate(void* ptr)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Slot* slot = reinterpret_cast<Slot*>(ptr);
+        slot->next = free_list_;
+        free_list_ = slot;
+    }
+
+    size_t capacity()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return capacity_;
+    }
+
+  private:
+    union Slot
+    {
+        Slot* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    ObjectPool() = default;
+
+    void grow()
+    {
+        const size_t chunk_size = capacity_ == 0 ? 64 : capacity_;
+        chunks_.emplace_back(new Slot[chunk_size]);
+        Slot* chunk = chunks_.back().get();
+        for (size_t i = 0; i < chunk_size; i++)
+        {
+            chunk[i].next = free_list_;
+            free_list_ = &chunk[i];
+        }
+        capacity_ += chunk_size;
+    }
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Slot[]>> chunks_;
+    Slot* free_list_ = nullptr;
+    size_t capacity_ = 0;
+};
+
+// inherit to route new/delete of T through ObjectPool<T>, works for objects deleted through a base pointer
+// (ceres::Problem, MarginalizationInfo) as long as the base has a virtual destructor
+template <typename T>
+struct PooledObject
+{
+    static void* operator new(size_t size)
+    {
+        if (size != sizeof(T))
+            return ::operator new(size);
+        return ObjectPool<T>::instance().allocate();
+    }
+
+    static void operator delete(void* ptr, size_t size)
+    {
+        if (!ptr)
+            return;
+        if (size != sizeof(T))
+        {
+            ::operator delete(ptr);
+            return;
+        }
+        ObjectPool<T>::instance().deallocate(ptr);
+    }
+};
+
+}
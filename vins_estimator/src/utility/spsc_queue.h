@@ -0,0 +1,71 @@
+/*******************************************************
+ * Copyright (C) 2025, Aerial Robotics Group, Hong Kong University of Science and Technology
+ *
+ * This file is part of VINS.
+ *
+ * Licensed under the GNU General Public License v3.0;
+ * you may not use this file except in compliance with the License.
+ *******************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace vins_multi{
+
+// bounded lock-free ring buffer for exactly one producer thread and one consumer thread
+template <typename T>
+class SPSCQueue
+{
+  public:
+    explicit SPSCQueue(const size_t capacity)
+    {
+        size_t size = 2;
+        while (size < capacity + 1)
+            size <<= 1;
+        buffer_.resize(size);
+        mask_ = size - 1;
+    }
+
+    SPSCQueue(const SPSCQueue&) = delete;
+    SPSCQueue& operator=(const SPSCQueue&) = delete;
+
+    // producer side, false if the queue is full
+    bool push(const T& item)
+    {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        const size_t next_head = (head + 1) & mask_;
+        if (next_head == tail_.load(std::memory_order_acquire))
+            return false;
+        buffer_[head] = item;
+        head_.store(next_head, std::memory_order_release);
+        return true;
+    }
+
+    // consumer side, false if the queue is empty
+    bool pop(T& item)
+    {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire))
+            return false;
+        item = buffer_[tail];
+        tail_.store((tail + 1) & mask_, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const
+    {
+        return tail_.load(std::memory_order_acquire) == head_.load(std::memory_order_acquire);
+    }
+
+  private:
+    std::vector<T> buffer_;
+    size_t mask_;
+    // separate cache lines, head is written by the producer and tail by the consumer
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+};
+
+}
@@ -0,0 +1,215 @@
+/*******************************************************
+ * Copyright (C) 2025, Aerial Robotics Group, Hong Kong University of Science and Technology
+ *
+ * This file is part of VINS.
+ *
+ * Licensed under the GNU General Public License v3.0;
+ * you may not use this file except in compliance with the License.
+ *******************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+namespace vins_multi{
+
+// fixed size pool, every worker owns a task deque and steals from the others when it runs dry
+class ThreadPool
+{
+  public:
+    explicit ThreadPool(const unsigned int num_threads, const bool cpu_affinity = false)
+    {
+        const unsigned int thread_num = std::max(1U, num_threads);
+        for (unsigned int i = 0; i < thread_num; i++)
+            queues_.emplace_back(new WorkQueue());
+
+        for (unsigned int i = 0; i < thread_num; i++)
+        {
+            workers_.emplace_back(&ThreadPool::workerLoop, this, i);
+#ifdef __linux__
+            if (cpu_affinity)
+            {
+                cpu_set_t cpu_set;
+                CPU_ZERO(&cpu_set);
+                CPU_SET(i % std::max(1U, std::thread::hardware_concurrency()), &cpu_set);
+                pthread_setaffinity_np(workers_.back().native_handle(), sizeof(cpu_set_t), &cpu_set);
+            }
+#endif
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            stop_ = true;
+        }
+        sleep_cv_.notify_all();
+        for (auto &worker : workers_)
+            worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned int size() const
+    {
+        return workers_.size();
+    }
+
+    // tasks submitted from a worker go to its own deque, others are spread round robin
+    void submit(std::function<void()> task)
+    {
+        unsigned int queue_idx = worker_idx_ >= 0 && worker_pool_ == this ? worker_idx_ : next_queue_++ % queues_.size();
+        {
+            std::lock_guard<std::mutex> lock(queues_[queue_idx]->mutex);
+            queues_[queue_idx]->tasks.emplace_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            pending_++;
+        }
+        sleep_cv_.notify_one();
+    }
+
+    // runs f(0) ... f(num - 1) and returns when all are done. The calls form a task group: helpers
+    // on the pool and the calling thread only claim indices of this group, so the caller never
+    // runs unrelated queued tasks (which may take locks it already holds) and it is safe to call
+    // from inside a task. Once no index is left the caller sleeps until the group has finished.
+    void parallelFor(const int num, const std::function<void(int)> &f)
+    {
+        if (num <= 0)
+            return;
+
+        auto group = std::make_shared<TaskGroup>();
+        group->f = &f;
+        group->num = num;
+
+        const int helper_num = std::min<int>(num - 1, workers_.size());
+        for (int i = 0; i < helper_num; i++)
+            submit([group]() { group->run(); });
+
+        group->run();
+
+        std::unique_lock<std::mutex> lock(group->mutex);
+        group->cv.wait(lock, [&group]() { return group->done == group->num; });
+    }
+
+  private:
+    // f is only dereferenced for claimed indices, so helpers that start after parallelFor returned just exit
+    struct TaskGroup
+    {
+        const std::function<void(int)>* f = nullptr;
+        int num = 0;
+        std::atomic<int> next{0};
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        int done = 0;
+
+        void run()
+        {
+            int finished = 0;
+            for (int i = next++; i < num; i = next++)
+            {
+                (*f)(i);
+                finished++;
+            }
+            if (finished == 0)
+                return;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            done += finished;
+            if (done == num)
+                cv.notify_all();
+        }
+    };
+
+    struct WorkQueue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    // own tasks are taken from the back (most recent, cache warm), stolen ones from the front
+    bool popTask(const unsigned int queue_idx, std::function<void()> &task)
+    {
+        for (unsigned int i = 0; i < queues_.size(); i++)
+        {
+            const unsigned int idx = (queue_idx + i) % queues_.size();
+            std::lock_guard<std::mutex> lock(queues_[idx]->mutex);
+            if (queues_[idx]->tasks.empty())
+                continue;
+            if (i == 0)
+            {
+                task = std::move(queues_[idx]->tasks.back());
+                queues_[idx]->tasks.pop_back();
+            }
+            else
+            {
+                task = std::move(queues_[idx]->tasks.front());
+                queues_[idx]->tasks.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    bool runPendingTask()
+    {
+        std::function<void()> task;
+        const unsigned int queue_idx = worker_idx_ >= 0 && worker_pool_ == this ? worker_idx_ : 0;
+        if (!popTask(queue_idx, task))
+            return false;
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            pending_--;
+        }
+        task();
+        return true;
+    }
+
+    void workerLoop(const int idx)
+    {
+        worker_idx_ = idx;
+        worker_pool_ = this;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(sleep_mutex_);
+                sleep_cv_.wait(lock, [this]() { return stop_ || pending_ > 0; });
+                if (stop_)
+                    return;
+            }
+            runPendingTask();
+        }
+    }
+
+    std::vector<std::unique_ptr<WorkQueue>> queues_;
+    std::vector<std::thread> workers_;
+    std::atomic<unsigned int> next_queue_{0};
+
+    std::mutex sleep_mutex_;
+    std::condition_variable sleep_cv_;
+    int pending_ = 0;
+    bool stop_ = false;
+
+    static thread_local int worker_idx_;
+    static thread_local ThreadPool* worker_pool_;
+};
+
+inline thread_local int ThreadPool::worker_idx_ = -1;
+inline thread_local ThreadPool* ThreadPool::worker_pool_ = nullptr;
+
+}
@@ -66,17 +66,17 @@ void registerPub(ros::NodeHandle &n)
     cameraposevisual.setLineWidth(0.01);
 }
 
-void pubLatestOdometry(const Estimator &estimator)
+void pubLatestOdometry(const Estimator &estimator, const State &state, const vector<vector<Eigen::Vector3d>> &tic, const vector<vector<Eigen::Quaterniond>> &ric)
 {
 
-    const double t = estimator.state_hist_.back().t_;
+    const double t = state.t_;
 
-    const Eigen::Vector3d& P = estimator.state_hist_.back().P_lpf_;    
-    const Eigen::Quaterniond &R= estimator.state_hist_.back().Q_lpf_;
-    const Eigen::Vector3d &V = estimator.state_hist_.back().V_lpf_;
+    const Eigen::Vector3d& P = state.P_lpf_;    
+    const Eigen::Quaterniond &R= state.Q_lpf_;
+    const Eigen::Vector3d &V = state.V_lpf_;
 
 
-    const Eigen::Vector3d &omega = estimator.state_hist_.back().un_gyr_;
+    const Eigen::Vector3d &omega = state.un_gyr_;
     
     const Eigen::Matrix3d &center_R_imu = estimator.imu_module_.rcenterimu_;
     const Eigen::Vector3d &center_T_imu = estimator.imu_module_.tcenterimu_;
@@ -131,10 +131,10 @@ void pubLatestOdometry(const Estimator &estimator)
     last_vel = v_center;
     last_omega = omega_center;
 
-    for(unsigned int i = 0; i < estimator.img_trackers_.size(); i++){
+    for(unsigned int i = 0; i < tic.size(); i++){
 
-        Vector3d P_cam = P + R * estimator.img_trackers_[i]->cam_info_.tic_[0];
-        Quaterniond R_cam = Quaterniond(R * estimator.img_trackers_[i]->cam_info_.ric_[0]);
+        Vector3d P_cam = P + R * tic[i][0];
+        Quaterniond R_cam = Quaterniond(R * ric[i][0]);
 
         geometry_msgs::PoseStamped pose_cam;
         pose_cam.header = odometry.header;
@@ -157,8 +157,8 @@ void pubLatestOdometry(const Estimator &estimator)
             cameraposevisual.add_pose(P_cam, R_cam);
             if(estimator.img_trackers_[i]->cam_info_.stereo_)
             {
-                Vector3d P1 = P + R * estimator.img_trackers_[i]->cam_info_.tic_[1];
-                Quaterniond R1 = R * estimator.img_trackers_[i]->cam_info_.ric_[1];
+                Vector3d P1 = P + R * tic[i][1];
+                Quaterniond R1 = R * ric[i][1];
                 cameraposevisual.add_pose(P1, R1);
             }
             cameraposevisual.publish_by(pub_camera_pose_visual[i], odometry.header);
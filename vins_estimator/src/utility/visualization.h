@@ -34,7 +34,7 @@ namespace vins_multi{
 
 void registerPub(ros::NodeHandle &n);
 
-void pubLatestOdometry(const Estimator &estimator);
+void pubLatestOdometry(const Estimator &estimator, const State &state, const vector<vector<Eigen::Vector3d>> &tic, const vector<vector<Eigen::Quaterniond>> &ric);
 
 void pubTrackImage(const cv::Mat &imgTrack, const double t, const unsigned int cam_unique_id);
 